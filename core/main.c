@@ -14,81 +14,256 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+enum {
+	/*
+	 * While the io workqueues are full, gw_ring_submit() leaves the
+	 * SQEs in the SQ and fails with -EBUSY. The main loop then polls
+	 * the ring less often: it backs off for SUBMIT_BUSY_MIN_NS,
+	 * doubling up to SUBMIT_BUSY_MAX_NS until a submission goes
+	 * through.
+	 */
+	SUBMIT_BUSY_MIN_NS = 100000,
+	SUBMIT_BUSY_MAX_NS = 16000000,
+};
+
+static int submit_sqes(struct tg_bot_ctx *ctx)
+{
+	int ret = gw_ring_submit(&ctx->ring);
 
-static void arm_update_sqe(struct tg_bot_ctx *ctx)
+	if (likely(ret != -EBUSY)) {
+		ctx->submit_busy_ns = 0;
+		return ret;
+	}
+
+	if (!ctx->submit_busy_ns)
+		ctx->submit_busy_ns = SUBMIT_BUSY_MIN_NS;
+	else if (ctx->submit_busy_ns < SUBMIT_BUSY_MAX_NS)
+		ctx->submit_busy_ns *= 2u;
+
+	return ret;
+}
+
+/*
+ * Make room in a full SQ. If the ring runs with an SQ thread, it only
+ * frees up once the SQ thread has caught up. Without one, it may not
+ * free up at all until the io workers have made room.
+ */
+static void flush_full_sq(struct tg_bot_ctx *ctx)
+{
+	struct timespec ts = { 0, 0 };
+
+	if (submit_sqes(ctx) != -EBUSY) {
+		sched_yield();
+		return;
+	}
+
+	ts.tv_nsec = (long)ctx->submit_busy_ns;
+	nanosleep(&ts, NULL);
+}
+
+static struct gw_ring_sqe *get_sqe(struct tg_bot_ctx *ctx)
 {
 	struct gw_ring_sqe *sqe;
 
-	sqe = gw_ring_get_sqe(&ctx->ring);
-	if (unlikely(!sqe)) {
-		gw_ring_submit(&ctx->ring);
+	while (1) {
 		sqe = gw_ring_get_sqe(&ctx->ring);
+		if (likely(sqe))
+			return sqe;
+
+		flush_full_sq(ctx);
 	}
+}
+
+/*
+ * The getUpdates SQE is multishot: it keeps polling in the io worker
+ * and posts a CQE for every batch, so it only has to be armed again
+ * after it has failed.
+ */
+static void arm_update_sqe(struct tg_bot_ctx *ctx)
+{
+	struct gw_ring_sqe *sqe = get_sqe(ctx);
 
-	ctx->updates = NULL;
-	gw_ring_prep_tg_get_updates(sqe, &ctx->tctx, &ctx->updates,
-				    ctx->max_update_id + 1);
+	gw_ring_prep_tg_get_updates_multishot(sqe, &ctx->tctx,
+					      ctx->max_update_id + 1);
 	sqe->user_data = TG_API_GET_UPDATES;
 }
 
-static int prep_update_handle(struct tg_bot_ctx *ctx, struct tg_update *up)
+/*
+ * Back off for a while after a failed getUpdates call instead of
+ * hammering the API. The next getUpdates SQE is armed when the timeout
+ * CQE arrives.
+ */
+static void arm_update_retry_timeout(struct tg_bot_ctx *ctx)
 {
-	struct gw_ring_sqe *sqe;
+	static const struct timespec ts = { .tv_sec = 1 };
+	struct gw_ring_sqe *sqe = get_sqe(ctx);
 
-	sqe = gw_ring_get_sqe(&ctx->ring);
-	if (unlikely(!sqe)) {
-		gw_ring_submit(&ctx->ring);
-		sqe = gw_ring_get_sqe(&ctx->ring);
+	gw_ring_prep_timeout(sqe, &ts, 0);
+	sqe->user_data = TG_API_GET_UPDATES;
+}
+
+enum {
+	/*
+	 * Under load, wait for this many CQEs before waking up, but no
+	 * longer than CQE_BATCH_WAIT_NS so that a quiet period doesn't
+	 * hold back the few CQEs that are already in.
+	 */
+	CQE_BATCH = 32,
+	CQE_BATCH_WAIT_NS = 1000000,
+};
+
+enum {
+	/*
+	 * The Telegram getUpdates API returns at most 100 updates per
+	 * call, so one reservation normally covers the whole batch.
+	 */
+	UPDATE_SQE_BATCH = 128,
+};
+
+/*
+ * Check whether the command at the start of @text (up to the first
+ * space or '@') is in the comma separated @list.
+ */
+static bool is_prio_command(const char *list, const char *text)
+{
+	size_t len;
+	size_t n;
+
+	if (text[0] != '/')
+		return false;
+
+	len = strcspn(text, " @\n");
+	while (*list) {
+		n = strcspn(list, ",");
+		if (n == len && !memcmp(list, text, len))
+			return true;
+
+		list += n;
+		if (*list == ',')
+			list++;
 	}
 
-	gw_ring_prep_tg_module_handle(sqe, ctx, up);
-	sqe->user_data = 0;
-	return 0;
+	return false;
 }
 
-static int process_tg_api_update(struct tg_bot_ctx *ctx, struct tg_update *up)
+static uint8_t get_update_prio(struct tg_bot_ctx *ctx, struct tg_update *up)
+{
+	struct tg_message *msg = &up->message;
+	size_t i;
+
+	if (up->type != TG_UPDATE_MESSAGE)
+		return WQ_PRIO_NORMAL;
+
+	if (msg->chat) {
+		for (i = 0; i < ctx->nr_prio_chats; i++) {
+			if (ctx->prio_chats[i] == msg->chat->id)
+				return WQ_PRIO_HIGH;
+		}
+	}
+
+	if (ctx->prio_commands && (msg->type & TG_MSG_TEXT) && msg->text &&
+	    is_prio_command(ctx->prio_commands, msg->text))
+		return WQ_PRIO_HIGH;
+
+	return WQ_PRIO_NORMAL;
+}
+
+/*
+ * The updates of a chat are handled one at a time, in order, so that
+ * the modules don't need their own locking for per-chat state. A high
+ * priority update pulls the updates queued before it in its chat up
+ * to its priority.
+ */
+static void prep_update_handle(struct tg_bot_ctx *ctx, struct tg_update *up,
+			       struct gw_ring_sqe *sqe)
+{
+	struct tg_message *msg = &up->message;
+
+	if (up->type == TG_UPDATE_MESSAGE && msg->chat)
+		gw_ring_prep_tg_module_handle_keyed(sqe, ctx, up,
+						    (uint64_t)msg->chat->id);
+	else
+		gw_ring_prep_tg_module_handle(sqe, ctx, up);
+	sqe->user_data = up->update_id;
+	sqe->prio = get_update_prio(ctx, up);
+}
+
+static void process_tg_api_update(struct tg_bot_ctx *ctx, struct tg_update *up,
+				  struct gw_ring_sqe *sqe)
 {
 	tgapi_inc_ref_update(up);
-	return prep_update_handle(ctx, up);
+	prep_update_handle(ctx, up, sqe);
 }
 
-static int process_tg_api_updates(struct tg_bot_ctx *ctx, int res)
+static void process_tg_api_update_batch(struct tg_bot_ctx *ctx,
+					struct tg_updates *updates)
 {
+	struct gw_ring_sqe *sqes[UPDATE_SQE_BATCH];
 	struct tg_update *update;
-	uint32_t i;
+	size_t len = updates->len;
+	uint32_t nr;
+	uint32_t j;
+	size_t i;
+
+	for (i = 0; i < len; i += nr) {
+		nr = UPDATE_SQE_BATCH;
+		if (len - i < nr)
+			nr = (uint32_t)(len - i);
+
+		nr = gw_ring_get_sqes(&ctx->ring, nr, sqes);
+		if (unlikely(!nr)) {
+			flush_full_sq(ctx);
+			continue;
+		}
+
+		for (j = 0; j < nr; j++) {
+			update = &updates->updates[i + j];
+			if ((int64_t)update->update_id > ctx->max_update_id)
+				ctx->max_update_id = update->update_id;
+			process_tg_api_update(ctx, update, sqes[j]);
+		}
+	}
+}
+
+static int process_tg_api_updates(struct tg_bot_ctx *ctx,
+				  struct gw_ring_cqe *cqe)
+{
+	struct tg_updates *updates = cqe->data;
+	int res = (int)cqe->res;
 
 	if (unlikely(res < 0)) {
 		fprintf(stderr, "Failed to get updates: %s\n", strerror(-res));
-		res = 0;
-		goto out;
+		arm_update_retry_timeout(ctx);
+		return 0;
 	}
 
-	if (unlikely(!ctx->updates))
-		goto out;
-
-	if (ctx->updates->len)
-		printf("Got new %zu update(s)\n", ctx->updates->len);
-
-	for (i = 0; i < ctx->updates->len; i++) {
-		update = &ctx->updates->updates[i];
-		if ((int64_t)update->update_id > ctx->max_update_id)
-			ctx->max_update_id = update->update_id;
-		process_tg_api_update(ctx, update);
+	if (likely(updates)) {
+		printf("Got new %zu update(s)\n", updates->len);
+		process_tg_api_update_batch(ctx, updates);
 	}
 
-out:
-	arm_update_sqe(ctx);
+	/*
+	 * The module handle SQEs are submitted together by the next
+	 * gw_ring_submit() call in run_tg_bot_loop(), which punts them
+	 * to the io workqueue in one batch.
+	 */
+	if (unlikely(!(cqe->flags & GW_RING_CQE_F_MORE)))
+		arm_update_sqe(ctx);
+
 	return res;
 }
 
 static int process_tg_api_cqe(struct tg_bot_ctx *ctx, struct gw_ring_cqe *cqe)
 {
-	int res = (int)cqe->res;
 	int ret = 0;
 
 	switch (cqe->user_data) {
 	case TG_API_GET_UPDATES:
-		ret = process_tg_api_updates(ctx, res);
+		ret = process_tg_api_updates(ctx, cqe);
 		break;
 	}
 
@@ -105,6 +280,10 @@ static int process_cqe(struct tg_bot_ctx *ctx, struct gw_ring_cqe *cqe)
 	case GW_RING_OP_TG_API_CALL:
 		ret = process_tg_api_cqe(ctx, cqe);
 		break;
+	case GW_RING_OP_TIMEOUT:
+		if (cqe->user_data == TG_API_GET_UPDATES)
+			arm_update_sqe(ctx);
+		break;
 	}
 
 	return ret;
@@ -112,18 +291,38 @@ static int process_cqe(struct tg_bot_ctx *ctx, struct gw_ring_cqe *cqe)
 
 static int run_tg_bot_loop(struct tg_bot_ctx *ctx)
 {
+	static const struct timespec batch_ts = { .tv_nsec = CQE_BATCH_WAIT_NS };
+	struct timespec busy_ts = { 0, 0 };
 	struct gw_ring_cqe *cqe;
 	uint32_t head;
 	uint32_t i;
 	int ret;
 
-	ret = gw_ring_submit(&ctx->ring);
-	if (unlikely(ret < 0)) {
+	ret = submit_sqes(ctx);
+	if (unlikely(ret < 0 && ret != -EBUSY)) {
 		fprintf(stderr, "Failed to submit sqe: %s\n", strerror(-ret));
 		return ret;
 	}
 
-	ret = gw_ring_wait_cqe(&ctx->ring, &cqe);
+	if (unlikely(ret == -EBUSY)) {
+		/*
+		 * The SQEs are still in the SQ. Completions make room
+		 * for them, but don't wait for one longer than the
+		 * back off.
+		 */
+		busy_ts.tv_nsec = (long)ctx->submit_busy_ns;
+		ret = gw_ring_wait_cqe_timeout(&ctx->ring, &cqe, &busy_ts);
+		if (ret == -ETIME)
+			return 0;
+	} else {
+		/*
+		 * Only block without a timeout once the batch wait has
+		 * found the CQ empty, i.e., when the bot is idle.
+		 */
+		ret = gw_ring_wait_cqes(&ctx->ring, &cqe, CQE_BATCH, &batch_ts);
+		if (ret == -ETIME)
+			ret = gw_ring_wait_cqe(&ctx->ring, &cqe);
+	}
 	if (unlikely(ret < 0)) {
 		fprintf(stderr, "Failed to wait cqe: %s\n", strerror(-ret));
 		return ret;
@@ -162,9 +361,57 @@ static int run_tg_bot(struct tg_bot_ctx *ctx)
 	return ret;
 }
 
+/*
+ * GNUWEEB_PRIO_CHATS is a comma separated list of chat IDs, e.g.
+ * "-1001234567890,42". GNUWEEB_PRIO_COMMANDS is a comma separated
+ * list of commands, e.g. "/ban,/kick".
+ */
+static int parse_prio_config(struct tg_bot_ctx *ctx)
+{
+	const char *chats = getenv("GNUWEEB_PRIO_CHATS");
+	const char *p;
+	char *end;
+	size_t nr;
+
+	ctx->prio_commands = getenv("GNUWEEB_PRIO_COMMANDS");
+	if (!chats || !*chats)
+		return 0;
+
+	nr = 1;
+	for (p = chats; *p; p++) {
+		if (*p == ',')
+			nr++;
+	}
+
+	ctx->prio_chats = calloc(nr, sizeof(*ctx->prio_chats));
+	if (!ctx->prio_chats)
+		return -ENOMEM;
+
+	p = chats;
+	while (1) {
+		errno = 0;
+		ctx->prio_chats[ctx->nr_prio_chats++] = strtoll(p, &end, 10);
+		if (errno || end == p || (*end && *end != ','))
+			goto out_inval;
+
+		if (!*end)
+			break;
+		p = end + 1;
+	}
+
+	return 0;
+
+out_inval:
+	free(ctx->prio_chats);
+	ctx->prio_chats = NULL;
+	ctx->nr_prio_chats = 0;
+	return -EINVAL;
+}
+
 int main(void)
 {
 	struct tg_bot_ctx ctx;
+	uint32_t ring_flags;
 	int ret;
 
 	memset(&ctx, 0, sizeof(ctx));
@@ -175,9 +422,16 @@ int main(void)
 		return 1;
 	}
 
+	ret = parse_prio_config(&ctx);
+	if (ret) {
+		fprintf(stderr, "Invalid GNUWEEB_PRIO_CHATS: %s\n", strerror(-ret));
+		return 1;
+	}
+
 	ret = gw_curl_global_init(0);
 	if (ret) {
 		fprintf(stderr, "Failed to init curl: %s\n", strerror(-ret));
+		free(ctx.prio_chats);
 		return 1;
 	}
 
@@ -187,7 +441,21 @@ int main(void)
 		goto out;
 	}
 
-	ret = gw_ring_init(&ctx.ring, 8192);
+	/*
+	 * The SQ thread polls for new SQEs, which only pays off with a
+	 * spare CPU.
+	 */
+	ring_flags = 0;
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		ring_flags |= GW_RING_SETUP_F_SQPOLL;
+
+	/*
+	 * Keep each io worker, and the memory it touches, on one node.
+	 */
+	if (workqueue_nr_nodes() > 1)
+		ring_flags |= GW_RING_SETUP_F_NUMA;
+
+	ret = gw_ring_init_flags(&ctx.ring, 8192, ring_flags);
 	if (ret) {
 		fprintf(stderr, "Failed to init ring: %s\n", strerror(-ret));
 		goto out;
@@ -204,5 +472,6 @@ out:
 		ret = -ret;
 
 	gw_curl_global_cleanup();
+	free(ctx.prio_chats);
 	return ret;
 }
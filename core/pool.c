@@ -0,0 +1,429 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2023  Ammar Faizi <ammarfaizi2@gnuweeb.org>
+ *
+ * Fixed-size object pool. The objects live in a single slab and the
+ * free ones are kept in a lock-free stack of slab indexes.
+ *
+ * Freeing pushes the object on the shared stack with one CAS. A thread
+ * that allocates owns a private list of free objects (its cache), so
+ * the common allocation doesn't touch any shared cache line. When the
+ * cache runs dry, the thread takes the whole shared stack with a single
+ * exchange. Since nothing ever pops a single entry off the shared
+ * stack, there is no ABA problem to deal with.
+ *
+ * This fits the ring, where one thread allocates and many workers free,
+ * without stranding objects in the caches of threads that only free.
+ * When the slab is exhausted, the pool falls back to malloc().
+ *
+ * A thread has a small table of caches, one per pool it allocates
+ * from. When the table is full, the thread gives the cache of another
+ * pool back to make room. On exit, it gives all of them back to the
+ * pools that are still alive.
+ */
+
+#include <gw/common.h>
+#include <gw/pool.h>
+#include <stdatomic.h>
+#include <gw/thread.h>
+#include <stdalign.h>
+#include <stdlib.h>
+
+#define GW_POOL_NR_CACHES	8u
+#define GW_POOL_NIL		UINT32_MAX
+
+/*
+ * How many frees a thread counts locally before adding them to the
+ * pool's statistics.
+ */
+#define GW_POOL_STATS_BATCH	64u
+
+struct gw_pool {
+	_Atomic(uint32_t)	head;
+	uint32_t		nr_objs;
+	size_t			obj_size;
+	char			*slab;
+	uint64_t		id;
+	struct gw_pool		*next;
+
+	_Atomic(uint64_t)	nr_alloc;
+	_Atomic(uint64_t)	nr_free;
+	_Atomic(uint64_t)	nr_refill;
+	_Atomic(uint64_t)	nr_fallback;
+};
+
+/*
+ * A cache belongs to @pool as long as @pool_id matches, so that a new
+ * pool at the address of a destroyed one doesn't get its stale cache.
+ */
+struct gw_pool_cache {
+	struct gw_pool		*pool;
+	uint64_t		pool_id;
+	uint32_t		head;
+	uint32_t		nr_alloc;
+	uint32_t		nr_free;
+};
+
+static _Atomic(uint64_t) gw_pool_next_id = 1;
+static __thread struct gw_pool_cache gw_pool_caches[GW_POOL_NR_CACHES];
+static __thread uint32_t gw_pool_cache_victim;
+static __thread bool gw_pool_cache_registered;
+
+/*
+ * Live pools, so that a thread can tell which of its caches still
+ * belong to a pool.
+ */
+static thread_once_t gw_pool_list_once = THREAD_ONCE_INIT;
+static mutex_t gw_pool_list_lock;
+static int gw_pool_list_lock_err;
+static struct gw_pool *gw_pool_list;
+
+static inline void *pool_obj(struct gw_pool *pool, uint32_t idx)
+{
+	return pool->slab + (size_t)idx * pool->obj_size;
+}
+
+static inline uint32_t pool_idx(struct gw_pool *pool, void *obj)
+{
+	return (uint32_t)(((char *)obj - pool->slab) / pool->obj_size);
+}
+
+/*
+ * A free object stores the index of the next free object in its first
+ * bytes.
+ */
+static inline _Atomic(uint32_t) *pool_next(struct gw_pool *pool, uint32_t idx)
+{
+	return (_Atomic(uint32_t) *)pool_obj(pool, idx);
+}
+
+static inline bool pool_owns(struct gw_pool *pool, void *obj)
+{
+	char *p = obj;
+
+	return p >= pool->slab &&
+	       p < pool->slab + (size_t)pool->nr_objs * pool->obj_size;
+}
+
+/*
+ * Push the list @first..@last on the shared stack with a single CAS.
+ */
+static void pool_push(struct gw_pool *pool, uint32_t first, uint32_t last)
+{
+	uint32_t old = atomic_load_explicit(&pool->head, memory_order_relaxed);
+
+	do {
+		atomic_store_explicit(pool_next(pool, last), old,
+				      memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&pool->head, &old,
+							first,
+							memory_order_release,
+							memory_order_relaxed));
+}
+
+static void flush_cache_stats(struct gw_pool *pool, struct gw_pool_cache *c)
+{
+	if (c->nr_alloc) {
+		atomic_fetch_add_explicit(&pool->nr_alloc, c->nr_alloc,
+					  memory_order_relaxed);
+		c->nr_alloc = 0;
+	}
+
+	if (c->nr_free) {
+		atomic_fetch_add_explicit(&pool->nr_free, c->nr_free,
+					  memory_order_relaxed);
+		c->nr_free = 0;
+	}
+}
+
+static void put_cache(struct gw_pool *pool, struct gw_pool_cache *c)
+{
+	uint32_t last = c->head;
+	uint32_t next;
+
+	if (last == GW_POOL_NIL)
+		return;
+
+	while (1) {
+		next = atomic_load_explicit(pool_next(pool, last),
+					    memory_order_relaxed);
+		if (next == GW_POOL_NIL)
+			break;
+		last = next;
+	}
+
+	pool_push(pool, c->head, last);
+	c->head = GW_POOL_NIL;
+}
+
+/*
+ * The pool @c belongs to, or NULL if it has been destroyed.
+ */
+static struct gw_pool *cache_pool(struct gw_pool_cache *c)
+	__must_hold(&gw_pool_list_lock)
+{
+	struct gw_pool *pool;
+
+	for (pool = gw_pool_list; pool; pool = pool->next) {
+		if (pool == c->pool && pool->id == c->pool_id)
+			return pool;
+	}
+
+	return NULL;
+}
+
+/*
+ * Give @c back to its pool if that is still alive, and free the slot.
+ */
+static void release_cache(struct gw_pool_cache *c)
+	__must_hold(&gw_pool_list_lock)
+{
+	struct gw_pool *pool;
+
+	if (!c->pool_id)
+		return;
+
+	pool = cache_pool(c);
+	if (pool) {
+		put_cache(pool, c);
+		flush_cache_stats(pool, c);
+	}
+
+	c->pool = NULL;
+	c->pool_id = 0;
+}
+
+static void pool_thread_exit(void *arg)
+{
+	uint32_t i;
+
+	(void)arg;
+	mutex_lock(&gw_pool_list_lock);
+	for (i = 0; i < GW_POOL_NR_CACHES; i++)
+		release_cache(&gw_pool_caches[i]);
+	mutex_unlock(&gw_pool_list_lock);
+}
+
+static void pool_list_lock_init(void)
+{
+	gw_pool_list_lock_err = mutex_init(&gw_pool_list_lock);
+}
+
+int gw_pool_init(struct gw_pool **pool_p, size_t obj_size, uint32_t nr_objs)
+{
+	struct gw_pool *pool;
+	uint32_t i;
+
+	if (!nr_objs || nr_objs == GW_POOL_NIL)
+		return -EINVAL;
+
+	thread_once(&gw_pool_list_once, &pool_list_lock_init);
+	if (unlikely(gw_pool_list_lock_err))
+		return gw_pool_list_lock_err;
+
+	pool = calloc(1u, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	if (obj_size < sizeof(uint32_t))
+		obj_size = sizeof(uint32_t);
+
+	obj_size = (obj_size + alignof(max_align_t) - 1u) &
+		   ~(alignof(max_align_t) - 1u);
+
+	pool->slab = malloc(obj_size * nr_objs);
+	if (!pool->slab) {
+		free(pool);
+		return -ENOMEM;
+	}
+
+	pool->id = atomic_fetch_add(&gw_pool_next_id, 1u);
+	pool->obj_size = obj_size;
+	pool->nr_objs = nr_objs;
+	for (i = 0; i + 1u < nr_objs; i++)
+		atomic_init(pool_next(pool, i), i + 1u);
+	atomic_init(pool_next(pool, nr_objs - 1u), GW_POOL_NIL);
+	atomic_init(&pool->head, 0u);
+
+	mutex_lock(&gw_pool_list_lock);
+	pool->next = gw_pool_list;
+	gw_pool_list = pool;
+	mutex_unlock(&gw_pool_list_lock);
+
+	*pool_p = pool;
+	return 0;
+}
+
+/*
+ * All objects must have been freed. Stale per-thread caches are
+ * recognized by the pool id and never touched again.
+ */
+void gw_pool_destroy(struct gw_pool *pool)
+{
+	struct gw_pool **pp;
+
+	mutex_lock(&gw_pool_list_lock);
+	for (pp = &gw_pool_list; *pp; pp = &(*pp)->next) {
+		if (*pp == pool) {
+			*pp = pool->next;
+			break;
+		}
+	}
+	mutex_unlock(&gw_pool_list_lock);
+
+	free(pool->slab);
+	free(pool);
+}
+
+static inline struct gw_pool_cache *find_cache(struct gw_pool *pool)
+{
+	struct gw_pool_cache *c;
+	uint32_t i;
+
+	for (i = 0; i < GW_POOL_NR_CACHES; i++) {
+		c = &gw_pool_caches[i];
+		if (likely(c->pool == pool && c->pool_id == pool->id))
+			return c;
+	}
+
+	return NULL;
+}
+
+/*
+ * Take a slot for @pool. The slots of destroyed pools are reused
+ * first, otherwise the cache of another pool is given back.
+ */
+static __no_inline struct gw_pool_cache *take_cache(struct gw_pool *pool)
+{
+	struct gw_pool_cache *c;
+	uint32_t i;
+
+	if (unlikely(!gw_pool_cache_registered)) {
+		if (!thread_at_exit(&pool_thread_exit, NULL))
+			gw_pool_cache_registered = true;
+	}
+
+	mutex_lock(&gw_pool_list_lock);
+	for (i = 0; i < GW_POOL_NR_CACHES; i++) {
+		c = &gw_pool_caches[i];
+		if (!c->pool_id || !cache_pool(c))
+			goto out;
+	}
+
+	c = &gw_pool_caches[gw_pool_cache_victim++ % GW_POOL_NR_CACHES];
+	release_cache(c);
+out:
+	mutex_unlock(&gw_pool_list_lock);
+
+	c->pool = pool;
+	c->pool_id = pool->id;
+	c->head = GW_POOL_NIL;
+	c->nr_alloc = 0;
+	c->nr_free = 0;
+	return c;
+}
+
+static inline struct gw_pool_cache *get_cache(struct gw_pool *pool)
+{
+	struct gw_pool_cache *c = find_cache(pool);
+
+	if (unlikely(!c))
+		c = take_cache(pool);
+
+	return c;
+}
+
+static __no_inline void *pool_alloc_slow(struct gw_pool *pool,
+					 struct gw_pool_cache *c)
+{
+	uint32_t idx;
+	void *obj;
+
+	flush_cache_stats(pool, c);
+	idx = atomic_exchange_explicit(&pool->head, GW_POOL_NIL,
+				       memory_order_acquire);
+	if (likely(idx != GW_POOL_NIL)) {
+		atomic_fetch_add_explicit(&pool->nr_refill, 1u,
+					  memory_order_relaxed);
+		c->head = atomic_load_explicit(pool_next(pool, idx),
+					       memory_order_relaxed);
+		c->nr_alloc++;
+		return pool_obj(pool, idx);
+	}
+
+	obj = malloc(pool->obj_size);
+	if (unlikely(!obj))
+		return NULL;
+
+	atomic_fetch_add_explicit(&pool->nr_fallback, 1u, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pool->nr_alloc, 1u, memory_order_relaxed);
+	return obj;
+}
+
+void *gw_pool_alloc(struct gw_pool *pool)
+{
+	struct gw_pool_cache *c = get_cache(pool);
+	uint32_t idx = c->head;
+
+	if (likely(idx != GW_POOL_NIL)) {
+		c->head = atomic_load_explicit(pool_next(pool, idx),
+					       memory_order_relaxed);
+		c->nr_alloc++;
+		return pool_obj(pool, idx);
+	}
+
+	return pool_alloc_slow(pool, c);
+}
+
+void gw_pool_free(struct gw_pool *pool, void *obj)
+{
+	struct gw_pool_cache *c;
+	uint32_t idx;
+
+	if (unlikely(!pool_owns(pool, obj))) {
+		atomic_fetch_add_explicit(&pool->nr_free, 1u,
+					  memory_order_relaxed);
+		free(obj);
+		return;
+	}
+
+	idx = pool_idx(pool, obj);
+	pool_push(pool, idx, idx);
+
+	/*
+	 * Don't take a cache slot just to count a free.
+	 */
+	c = find_cache(pool);
+	if (unlikely(!c)) {
+		atomic_fetch_add_explicit(&pool->nr_free, 1u,
+					  memory_order_relaxed);
+		return;
+	}
+
+	if (unlikely(++c->nr_free >= GW_POOL_STATS_BATCH))
+		flush_cache_stats(pool, c);
+}
+
+/*
+ * Only the counters of the calling thread are folded in, the other
+ * threads' ones show up within GW_POOL_STATS_BATCH frees or at their
+ * next refill.
+ */
+void gw_pool_get_stats(struct gw_pool *pool, struct gw_pool_stats *stats)
+{
+	struct gw_pool_cache *c;
+
+	c = find_cache(pool);
+	if (c)
+		flush_cache_stats(pool, c);
+
+	stats->nr_objs = pool->nr_objs;
+	stats->nr_alloc = atomic_load_explicit(&pool->nr_alloc,
+					       memory_order_relaxed);
+	stats->nr_free = atomic_load_explicit(&pool->nr_free,
+					      memory_order_relaxed);
+	stats->nr_refill = atomic_load_explicit(&pool->nr_refill,
+						memory_order_relaxed);
+	stats->nr_fallback = atomic_load_explicit(&pool->nr_fallback,
+						  memory_order_relaxed);
+}
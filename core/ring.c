@@ -6,311 +6,2232 @@
 #include <gw/module.h>
 #include <gw/common.h>
 #include <gw/ring.h>
+#include <gw/lib/curl.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <stdio.h>
+#include <time.h>
+
+#ifdef CONFIG_USDT
+#include <sys/sdt.h>
+#define trace_ring_submit(ring, sqe)					\
+	DTRACE_PROBE3(gw_ring, submit, ring, (sqe)->op, (sqe)->user_data)
+#define trace_ring_dispatch(ring, sqe)					\
+	DTRACE_PROBE3(gw_ring, dispatch, ring, (sqe)->op, (sqe)->user_data)
+#define trace_ring_complete(ring, cqe)					\
+	DTRACE_PROBE4(gw_ring, complete, ring, (cqe)->op, (cqe)->user_data, \
+		      (cqe)->res)
+#else
+#define trace_ring_submit(ring, sqe)	do { } while (0)
+#define trace_ring_dispatch(ring, sqe)	do { } while (0)
+#define trace_ring_complete(ring, cqe)	do { } while (0)
+#endif
+
+enum {
+	/*
+	 * Maximum number of SQEs handed to the io workqueue with a single
+	 * queue_work_batch() call. Big enough for a full getUpdates batch.
+	 */
+	GW_RING_PUNT_BATCH = 128,
+
+	GW_RING_CANCEL_HASH_BITS = 6,
+	GW_RING_CANCEL_HASH_SIZE = 1u << GW_RING_CANCEL_HASH_BITS,
+
+	/*
+	 * The last shard is shared by the threads that didn't get one
+	 * of their own.
+	 */
+	GW_RING_STATS_NR_SHARDS = 32,
+	GW_RING_STATS_SHARED = GW_RING_STATS_NR_SHARDS - 1,
+
+	GW_RING_WQ_MAX_THREADS = 1024,
+	GW_RING_WQ_MIN_THREADS = 32,
+	GW_RING_WQ_MAX_PENDING = 4096,
+};
+
+/*
+ * How long the SQ thread keeps polling for new SQEs before it parks.
+ */
+#define GW_RING_SQ_THREAD_IDLE_NS	(2ull * 1000ull * 1000ull)
+
+/*
+ * While the io workqueues are full, the SQ thread sleeps between two
+ * submission attempts, doubling the sleep up to the max.
+ */
+#define GW_RING_SQ_BUSY_MIN_NS		(50u * 1000u)
+#define GW_RING_SQ_BUSY_MAX_NS		(2u * 1000u * 1000u)
+
+/*
+ * Default cap on how long gw_ring_wait_cqe() spins before it sleeps,
+ * used when there is more than one CPU to spin on.
+ */
+#define GW_RING_WAIT_MAX_SPIN_NS	(20u * 1000u)
+
+enum {
+	CANCEL_QUEUED = 0,
+	CANCEL_RUNNING = 1,
+	CANCEL_CANCELLED = 2,
+};
+
+/*
+ * Tracks a punted SQE or a pending timeout in the cancel hash until it
+ * starts. Whoever moves @state out of CANCEL_QUEUED owns the request:
+ * the worker or the timer thread by moving it to CANCEL_RUNNING, or
+ * GW_RING_OP_ASYNC_CANCEL by moving it to CANCEL_CANCELLED.
+ */
+struct cancel_node {
+	struct cancel_node	*next;
+	struct cancel_node	**pprev;
+	uint64_t		user_data;
+	uint8_t			op;
+	_Atomic(uint32_t)	state;
+	_Atomic(bool)		cancel_requested;
+};
+
+struct gw_ring_cancel_bucket {
+	mutex_t			lock;
+	struct cancel_node	*head;
+};
+
+struct gw_ring_overflow_cqe {
+	struct gw_ring_overflow_cqe	*next;
+	struct gw_ring_cqe		cqe;
+};
+
+/*
+ * An SQE that is part of a link chain and waits for the SQE before it
+ * to complete successfully.
+ */
+struct link_data {
+	struct link_data	*next;
+	struct gw_ring_sqe	sqe;
+};
 
 struct wq_sqe_data {
 	struct gw_ring		*ring;
+	struct link_data	*link;
+	uint64_t		punt_ns;
+	struct cancel_node	cnode;
+	struct gw_ring_sqe	sqe;
+};
+
+struct timeout_data {
+	struct gw_timer		timer;
+	struct gw_ring		*ring;
+	struct link_data	*link;
+	struct cancel_node	cnode;
 	struct gw_ring_sqe	sqe;
 };
 
+/*
+ * Nobody waits for room in the io workqueues: that room is only made
+ * by the workers, which issue SQEs too. The SQEs that find none get a
+ * CQE with -EBUSY, or, with in_sq, are left in the SQ when nothing
+ * after them has been consumed for good, see flush_punt_batch().
+ *
+ * pos[] is the SQ position of each SQE, sq_pos the one of the SQE
+ * being issued, and direct_end the position right after the last SQE
+ * consumed without going through the batch. busy is set once an SQE
+ * has found no room, and sq_restart is where the SQ consumer starts
+ * over if nr_left SQEs are left in the SQ.
+ */
+struct punt_batch {
+	uint32_t		nr;
+	uint32_t		nr_failed;
+	bool			in_sq;
+	bool			busy;
+	bool			punted;
+	uint32_t		sq_pos;
+	uint32_t		direct_end;
+	uint32_t		sq_restart;
+	uint32_t		nr_left;
+	struct gw_ring_sqe	*sqes[GW_RING_PUNT_BATCH];
+	struct link_data	*links[GW_RING_PUNT_BATCH];
+	uint32_t		pos[GW_RING_PUNT_BATCH];
+};
+
 static void gw_ring_wq_sqe_exec(void *data);
 static void gw_ring_wq_sqe_delete(void *data);
-static bool punt_to_io_wq(struct gw_ring *ring, struct gw_ring_sqe *sqe);
+static bool punt_to_io_wq(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+			  struct link_data *link, struct punt_batch *pb);
+static uint32_t flush_punt_batch(struct gw_ring *ring, struct punt_batch *pb);
+static void gw_ring_timeout_drop(struct gw_timer *t);
+static void *gw_ring_sq_thread(void *arg);
 
-int gw_ring_init(struct gw_ring *ring, uint32_t size)
+struct ring_op_counters {
+	_Atomic(uint64_t)	nr_submitted;
+	_Atomic(uint64_t)	nr_completed;
+	_Atomic(uint64_t)	nr_punted;
+	_Atomic(uint64_t)	queue_lat[GW_RING_LAT_NR_BUCKETS];
+	_Atomic(uint64_t)	run_lat[GW_RING_LAT_NR_BUCKETS];
+};
+
+struct gw_ring_stats_shard {
+	struct ring_op_counters	ops[GW_RING_NR_OPS];
+} __cacheline_aligned;
+
+static __thread struct cancel_node *current_cnode;
+static __thread uint32_t current_stats_shard = UINT32_MAX;
+
+/*
+ * Every thread that touches a ring gets a shard index of its own, the
+ * same in all rings, and hands it back when it exits. A thread that
+ * owns its shard updates it without atomic read-modify-write.
+ */
+static thread_once_t stats_shard_once = THREAD_ONCE_INIT;
+static mutex_t stats_shard_lock;
+static int stats_shard_lock_err;
+static uint32_t stats_shard_used[GW_RING_STATS_SHARED];
+
+static void stats_shard_lock_init(void)
+{
+	stats_shard_lock_err = mutex_init(&stats_shard_lock);
+}
+
+static void stats_shard_thread_exit(void *arg)
+{
+	uint32_t shard = (uint32_t)(uintptr_t)arg;
+
+	mutex_lock(&stats_shard_lock);
+	stats_shard_used[shard] = 0;
+	mutex_unlock(&stats_shard_lock);
+}
+
+static __attribute__((__noinline__)) uint32_t get_stats_shard(void)
+{
+	uint32_t shard = GW_RING_STATS_SHARED;
+	uint32_t i;
+
+	thread_once(&stats_shard_once, &stats_shard_lock_init);
+	if (unlikely(stats_shard_lock_err))
+		goto out;
+
+	mutex_lock(&stats_shard_lock);
+	for (i = 0; i < GW_RING_STATS_SHARED; i++) {
+		if (!stats_shard_used[i]) {
+			stats_shard_used[i] = 1;
+			shard = i;
+			break;
+		}
+	}
+	mutex_unlock(&stats_shard_lock);
+
+	if (shard < GW_RING_STATS_SHARED &&
+	    thread_at_exit(&stats_shard_thread_exit, (void *)(uintptr_t)shard)) {
+		stats_shard_thread_exit((void *)(uintptr_t)shard);
+		shard = GW_RING_STATS_SHARED;
+	}
+
+out:
+	current_stats_shard = shard;
+	return shard;
+}
+
+static struct ring_op_counters *this_op_counters(struct gw_ring *ring,
+						 uint8_t op)
+{
+	uint32_t shard = current_stats_shard;
+
+	if (unlikely(shard == UINT32_MAX))
+		shard = get_stats_shard();
+
+	if (unlikely(op >= GW_RING_NR_OPS))
+		return NULL;
+
+	return &ring->stats_shards[shard].ops[op];
+}
+
+/*
+ * Bump a counter that only the calling thread writes.
+ */
+static inline void owner_inc(_Atomic(uint64_t) *p)
+{
+	atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + 1u,
+			      memory_order_relaxed);
+}
+
+/*
+ * Bump a counter of the calling thread's shard, see this_op_counters().
+ * Only the shared shard needs an atomic read-modify-write.
+ */
+static inline void shard_inc(_Atomic(uint64_t) *p)
+{
+	if (likely(current_stats_shard != GW_RING_STATS_SHARED))
+		owner_inc(p);
+	else
+		atomic_fetch_add_explicit(p, 1u, memory_order_relaxed);
+}
+
+static inline void shard_dec(_Atomic(uint64_t) *p)
+{
+	if (likely(current_stats_shard != GW_RING_STATS_SHARED))
+		atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) - 1u,
+				      memory_order_relaxed);
+	else
+		atomic_fetch_sub_explicit(p, 1u, memory_order_relaxed);
+}
+
+static inline uint32_t lat_bucket(uint64_t ns)
+{
+	uint32_t b;
+
+	if (!ns)
+		return 0;
+
+	b = 64u - (uint32_t)__builtin_clzll(ns);
+	return b < GW_RING_LAT_NR_BUCKETS ? b : GW_RING_LAT_NR_BUCKETS - 1u;
+}
+
+static void account_submit(struct gw_ring *ring, struct gw_ring_sqe *sqe)
+{
+	struct ring_op_counters *c = this_op_counters(ring, sqe->op);
+
+	trace_ring_submit(ring, sqe);
+	if (likely(c))
+		shard_inc(&c->nr_submitted);
+}
+
+static int init_cancel_hash(struct gw_ring *ring)
+{
+	struct gw_ring_cancel_bucket *hash;
+	uint32_t i;
+	int ret;
+
+	hash = calloc(GW_RING_CANCEL_HASH_SIZE, sizeof(*hash));
+	if (!hash)
+		return -ENOMEM;
+
+	for (i = 0; i < GW_RING_CANCEL_HASH_SIZE; i++) {
+		ret = mutex_init(&hash[i].lock);
+		if (ret)
+			goto out_err;
+	}
+
+	ring->cancel_hash = hash;
+	return 0;
+
+out_err:
+	while (i--)
+		mutex_destroy(&hash[i].lock);
+	free(hash);
+	return ret;
+}
+
+static void destroy_cancel_hash(struct gw_ring *ring)
+{
+	uint32_t i;
+
+	for (i = 0; i < GW_RING_CANCEL_HASH_SIZE; i++)
+		mutex_destroy(&ring->cancel_hash[i].lock);
+	free(ring->cancel_hash);
+}
+
+/*
+ * Ask every running request to stop, so that long-running ones (e.g.,
+ * a multishot getUpdates) don't hold up the workqueue teardown.
+ */
+static void cancel_running_requests(struct gw_ring *ring)
+{
+	struct gw_ring_cancel_bucket *b;
+	struct cancel_node *cnode;
+	uint32_t i;
+
+	for (i = 0; i < GW_RING_CANCEL_HASH_SIZE; i++) {
+		b = &ring->cancel_hash[i];
+		mutex_lock(&b->lock);
+		for (cnode = b->head; cnode; cnode = cnode->next)
+			atomic_store_explicit(&cnode->cancel_requested, true,
+					      memory_order_relaxed);
+		mutex_unlock(&b->lock);
+	}
+}
+
+/*
+ * Allocate a zeroed array of SQEs or CQEs starting on a cache line, so
+ * that no entry straddles two lines.
+ */
+static void *alloc_entries(uint32_t nr, size_t size)
+{
+	size_t len = (size_t)nr * size;
+	void *p;
+
+	len = (len + GW_CACHELINE_SIZE - 1u) & ~(size_t)(GW_CACHELINE_SIZE - 1u);
+	p = aligned_alloc(GW_CACHELINE_SIZE, len);
+	if (p)
+		memset(p, 0, len);
+
+	return p;
+}
+
+static void destroy_wqs(struct gw_ring *ring, uint32_t nr)
 {
-	static const struct workqueue_attr attr = {
+	while (nr--)
+		destroy_workqueue(ring->wqs[nr]);
+
+	free(ring->wqs);
+}
+
+/*
+ * With GW_RING_SETUP_F_NUMA, there is one workqueue per online node.
+ * Each of them may grow to the full max_threads, so that the ring
+ * keeps its capacity when the load is uneven. Only the threads kept
+ * around are split between them.
+ */
+static int alloc_wqs(struct gw_ring *ring)
+{
+	struct workqueue_attr attr = {
 		.name = "gw-ring-wq",
 		.flags = WQ_F_LAZY_THREAD_CREATION,
-		.max_threads = 1024u,
-		.min_threads = 32u,
-		.max_pending_works = 4096u,
+		.max_threads = GW_RING_WQ_MAX_THREADS,
+		.min_threads = GW_RING_WQ_MIN_THREADS,
+		.max_pending_works = GW_RING_WQ_MAX_PENDING,
+		.idle_timeout_ms = 10000u,
+		.spawn_delay_us = 1000u,
 	};
+	uint32_t *nodes = NULL;
+	uint32_t nr = 1;
+	uint32_t i, n;
+	int ret = 0;
+
+	if (ring->setup_flags & GW_RING_SETUP_F_NUMA) {
+		nr = workqueue_nr_nodes();
+		nodes = calloc(nr, sizeof(*nodes));
+		if (!nodes)
+			return -ENOMEM;
+
+		/*
+		 * A node may have gone offline in between.
+		 */
+		n = workqueue_get_nodes(nodes, nr);
+		if (n < nr)
+			nr = n;
+
+		attr.flags |= WQ_F_NUMA_NODE;
+		attr.min_threads = (attr.min_threads + nr - 1u) / nr;
+	}
+
+	ring->wqs = calloc(nr, sizeof(*ring->wqs));
+	if (!ring->wqs) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		attr.numa_node = nodes ? nodes[i] : 0;
+		ret = alloc_workqueue(&ring->wqs[i], &attr);
+		if (ret) {
+			destroy_wqs(ring, i);
+			goto out;
+		}
+	}
+
+	ring->nr_wqs = nr;
+out:
+	free(nodes);
+	return ret;
+}
+
+/*
+ * Spread the punted SQEs over the io workqueues round-robin. They are
+ * all issued by the one thread consuming the SQ, so picking by the
+ * node of the issuing thread would load a single node.
+ */
+static struct workqueue_struct *next_io_wq(struct gw_ring *ring)
+{
+	uint32_t i;
+
+	if (likely(ring->nr_wqs == 1u))
+		return ring->wqs[0];
+
+	i = atomic_fetch_add_explicit(&ring->wq_next, 1u,
+				      memory_order_relaxed);
+	return ring->wqs[i % ring->nr_wqs];
+}
+
+int gw_ring_init(struct gw_ring *ring, uint32_t size)
+{
+	return gw_ring_init_flags(ring, size, 0);
+}
+
+int gw_ring_init_flags(struct gw_ring *ring, uint32_t size, uint32_t flags)
+{
 	uint32_t max = 2u;
 	int ret;
 
-	memset(ring, 0, sizeof(*ring));
+	if (flags & ~GW_RING_SETUP_F_ALL)
+		return -EINVAL;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->setup_flags = flags;
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		ring->cq_wait_max_spin_ns = GW_RING_WAIT_MAX_SPIN_NS;
+	atomic_init(&ring->cq_evfd, -1);
+	ring->cq_overflow_tail = &ring->cq_overflow_head;
+
+	/*
+	 * Make sure that the size is power of 2 to avoid costly
+	 * modulo operation.
+	 */
+	while (max < size)
+		max *= 2u;
+
+	ring->sq_mask = max - 1u;
+	ring->cq_mask = (max * 2u) - 1u;
+	ring->max_cq_overflow = ring->cq_mask + 1u;
+
+	ring->sqes = alloc_entries(ring->sq_mask + 1u, sizeof(ring->sqes[0]));
+	if (!ring->sqes)
+		return -ENOMEM;
+
+	ring->cqes = alloc_entries(ring->cq_mask + 1u, sizeof(ring->cqes[0]));
+	if (!ring->cqes) {
+		ret = -ENOMEM;
+		goto out_free_sqes;
+	}
+
+	ring->cq_seqs = calloc(ring->cq_mask + 1u, sizeof(ring->cq_seqs[0]));
+	if (!ring->cq_seqs) {
+		ret = -ENOMEM;
+		goto out_free_cqes;
+	}
+
+	ring->stats_shards = alloc_entries(GW_RING_STATS_NR_SHARDS,
+					   sizeof(ring->stats_shards[0]));
+	if (!ring->stats_shards) {
+		ret = -ENOMEM;
+		goto out_free_cq_seqs;
+	}
+
+	ret = mutex_init(&ring->cq_wait_lock);
+	if (ret)
+		goto out_free_stats_shards;
+
+	ret = cond_init(&ring->cq_wait_cond);
+	if (ret)
+		goto out_free_cq_wait_lock;
+
+	ret = mutex_init(&ring->cq_overflow_lock);
+	if (ret)
+		goto out_free_cq_wait_cond;
+
+	ret = mutex_init(&ring->sq_wait_lock);
+	if (ret)
+		goto out_free_cq_overflow_lock;
+
+	ret = cond_init(&ring->sq_wait_cond);
+	if (ret)
+		goto out_free_sq_wait_lock;
+
+	ret = gw_timer_base_init(&ring->timers);
+	if (ret)
+		goto out_free_sq_wait_cond;
+
+	ret = alloc_wqs(ring);
+	if (ret)
+		goto out_free_timers;
+
+	ret = gw_pool_init(&ring->sqe_pool, sizeof(struct wq_sqe_data),
+			   ring->nr_wqs * GW_RING_WQ_MAX_PENDING +
+			   ring->sq_mask + 1u);
+	if (ret)
+		goto out_free_wqs;
+
+	ret = init_cancel_hash(ring);
+	if (ret)
+		goto out_free_sqe_pool;
+
+	if (flags & GW_RING_SETUP_F_SQPOLL) {
+		ret = thread_create(&ring->sq_thread, &gw_ring_sq_thread, ring);
+		if (ret)
+			goto out_free_cancel_hash;
+	}
+
+	return 0;
+
+out_free_cancel_hash:
+	destroy_cancel_hash(ring);
+out_free_sqe_pool:
+	gw_pool_destroy(ring->sqe_pool);
+out_free_wqs:
+	destroy_wqs(ring, ring->nr_wqs);
+out_free_timers:
+	gw_timer_base_destroy(ring->timers, NULL);
+out_free_sq_wait_cond:
+	cond_destroy(&ring->sq_wait_cond);
+out_free_sq_wait_lock:
+	mutex_destroy(&ring->sq_wait_lock);
+out_free_cq_overflow_lock:
+	mutex_destroy(&ring->cq_overflow_lock);
+out_free_cq_wait_cond:
+	cond_destroy(&ring->cq_wait_cond);
+out_free_cq_wait_lock:
+	mutex_destroy(&ring->cq_wait_lock);
+out_free_stats_shards:
+	free(ring->stats_shards);
+out_free_cq_seqs:
+	free(ring->cq_seqs);
+out_free_cqes:
+	free(ring->cqes);
+out_free_sqes:
+	free(ring->sqes);
+	return ret;
+}
+
+void gw_ring_destroy(struct gw_ring *ring)
+{
+	struct gw_ring_overflow_cqe *ocqe;
+
+	atomic_store_explicit(&ring->should_stop, true, memory_order_release);
+	mutex_lock(&ring->cq_wait_lock);
+	cond_broadcast(&ring->cq_wait_cond);
+	mutex_unlock(&ring->cq_wait_lock);
+
+	/*
+	 * The SQ thread punts to the workqueue and arms timers, so it
+	 * goes first. SQEs it hasn't picked up yet are never issued.
+	 */
+	if (ring->setup_flags & GW_RING_SETUP_F_SQPOLL) {
+		mutex_lock(&ring->sq_wait_lock);
+		cond_signal(&ring->sq_wait_cond);
+		mutex_unlock(&ring->sq_wait_lock);
+		thread_join(ring->sq_thread, NULL);
+	}
+
+	/*
+	 * Timer callbacks may punt to the workqueue and workers may arm
+	 * timers (link chains), so stop the timer thread first, then
+	 * the workers, and only then free what is still pending.
+	 */
+	gw_timer_base_stop(ring->timers);
+	cancel_running_requests(ring);
+	destroy_wqs(ring, ring->nr_wqs);
+	gw_timer_base_destroy(ring->timers, &gw_ring_timeout_drop);
+	gw_pool_destroy(ring->sqe_pool);
+	destroy_cancel_hash(ring);
+
+	while (ring->cq_overflow_head) {
+		ocqe = ring->cq_overflow_head;
+		ring->cq_overflow_head = ocqe->next;
+		free(ocqe);
+	}
+
+	cond_destroy(&ring->sq_wait_cond);
+	mutex_destroy(&ring->sq_wait_lock);
+	mutex_destroy(&ring->cq_overflow_lock);
+	cond_destroy(&ring->cq_wait_cond);
+	mutex_destroy(&ring->cq_wait_lock);
+	free(ring->stats_shards);
+	free(ring->cq_seqs);
+	free(ring->cqes);
+	free(ring->sqes);
+}
+
+int gw_ring_register_eventfd(struct gw_ring *ring, int fd, uint32_t flags)
+{
+	if (fd < 0 || (flags & ~GW_RING_EVFD_F_ALL))
+		return -EINVAL;
+
+	if (atomic_load_explicit(&ring->cq_evfd, memory_order_relaxed) >= 0)
+		return -EBUSY;
+
+	ring->cq_evfd_flags = flags;
+	atomic_store_explicit(&ring->cq_evfd, fd, memory_order_seq_cst);
+	return 0;
+}
+
+int gw_ring_unregister_eventfd(struct gw_ring *ring)
+{
+	int fd;
+
+	fd = atomic_exchange_explicit(&ring->cq_evfd, -1, memory_order_seq_cst);
+	if (fd < 0)
+		return -ENXIO;
+
+	/*
+	 * Wait for the producers that may still see the old fd, so the
+	 * caller can close it as soon as we return.
+	 */
+	while (atomic_load_explicit(&ring->nr_cq_evfd_users,
+				    memory_order_seq_cst))
+		sched_yield();
+
+	return 0;
+}
+
+static void signal_cq_eventfd(struct gw_ring *ring, uint32_t pos)
+{
+	uint32_t cq_head;
+	int fd;
+
+	if (likely(atomic_load_explicit(&ring->cq_evfd,
+					memory_order_relaxed) < 0))
+		return;
+
+	/*
+	 * In coalescing mode, only signal the empty to non-empty
+	 * transition, i.e., when the consumer is already waiting for
+	 * the slot we have just published. A consumer that is behind
+	 * will see our CQE when it re-checks with gw_ring_cq_ready().
+	 */
+	if (ring->cq_evfd_flags & GW_RING_EVFD_F_COALESCE) {
+		cq_head = atomic_load_explicit(&ring->cq_head,
+					       memory_order_relaxed);
+		if (cq_head != pos)
+			return;
+	}
+
+	atomic_fetch_add_explicit(&ring->nr_cq_evfd_users, 1u,
+				  memory_order_seq_cst);
+	fd = atomic_load_explicit(&ring->cq_evfd, memory_order_seq_cst);
+	if (fd >= 0)
+		eventfd_write(fd, 1);
+	atomic_fetch_sub_explicit(&ring->nr_cq_evfd_users, 1u,
+				  memory_order_release);
+}
+
+static void wake_up_wait_cqe_callers(struct gw_ring *ring)
+{
+	if (likely(!atomic_load_explicit(&ring->nr_cq_waiters,
+					 memory_order_relaxed)))
+		return;
+
+	mutex_lock(&ring->cq_wait_lock);
+	cond_broadcast(&ring->cq_wait_cond);
+	mutex_unlock(&ring->cq_wait_lock);
+}
+
+/*
+ * Only wake up the consumer once the CQ holds as many CQEs as it waits
+ * for (cq_wait_nr). cq_tail is read after our CQE is published, so
+ * the producer that publishes the last of the first cq_wait_nr slots
+ * always sees the threshold reached. An earlier producer may see it
+ * too while some of those slots are still being filled, in which case
+ * the consumer just goes back to sleep.
+ */
+static void wake_up_wait_cqes_callers(struct gw_ring *ring)
+{
+	uint32_t cq_head;
+	uint32_t cq_tail;
+
+	if (likely(!atomic_load_explicit(&ring->nr_cq_waiters,
+					 memory_order_relaxed)))
+		return;
+
+	cq_tail = atomic_load_explicit(&ring->cq_tail, memory_order_relaxed);
+	cq_head = atomic_load_explicit(&ring->cq_head, memory_order_relaxed);
+	if (cq_tail - cq_head < atomic_load_explicit(&ring->cq_wait_nr,
+						     memory_order_relaxed))
+		return;
+
+	mutex_lock(&ring->cq_wait_lock);
+	cond_broadcast(&ring->cq_wait_cond);
+	mutex_unlock(&ring->cq_wait_lock);
+}
+
+/*
+ * Reserve a CQ slot and publish @src in it. Returns false if the CQ is
+ * full. The caller is responsible for waking up the consumer.
+ */
+static bool __post_cqe(struct gw_ring *ring, const struct gw_ring_cqe *src,
+		       uint32_t *pos_p)
+{
+	uint32_t cq_mask = ring->cq_mask;
+	struct gw_ring_cqe *cqe;
+	uint32_t cq_tail;
+	uint32_t cq_head;
+	uint32_t idx;
+
+	/*
+	 * Read the head before the tail. The head never passes the
+	 * tail, so a stale head can only make the CQ look fuller than
+	 * it really is, never the other way around.
+	 */
+	do {
+		cq_head = smp_load_acquire(&ring->cq_head);
+		cq_tail = atomic_load_explicit(&ring->cq_tail,
+					       memory_order_relaxed);
+		if (unlikely(cq_tail - cq_head >= cq_mask + 1u))
+			return false;
+	} while (!atomic_compare_exchange_weak_explicit(&ring->cq_tail,
+							&cq_tail, cq_tail + 1u,
+							memory_order_relaxed,
+							memory_order_relaxed));
+
+	idx = cq_tail & cq_mask;
+	cqe = &ring->cqes[idx];
+	*cqe = *src;
+	smp_store_release(&ring->cq_seqs[idx], cq_tail + 1u);
+	*pos_p = cq_tail;
+	return true;
+}
+
+/*
+ * Move as many overflowed CQEs as fit into the CQ, oldest first.
+ * Returns the number of CQEs moved, and the position of the first one
+ * in @pos_p.
+ */
+static uint32_t flush_cq_overflow(struct gw_ring *ring, uint32_t *pos_p)
+	__must_hold(&ring->cq_overflow_lock)
+{
+	struct gw_ring_overflow_cqe *ocqe;
+	uint32_t nr = 0;
+	uint32_t pos;
+
+	while ((ocqe = ring->cq_overflow_head)) {
+		if (!__post_cqe(ring, &ocqe->cqe, &pos))
+			break;
+
+		if (!nr)
+			*pos_p = pos;
+		nr++;
+		ring->cq_overflow_head = ocqe->next;
+		free(ocqe);
+	}
+
+	if (!ring->cq_overflow_head) {
+		ring->cq_overflow_tail = &ring->cq_overflow_head;
+		atomic_fetch_and_explicit(&ring->cq_flags, ~GW_RING_CQ_F_OVERFLOW,
+					  memory_order_relaxed);
+	}
+
+	ring->nr_cq_overflow -= nr;
+	return nr;
+}
+
+/*
+ * Called by the consumer when GW_RING_CQ_F_OVERFLOW is set, after it
+ * has made room in the CQ.
+ */
+void __gw_ring_cq_flush_overflow(struct gw_ring *ring)
+{
+	uint32_t pos;
+	uint32_t nr;
+
+	mutex_lock(&ring->cq_overflow_lock);
+	nr = flush_cq_overflow(ring, &pos);
+	mutex_unlock(&ring->cq_overflow_lock);
+
+	/*
+	 * The consumer is the one calling us, so there is nobody to
+	 * wake up, but an eventfd user may only look at the CQ again
+	 * when the eventfd fires.
+	 */
+	if (nr)
+		signal_cq_eventfd(ring, pos);
+}
+
+/*
+ * Slow path of post_cqe(): the CQ is full, or older CQEs are still
+ * waiting in the overflow list. Queue the CQE behind them so the
+ * completions of a single producer are never reordered.
+ */
+static bool overflow_cqe(struct gw_ring *ring, const struct gw_ring_cqe *cqe)
+{
+	struct gw_ring_overflow_cqe *ocqe;
+	uint32_t pos;
+
+	mutex_lock(&ring->cq_overflow_lock);
+	flush_cq_overflow(ring, &pos);
+	if (!ring->cq_overflow_head && __post_cqe(ring, cqe, &pos)) {
+		mutex_unlock(&ring->cq_overflow_lock);
+		atomic_thread_fence(memory_order_seq_cst);
+		signal_cq_eventfd(ring, pos);
+		wake_up_wait_cqes_callers(ring);
+		return true;
+	}
+
+	if (unlikely(ring->nr_cq_overflow >= ring->max_cq_overflow))
+		goto out_drop;
+
+	ocqe = malloc(sizeof(*ocqe));
+	if (unlikely(!ocqe))
+		goto out_drop;
+
+	ocqe->next = NULL;
+	ocqe->cqe = *cqe;
+	*ring->cq_overflow_tail = ocqe;
+	ring->cq_overflow_tail = &ocqe->next;
+	ring->nr_cq_overflow++;
+	atomic_fetch_add_explicit(&ring->cq_overflow, 1u, memory_order_relaxed);
+	atomic_fetch_or_explicit(&ring->cq_flags, GW_RING_CQ_F_OVERFLOW,
+				 memory_order_relaxed);
+	mutex_unlock(&ring->cq_overflow_lock);
+
+	/*
+	 * Pairs with the fence in gw_ring_cq_ready() and in the wait
+	 * path. Either the consumer sees GW_RING_CQ_F_OVERFLOW and
+	 * flushes, or we see it waiting and wake it up. The eventfd is
+	 * signaled unconditionally since the consumer may have drained
+	 * the CQ just before we set the flag.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	signal_cq_eventfd(ring, atomic_load_explicit(&ring->cq_head,
+						     memory_order_relaxed));
+	wake_up_wait_cqe_callers(ring);
+	return true;
+
+out_drop:
+	atomic_fetch_add_explicit(&ring->cq_dropped, 1u, memory_order_relaxed);
+	mutex_unlock(&ring->cq_overflow_lock);
+	return false;
+}
+
+static bool post_cqe_flags(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+			   int64_t res, uint32_t flags, void *data)
+{
+	struct gw_ring_cqe cqe = {
+		.user_data	= sqe->user_data,
+		.res		= res,
+		.flags		= flags,
+		.op		= sqe->op,
+		.data		= data,
+	};
+	struct ring_op_counters *c = this_op_counters(ring, sqe->op);
+	uint32_t pos;
+
+	trace_ring_complete(ring, &cqe);
+	if (likely(c))
+		shard_inc(&c->nr_completed);
+
+	if (unlikely(atomic_load_explicit(&ring->cq_flags, memory_order_relaxed) &
+		     GW_RING_CQ_F_OVERFLOW))
+		return overflow_cqe(ring, &cqe);
+
+	if (unlikely(!__post_cqe(ring, &cqe, &pos)))
+		return overflow_cqe(ring, &cqe);
+
+	/*
+	 * Pairs with the fence in gw_ring_wait_cqe() and gw_ring_cq_ready().
+	 * Either we see the waiter (or the consumer's new head), or the
+	 * consumer sees the CQE we have just published.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	signal_cq_eventfd(ring, pos);
+	wake_up_wait_cqes_callers(ring);
+	return true;
+}
+
+static bool post_cqe(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+		     int64_t res)
+{
+	return post_cqe_flags(ring, sqe, res, 0, NULL);
+}
+
+/*
+ * Report an SQE that failed to be issued. One that comes from the SQ
+ * has a caller to return the error to, unless it is the SQ thread. One
+ * that comes from a link chain doesn't, so it gets a CQE either way.
+ */
+static void report_failed_sqe(struct gw_ring *ring, struct punt_batch *pb,
+			      struct gw_ring_sqe *sqe, int res)
+{
+	if (!pb->in_sq || (ring->setup_flags & GW_RING_SETUP_F_SQPOLL))
+		post_cqe(ring, sqe, res);
+}
+
+/*
+ * Release the resources owned by an SQE that will never be issued.
+ */
+static void punt_failed(struct gw_ring_sqe *sqe)
+{
+	switch (sqe->op) {
+	case GW_RING_OP_MODULE_HANDLE:
+		tgapi_free_update(sqe->tg_module_handle.update);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Free a link chain without posting any CQE. Only used when the ring is
+ * being torn down.
+ */
+static void free_link(struct link_data *link)
+{
+	struct link_data *next;
+
+	while (link) {
+		next = link->next;
+		punt_failed(&link->sqe);
+		free(link);
+		link = next;
+	}
+}
+
+/*
+ * Free the copy of a link chain whose SQEs are left in the SQ. They
+ * still own their resources.
+ */
+static void free_link_copy(struct link_data *link)
+{
+	struct link_data *next;
+
+	while (link) {
+		next = link->next;
+		free(link);
+		link = next;
+	}
+}
+
+/*
+ * Complete every SQE of a link chain with -ECANCELED.
+ */
+static void cancel_link(struct gw_ring *ring, struct link_data *link)
+{
+	struct link_data *next;
+
+	while (link) {
+		next = link->next;
+		post_cqe(ring, &link->sqe, -ECANCELED);
+		punt_failed(&link->sqe);
+		free(link);
+		link = next;
+	}
+}
+
+static bool submit_sqe(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+		       struct link_data *link, struct punt_batch *pb);
+
+static void init_punt_batch(struct punt_batch *pb, bool in_sq)
+{
+	pb->nr = 0;
+	pb->nr_failed = 0;
+	pb->in_sq = in_sq;
+	pb->busy = false;
+	pb->sq_pos = 0;
+	pb->direct_end = 0;
+	pb->nr_left = 0;
+}
+
+/*
+ * Issue the next SQE of a chain once the SQE before it has completed
+ * successfully. This runs on whichever thread completed that SQE,
+ * often a worker of the io workqueue or the timer thread, so it must
+ * not wait for room in the io workqueue. If there is none, the SQE
+ * completes with -EBUSY and the rest of the chain with -ECANCELED.
+ * An SQE that fails to be issued has its CQE posted by
+ * report_failed_sqe() already.
+ */
+static void submit_link(struct gw_ring *ring, struct link_data *link)
+{
+	struct punt_batch pb;
+
+	init_punt_batch(&pb, false);
+	if (unlikely(!submit_sqe(ring, &link->sqe, link->next, &pb))) {
+		punt_failed(&link->sqe);
+		cancel_link(ring, link->next);
+	} else {
+		flush_punt_batch(ring, &pb);
+	}
+
+	free(link);
+}
+
+static bool link_should_continue(uint8_t op, int64_t res)
+{
+	/*
+	 * An expired timeout is the expected outcome of a timeout in
+	 * a chain, so it does not break the chain.
+	 */
+	if (op == GW_RING_OP_TIMEOUT && res == -ETIME)
+		return true;
+
+	return res >= 0;
+}
+
+/*
+ * Post the CQE of @sqe, then either start the rest of its link chain or
+ * cancel it, depending on @res.
+ */
+static bool complete_sqe(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+			 int64_t res, struct link_data *link)
+{
+	uint8_t op = sqe->op;
+	struct link_data *next;
+	bool ret;
+
+	ret = post_cqe(ring, sqe, res);
+	while (unlikely(link)) {
+		if (!link_should_continue(op, res)) {
+			cancel_link(ring, link);
+			break;
+		}
+
+		/*
+		 * Complete inline NOPs here instead of recursing through
+		 * submit_link(), so a long chain doesn't grow the stack.
+		 */
+		if (link->sqe.op != GW_RING_OP_NOP ||
+		    (link->sqe.flags & GW_RING_SQE_F_ASYNC)) {
+			submit_link(ring, link);
+			break;
+		}
+
+		next = link->next;
+		op = link->sqe.op;
+		res = 0;
+		post_cqe(ring, &link->sqe, res);
+		free(link);
+		link = next;
+	}
+
+	return ret;
+}
+
+static struct gw_ring_cancel_bucket *cancel_bucket(struct gw_ring *ring,
+						   uint64_t user_data)
+{
+	uint64_t hash = user_data * 0x9e3779b97f4a7c15ull;
+
+	return &ring->cancel_hash[hash >> (64u - GW_RING_CANCEL_HASH_BITS)];
+}
+
+static void cancel_hash_add(struct gw_ring *ring, struct cancel_node *cnode,
+			    struct gw_ring_sqe *sqe)
+{
+	struct gw_ring_cancel_bucket *b = cancel_bucket(ring, sqe->user_data);
+
+	cnode->user_data = sqe->user_data;
+	cnode->op = sqe->op;
+	atomic_init(&cnode->state, CANCEL_QUEUED);
+	atomic_init(&cnode->cancel_requested, false);
+
+	mutex_lock(&b->lock);
+	cnode->next = b->head;
+	if (b->head)
+		b->head->pprev = &cnode->next;
+	cnode->pprev = &b->head;
+	b->head = cnode;
+	mutex_unlock(&b->lock);
+}
+
+static void __cancel_hash_del(struct cancel_node *cnode)
+{
+	if (!cnode->pprev)
+		return;
+
+	*cnode->pprev = cnode->next;
+	if (cnode->next)
+		cnode->next->pprev = cnode->pprev;
+	cnode->pprev = NULL;
+}
+
+static void cancel_hash_del(struct gw_ring *ring, struct cancel_node *cnode)
+{
+	struct gw_ring_cancel_bucket *b = cancel_bucket(ring, cnode->user_data);
+
+	mutex_lock(&b->lock);
+	__cancel_hash_del(cnode);
+	mutex_unlock(&b->lock);
+}
+
+/*
+ * Called by the worker or the timer thread before it starts the
+ * request. Returns false if the request has been cancelled, in which
+ * case its CQE has already been posted and the caller only has to
+ * release it.
+ */
+static bool start_cancelable(struct gw_ring *ring, struct cancel_node *cnode)
+{
+	struct gw_ring_cancel_bucket *b;
+	uint32_t state = CANCEL_QUEUED;
+
+	if (likely(atomic_compare_exchange_strong_explicit(&cnode->state,
+							   &state,
+							   CANCEL_RUNNING,
+							   memory_order_acq_rel,
+							   memory_order_acquire)))
+		return true;
+
+	/*
+	 * The canceller may still be looking at the node under the
+	 * bucket lock. Wait for it before the caller frees the node.
+	 */
+	b = cancel_bucket(ring, cnode->user_data);
+	mutex_lock(&b->lock);
+	mutex_unlock(&b->lock);
+	return false;
+}
+
+static void finish_cancelable(struct gw_ring *ring, struct cancel_node *cnode,
+			      struct gw_ring_sqe *sqe, int64_t res,
+			      struct link_data *link)
+{
+	cancel_hash_del(ring, cnode);
+	complete_sqe(ring, sqe, res, link);
+}
+
+bool gw_ring_cancel_requested(void)
+{
+	struct cancel_node *cnode = current_cnode;
+
+	return cnode && atomic_load_explicit(&cnode->cancel_requested,
+					     memory_order_relaxed);
+}
+
+/*
+ * Try to cancel @cnode. Returns 1 if it was cancelled before it
+ * started, 0 if it is already running and has been asked to stop.
+ * Must be called with the bucket lock of @cnode held.
+ */
+static int cancel_one(struct gw_ring *ring, struct cancel_node *cnode)
+{
+	uint32_t state = CANCEL_QUEUED;
+	struct timeout_data *td;
+	struct gw_ring_sqe sqe;
+
+	if (!atomic_compare_exchange_strong_explicit(&cnode->state, &state,
+						     CANCEL_CANCELLED,
+						     memory_order_acq_rel,
+						     memory_order_acquire)) {
+		atomic_store_explicit(&cnode->cancel_requested, true,
+				      memory_order_relaxed);
+		return 0;
+	}
+
+	__cancel_hash_del(cnode);
+	sqe.op = cnode->op;
+	sqe.user_data = cnode->user_data;
+	post_cqe(ring, &sqe, -ECANCELED);
+	if (cnode->op != GW_RING_OP_TIMEOUT)
+		return 1;
+
+	/*
+	 * If the timer has already been taken off the heap, the timer
+	 * thread is about to call gw_ring_timeout_fire(), which sees the
+	 * cancellation and releases the timeout.
+	 */
+	td = container_of(cnode, struct timeout_data, cnode);
+	if (gw_timer_del(ring->timers, &td->timer)) {
+		cancel_link(ring, td->link);
+		free(td);
+	}
+
+	return 1;
+}
+
+static int issue_op_async_cancel(struct gw_ring *ring, struct gw_ring_sqe *sqe)
+{
+	struct gw_ring_cancel *cancel = &sqe->cancel;
+	struct gw_ring_cancel_bucket *b;
+	struct cancel_node *cnode;
+	struct cancel_node *next;
+	int nr_cancelled = 0;
+	int nr_running = 0;
+
+	if (unlikely(cancel->flags & ~GW_RING_CANCEL_F_ALL))
+		return -EINVAL;
+
+	b = cancel_bucket(ring, cancel->user_data);
+	mutex_lock(&b->lock);
+	for (cnode = b->head; cnode; cnode = next) {
+		next = cnode->next;
+		if (cnode->user_data != cancel->user_data)
+			continue;
+
+		if (cancel_one(ring, cnode))
+			nr_cancelled++;
+		else
+			nr_running++;
+
+		if (!(cancel->flags & GW_RING_CANCEL_F_MATCH_ALL))
+			break;
+	}
+	mutex_unlock(&b->lock);
+
+	if (cancel->flags & GW_RING_CANCEL_F_MATCH_ALL)
+		return (nr_cancelled + nr_running) ? nr_cancelled + nr_running
+						   : -ENOENT;
+	if (nr_cancelled)
+		return 0;
+	if (nr_running)
+		return -EALREADY;
+	return -ENOENT;
+}
+
+static bool issue_op_nop(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+			 struct link_data *link, struct punt_batch *pb)
+{
+	if (unlikely(sqe->flags & GW_RING_SQE_F_ASYNC))
+		return punt_to_io_wq(ring, sqe, link, pb);
+
+	complete_sqe(ring, sqe, 0, link);
+	return true;
+}
+
+static bool issue_op_tg_api_call(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+				 struct link_data *link, struct punt_batch *pb)
+{
+	return punt_to_io_wq(ring, sqe, link, pb);
+}
+
+static bool issue_op_module_handle(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+				   struct link_data *link, struct punt_batch *pb)
+{
+	return punt_to_io_wq(ring, sqe, link, pb);
+}
+
+static void gw_ring_timeout_fire(struct gw_timer *t)
+{
+	struct timeout_data *td = (struct timeout_data *)t;
+
+	if (unlikely(!start_cancelable(td->ring, &td->cnode))) {
+		cancel_link(td->ring, td->link);
+		free(td);
+		return;
+	}
+
+	finish_cancelable(td->ring, &td->cnode, &td->sqe, -ETIME, td->link);
+	free(td);
+}
+
+static void gw_ring_timeout_drop(struct gw_timer *t)
+{
+	struct timeout_data *td = (struct timeout_data *)t;
+
+	free_link(td->link);
+	free(td);
+}
+
+static bool issue_op_timeout(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+			     struct link_data *link, struct punt_batch *pb)
+{
+	struct gw_ring_timeout *timeout = &sqe->timeout;
+	struct timeout_data *td;
+	uint64_t expires;
+	int ret;
+
+	if (unlikely(timeout->flags & ~GW_RING_TIMEOUT_F_ALL)) {
+		complete_sqe(ring, sqe, -EINVAL, link);
+		return true;
+	}
+
+	expires = gw_timespec_to_ns(&timeout->ts);
+	if (!(timeout->flags & GW_RING_TIMEOUT_F_ABS))
+		expires += gw_time_now_ns();
+
+	td = malloc(sizeof(*td));
+	if (unlikely(!td)) {
+		report_failed_sqe(ring, pb, sqe, -ENOMEM);
+		return false;
+	}
+
+	gw_timer_init(&td->timer, &gw_ring_timeout_fire);
+	td->ring = ring;
+	td->link = link;
+	td->sqe = *sqe;
+	cancel_hash_add(ring, &td->cnode, sqe);
+	ret = gw_timer_add(ring->timers, &td->timer, expires);
+	if (unlikely(ret)) {
+		cancel_hash_del(ring, &td->cnode);
+		report_failed_sqe(ring, pb, sqe, ret);
+		free(td);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Issue @sqe. @link is the rest of its link chain, if any. On success,
+ * the chain is owned by the issued request. On failure, the caller
+ * still owns it.
+ */
+static bool submit_sqe(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+		       struct link_data *link, struct punt_batch *pb)
+{
+	account_submit(ring, sqe);
+	switch (sqe->op) {
+	case GW_RING_OP_NOP:
+		return issue_op_nop(ring, sqe, link, pb);
+	case GW_RING_OP_TG_API_CALL:
+		return issue_op_tg_api_call(ring, sqe, link, pb);
+	case GW_RING_OP_MODULE_HANDLE:
+		return issue_op_module_handle(ring, sqe, link, pb);
+	case GW_RING_OP_TIMEOUT:
+		return issue_op_timeout(ring, sqe, link, pb);
+	case GW_RING_OP_ASYNC_CANCEL:
+		complete_sqe(ring, sqe, issue_op_async_cancel(ring, sqe), link);
+		return true;
+	default:
+		report_failed_sqe(ring, pb, sqe, -EINVAL);
+		return false;
+	}
+}
+
+static uint32_t sqe_wq_prio(const struct gw_ring_sqe *sqe)
+{
+	return sqe->prio < WQ_NR_PRIO ? sqe->prio : WQ_PRIO_LOW;
+}
+
+static bool sqe_is_keyed(const struct gw_ring_sqe *sqe)
+{
+	return sqe->op == GW_RING_OP_MODULE_HANDLE &&
+	       (sqe->tg_module_handle.flags & GW_RING_MODULE_HANDLE_F_KEYED);
+}
+
+/*
+ * The SQEs of a key must all go to the same workqueue, whichever node
+ * submits them.
+ */
+static int punt_keyed(struct gw_ring *ring, struct wq_sqe_data *data)
+{
+	uint64_t key = data->sqe.tg_module_handle.key;
+	struct workqueue_struct *wq = ring->wqs[key % ring->nr_wqs];
+
+	return try_queue_work_keyed_prio(wq, sqe_wq_prio(&data->sqe), key,
+					 gw_ring_wq_sqe_exec, data,
+					 gw_ring_wq_sqe_delete);
+}
+
+static bool sq_pos_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+/*
+ * Hand a punted SQE that found no room back to the SQ. Only its copy
+ * is freed, and it is not accounted as submitted until it is issued
+ * again.
+ */
+static void leave_in_sq(struct gw_ring *ring, struct punt_batch *pb,
+			struct wq_sqe_data *data, uint32_t pos)
+{
+	struct ring_op_counters *c = this_op_counters(ring, data->sqe.op);
+
+	if (likely(c)) {
+		shard_dec(&c->nr_submitted);
+		shard_dec(&c->nr_punted);
+	}
+
+	if (!pb->nr_left++)
+		pb->sq_restart = pos;
+
+	free_link_copy(data->link);
+	gw_pool_free(ring->sqe_pool, data);
+}
+
+/*
+ * Hand all SQEs collected in @pb to the io workqueue, with one
+ * try_queue_work_batch_prio() call per run of SQEs sharing the same
+ * priority. Keyed SQEs are queued one by one. Returns the number of
+ * SQEs that could not be punted.
+ *
+ * With pb->in_sq, the SQEs that find no room are left in the SQ, and
+ * not counted as failed, unless an SQE after them has been consumed
+ * already. The others get a CQE with -EBUSY.
+ */
+static uint32_t flush_punt_batch(struct gw_ring *ring, struct punt_batch *pb)
+{
+	uint32_t pos[GW_RING_PUNT_BATCH];
+	void *args[GW_RING_PUNT_BATCH];
+	struct ring_op_counters *c;
+	struct wq_sqe_data *data;
+	uint32_t nr_failed = 0;
+	uint32_t nr = 0;
+	uint32_t queued;
+	uint64_t now = 0;
+	uint32_t prio;
+	uint32_t i;
+	uint32_t n;
+	int ret = 0;
+
+	for (i = 0; i < pb->nr; i++) {
+		data = gw_pool_alloc(ring->sqe_pool);
+		if (unlikely(!data)) {
+			report_failed_sqe(ring, pb, pb->sqes[i], -ENOMEM);
+			punt_failed(pb->sqes[i]);
+			cancel_link(ring, pb->links[i]);
+			nr_failed++;
+			if (sq_pos_before(pb->direct_end, pb->pos[i] + 1u))
+				pb->direct_end = pb->pos[i] + 1u;
+			continue;
+		}
+
+		if (!now)
+			now = gw_time_now_ns();
+
+		data->ring = ring;
+		data->link = pb->links[i];
+		data->punt_ns = now;
+		data->sqe = *pb->sqes[i];
+		cancel_hash_add(ring, &data->cnode, &data->sqe);
+		c = this_op_counters(ring, data->sqe.op);
+		if (likely(c))
+			shard_inc(&c->nr_punted);
+		pos[nr] = pb->pos[i];
+		args[nr++] = data;
+	}
+
+	pb->nr = 0;
+	for (i = 0; i < nr; i += n) {
+		data = args[i];
+		if (sqe_is_keyed(&data->sqe)) {
+			n = 1;
+			ret = punt_keyed(ring, data);
+			if (unlikely(ret))
+				break;
+			continue;
+		}
+
+		prio = sqe_wq_prio(&data->sqe);
+		for (n = 1; i + n < nr; n++) {
+			data = args[i + n];
+			if (sqe_wq_prio(&data->sqe) != prio ||
+			    sqe_is_keyed(&data->sqe))
+				break;
+		}
+
+		ret = try_queue_work_batch_prio(next_io_wq(ring), prio,
+						gw_ring_wq_sqe_exec, &args[i],
+						n, gw_ring_wq_sqe_delete);
+		queued = (ret > 0) ? (uint32_t)ret : 0u;
+		if (unlikely(queued < n)) {
+			i += queued;
+			break;
+		}
+	}
+
+	if (likely(i >= nr))
+		return nr_failed;
+
+	if (ret == -EAGAIN || ret >= 0)
+		pb->busy = true;
+
+	for (; i < nr; i++) {
+		data = args[i];
+		cancel_hash_del(ring, &data->cnode);
+		if (pb->busy && pb->in_sq &&
+		    !sq_pos_before(pos[i], pb->direct_end)) {
+			leave_in_sq(ring, pb, data, pos[i]);
+			continue;
+		}
+
+		nr_failed++;
+		if (pb->busy)
+			post_cqe(ring, &data->sqe, -EBUSY);
+		else
+			report_failed_sqe(ring, pb, &data->sqe, ret);
+		punt_failed(&data->sqe);
+		cancel_link(ring, data->link);
+		gw_pool_free(ring->sqe_pool, data);
+	}
+
+	return nr_failed;
+}
+
+/*
+ * Copy the SQEs linked to the SQE right before @*sq_head_p into a
+ * chain. The chain ends at the first SQE without GW_RING_SQE_F_LINK,
+ * or at the end of the submission. Returns the number of SQEs in the
+ * chain, or -ENOMEM.
+ */
+static int prep_link_chain(struct gw_ring *ring, uint32_t *sq_head_p,
+			   uint32_t sq_tail, struct link_data **link_p)
+{
+	struct link_data **pprev = link_p;
+	uint32_t sq_head = *sq_head_p;
+	struct gw_ring_sqe *sqe;
+	struct link_data *link;
+	int ret = 0;
+
+	*link_p = NULL;
+	while (sq_head != sq_tail) {
+		sqe = &ring->sqes[sq_head++ & ring->sq_mask];
+		ret++;
+
+		link = malloc(sizeof(*link));
+		if (unlikely(!link)) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		link->next = NULL;
+		link->sqe = *sqe;
+		*pprev = link;
+		pprev = &link->next;
+		if (!(sqe->flags & GW_RING_SQE_F_LINK))
+			break;
+	}
 
-	/*
-	 * Make sure that the size is power of 2 to avoid costly
-	 * modulo operation.
-	 */
-	while (max < size)
-		max *= 2u;
+	if (unlikely(ret < 0)) {
+		/*
+		 * Fail the whole chain, including the SQEs that have not
+		 * been copied yet.
+		 */
+		cancel_link(ring, *link_p);
+		*link_p = NULL;
+		sq_head--;
+		do {
+			sqe = &ring->sqes[sq_head++ & ring->sq_mask];
+			post_cqe(ring, sqe, -ECANCELED);
+			punt_failed(sqe);
+		} while (sq_head != sq_tail && (sqe->flags & GW_RING_SQE_F_LINK));
+	}
 
-	ring->sq_mask = max - 1u;
-	ring->cq_mask = (max * 2u) - 1u;
+	*sq_head_p = sq_head;
+	return ret;
+}
 
-	ring->sqes = calloc(ring->sq_mask + 1u, sizeof(ring->sqes[0]));
-	if (!ring->sqes)
-		return -ENOMEM;
+/*
+ * Issue the SQEs between sq_head and @sq_tail. Only one thread consumes
+ * the SQ: the owner of the ring in gw_ring_submit(), or the SQ thread
+ * with GW_RING_SETUP_F_SQPOLL. Returns the number of SQEs issued.
+ *
+ * Never waits for room in the io workqueues. Once they are full, the
+ * SQEs from the first one that found no room on stay in the SQ, see
+ * flush_punt_batch(). Returns -EBUSY if nothing could be issued
+ * because of that.
+ */
+static int __submit_sqes(struct gw_ring *ring, uint32_t sq_tail)
+{
+	struct gw_ring_sqe *sqe;
+	uint32_t sq_mask = ring->sq_mask;
+	uint32_t sq_head;
+	uint32_t idx;
+	struct link_data *link;
+	struct punt_batch pb;
+	int nr_links;
+	int ret = 0;
 
-	ring->cqes = calloc(ring->cq_mask + 1u, sizeof(ring->cqes[0]));
-	if (!ring->cqes) {
-		ret = -ENOMEM;
-		goto out_free_sqes;
-	}
+	init_punt_batch(&pb, true);
+	sq_head = atomic_load_explicit(&ring->sq_head, memory_order_relaxed);
+	pb.direct_end = sq_head;
 
-	ret = mutex_init(&ring->sq_lock);
-	if (ret)
-		goto out_free_cqes;
-	
-	ret = mutex_init(&ring->cq_lock);
-	if (ret)
-		goto out_free_sq_lock;
+	while (sq_head != sq_tail) {
+		pb.sq_pos = sq_head;
+		pb.punted = false;
+		idx = sq_head++ & sq_mask;
+		sqe = &ring->sqes[idx];
+		link = NULL;
+		nr_links = 0;
 
-	ret = cond_init(&ring->wait_cqe_cond);
-	if (ret)
-		goto out_free_cq_lock;
+		if (unlikely(sqe->flags & GW_RING_SQE_F_LINK)) {
+			nr_links = prep_link_chain(ring, &sq_head, sq_tail,
+						   &link);
+			if (unlikely(nr_links < 0)) {
+				post_cqe(ring, sqe, -ECANCELED);
+				punt_failed(sqe);
+				pb.direct_end = sq_head;
+				continue;
+			}
+		}
 
-	ret = alloc_workqueue(&ring->wq, &attr);
-	if (ret)
-		goto out_free_wait_cqe_cond;
+		if (likely(submit_sqe(ring, sqe, link, &pb))) {
+			ret += 1 + nr_links;
+		} else if (unlikely(link)) {
+			cancel_link(ring, link);
+		}
 
-	return 0;
+		if (!pb.punted)
+			pb.direct_end = sq_head;
+		if (unlikely(pb.busy))
+			break;
+	}
 
-out_free_wait_cqe_cond:
-	cond_destroy(&ring->wait_cqe_cond);
-out_free_cq_lock:
-	mutex_destroy(&ring->cq_lock);
-out_free_sq_lock:
-	mutex_destroy(&ring->sq_lock);
-out_free_cqes:
-	free(ring->cqes);
-out_free_sqes:
-	free(ring->sqes);
+	/*
+	 * The punted SQEs still point into the SQ, so flush them before
+	 * handing the slots back to the producer.
+	 */
+	pb.nr_failed += flush_punt_batch(ring, &pb);
+	if (unlikely(pb.nr_left)) {
+		ret -= (int)(sq_head - pb.sq_restart);
+		sq_head = pb.sq_restart;
+	}
+	smp_store_release(&ring->sq_head, sq_head);
+
+	ret -= (int)pb.nr_failed;
+	if (unlikely(pb.busy)) {
+		owner_inc(&ring->nr_sq_busy);
+		if (ret <= 0)
+			return -EBUSY;
+	}
 	return ret;
 }
 
-void gw_ring_destroy(struct gw_ring *ring)
+static void wake_up_sq_thread(struct gw_ring *ring)
 {
-	mutex_lock(&ring->sq_lock);
-	mutex_lock(&ring->cq_lock);
-	ring->should_stop = true;
-	if (ring->wait_cqe_cond_flag)
-		cond_broadcast(&ring->wait_cqe_cond);
-	mutex_unlock(&ring->cq_lock);
-	mutex_unlock(&ring->sq_lock);
-	destroy_workqueue(ring->wq);
-
-	mutex_destroy(&ring->cq_lock);
-	mutex_destroy(&ring->sq_lock);
-	cond_destroy(&ring->wait_cqe_cond);
-	free(ring->cqes);
-	free(ring->sqes);
+	mutex_lock(&ring->sq_wait_lock);
+	cond_signal(&ring->sq_wait_cond);
+	mutex_unlock(&ring->sq_wait_lock);
 }
 
-static void wake_up_wait_cqe_callers(struct gw_ring *ring)
-	__must_hold(&ring->cq_lock)
+/*
+ * With GW_RING_SETUP_F_SQPOLL, submitting only publishes the new tail
+ * and wakes up the SQ thread if it is parked. Returns the number of
+ * SQEs published.
+ */
+static int sqpoll_submit(struct gw_ring *ring)
 {
-	if (ring->wait_cqe_cond_flag)
-		cond_broadcast(&ring->wait_cqe_cond);
+	uint32_t sq_tail = atomic_load_explicit(&ring->sq_tail,
+						memory_order_relaxed);
+	uint32_t sqe_tail = ring->sqe_tail;
+
+	smp_store_release(&ring->sq_tail, sqe_tail);
+
+	/*
+	 * Pairs with the fence in sq_thread_park(). Either we see
+	 * GW_RING_SQ_F_NEED_WAKEUP, or the SQ thread sees the new tail.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (unlikely(atomic_load_explicit(&ring->sq_flags,
+					  memory_order_relaxed) &
+		     GW_RING_SQ_F_NEED_WAKEUP))
+		wake_up_sq_thread(ring);
+
+	return (int)(sqe_tail - sq_tail);
 }
 
-static bool post_cqe(struct gw_ring *ring, struct gw_ring_sqe *sqe,
-		     int64_t res)
+/*
+ * Returns the number of SQEs issued (published with SQPOLL), or
+ * -EBUSY if the io workqueues had no room for any of them. The SQEs
+ * that could not be issued stay in the SQ for the next call.
+ */
+int gw_ring_submit(struct gw_ring *ring)
 {
-	struct gw_ring_cqe *cqe;
-	uint32_t cq_mask = ring->cq_mask;
-	uint32_t cq_tail;
-	uint32_t cq_head;
+	if (unlikely(atomic_load_explicit(&ring->should_stop,
+					  memory_order_acquire)))
+		return -EOWNERDEAD;
 
-	mutex_lock(&ring->cq_lock);
-	cq_tail = smp_load_acquire(&ring->cq_tail);
-	cq_head = smp_load_acquire(&ring->cq_head);
-
-	if (unlikely(u32_diff(cq_tail, cq_head) >= cq_mask + 1u)) {
-		mutex_unlock(&ring->cq_lock);
-		return false;
-	}
+	if (ring->setup_flags & GW_RING_SETUP_F_SQPOLL)
+		return sqpoll_submit(ring);
 
-	cqe = &ring->cqes[cq_tail & cq_mask];
-	cqe->op = sqe->op;
-	cqe->res = res;
-	cqe->flags = 0;
-	cqe->user_data = sqe->user_data;
-	smp_store_release(&ring->cq_tail, cq_tail + 1u);
-	wake_up_wait_cqe_callers(ring);
-	mutex_unlock(&ring->cq_lock);
-	return true;
+	/*
+	 * Publish the entries filled since the last submit. The caller
+	 * is also the consumer here, but keep the release/acquire pair
+	 * so the SQ stays a proper SPSC queue.
+	 */
+	smp_store_release(&ring->sq_tail, ring->sqe_tail);
+	return __submit_sqes(ring, smp_load_acquire(&ring->sq_tail));
 }
 
-static bool issue_op_nop(struct gw_ring *ring, struct gw_ring_sqe *sqe)
-	__must_hold(&ring->sq_lock)
+static void sq_thread_park(struct gw_ring *ring)
 {
-	return post_cqe(ring, sqe, 0);
+	uint32_t sq_head = atomic_load_explicit(&ring->sq_head,
+						memory_order_relaxed);
+
+	mutex_lock(&ring->sq_wait_lock);
+	atomic_fetch_or_explicit(&ring->sq_flags, GW_RING_SQ_F_NEED_WAKEUP,
+				 memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (smp_load_acquire(&ring->sq_tail) == sq_head &&
+	    !atomic_load_explicit(&ring->should_stop, memory_order_acquire))
+		cond_wait(&ring->sq_wait_cond, &ring->sq_wait_lock);
+	atomic_fetch_and_explicit(&ring->sq_flags, ~GW_RING_SQ_F_NEED_WAKEUP,
+				  memory_order_relaxed);
+	mutex_unlock(&ring->sq_wait_lock);
 }
 
-static bool issue_op_tg_api_call(struct gw_ring *ring, struct gw_ring_sqe *sqe)
-	__must_hold(&ring->sq_lock)
+static void sq_thread_back_off(uint32_t *busy_ns)
 {
-	return punt_to_io_wq(ring, sqe);
+	struct timespec ts = { 0, 0 };
+
+	if (!*busy_ns)
+		*busy_ns = GW_RING_SQ_BUSY_MIN_NS;
+	else if (*busy_ns < GW_RING_SQ_BUSY_MAX_NS)
+		*busy_ns *= 2u;
+
+	ts.tv_nsec = (long)*busy_ns;
+	nanosleep(&ts, NULL);
 }
 
-static bool issue_op_module_handle(struct gw_ring *ring, struct gw_ring_sqe *sqe)
-	__must_hold(&ring->sq_lock)
+/*
+ * Issue new SQEs as soon as they are published. After
+ * GW_RING_SQ_THREAD_IDLE_NS without any, park until gw_ring_submit()
+ * wakes us up. While the io workqueues are full, retry with a growing
+ * sleep in between.
+ */
+static void *gw_ring_sq_thread(void *arg)
 {
-	if (!punt_to_io_wq(ring, sqe)) {
-		tgapi_free_update(sqe->tg_module_handle.update);
-		return false;
+	struct gw_ring *ring = arg;
+	uint64_t idle_end = 0;
+	uint32_t busy_ns = 0;
+	uint32_t sq_tail;
+
+	while (!atomic_load_explicit(&ring->should_stop, memory_order_acquire)) {
+		sq_tail = smp_load_acquire(&ring->sq_tail);
+		if (sq_tail != atomic_load_explicit(&ring->sq_head,
+						    memory_order_relaxed)) {
+			if (unlikely(__submit_sqes(ring, sq_tail) == -EBUSY))
+				sq_thread_back_off(&busy_ns);
+			else
+				busy_ns = 0;
+			idle_end = 0;
+			continue;
+		}
+
+		if (!idle_end) {
+			idle_end = gw_time_now_ns() + GW_RING_SQ_THREAD_IDLE_NS;
+		} else if (gw_time_now_ns() >= idle_end) {
+			sq_thread_park(ring);
+			idle_end = 0;
+			continue;
+		}
+
+		sched_yield();
 	}
 
-	return true;
+	return NULL;
 }
 
-static bool submit_sqe(struct gw_ring *ring, struct gw_ring_sqe *sqe)
-	__must_hold(&ring->sq_lock)
+struct gw_ring_sqe *gw_ring_get_sqe(struct gw_ring *ring)
 {
-	switch (sqe->op) {
-	case GW_RING_OP_NOP:
-		return issue_op_nop(ring, sqe);
-	case GW_RING_OP_TG_API_CALL:
-		return issue_op_tg_api_call(ring, sqe);
-	case GW_RING_OP_MODULE_HANDLE:
-		return issue_op_module_handle(ring, sqe);
-	default:
-		return false;
+	uint32_t sq_head = smp_load_acquire(&ring->sq_head);
+	uint32_t sqe_tail = ring->sqe_tail;
+	struct gw_ring_sqe *sqe;
+
+	if (unlikely(sqe_tail - sq_head >= ring->sq_mask + 1u)) {
+		owner_inc(&ring->nr_sqe_full);
+		return NULL;
 	}
+
+	sqe = &ring->sqes[sqe_tail & ring->sq_mask];
+	sqe->flags = 0;
+	sqe->prio = WQ_PRIO_NORMAL;
+	ring->sqe_tail = sqe_tail + 1u;
+	return sqe;
 }
 
-int gw_ring_submit(struct gw_ring *ring)
+/*
+ * Reserve up to @nr SQEs at once. Returns the number of SQEs stored
+ * in @sqes, which is less than @nr if the SQ does not have enough
+ * free entries.
+ */
+uint32_t gw_ring_get_sqes(struct gw_ring *ring, uint32_t nr,
+			  struct gw_ring_sqe **sqes)
 {
-	struct gw_ring_sqe *sqe;
+	uint32_t sq_head = smp_load_acquire(&ring->sq_head);
+	uint32_t sqe_tail = ring->sqe_tail;
 	uint32_t sq_mask = ring->sq_mask;
-	uint32_t sq_tail;
-	uint32_t sq_head;
-	uint32_t idx;
-	int ret = 0;
+	uint32_t avail;
+	uint32_t i;
 
-	mutex_lock(&ring->sq_lock);
-	if (unlikely(ring->should_stop)) {
-		ret = -EOWNERDEAD;
-		goto out;
+	avail = sq_mask + 1u - (sqe_tail - sq_head);
+	if (unlikely(nr > avail)) {
+		owner_inc(&ring->nr_sqe_full);
+		nr = avail;
 	}
 
-	sq_head = smp_load_acquire(&ring->sq_head);
-	sq_tail = smp_load_acquire(&ring->sq_tail);
+	for (i = 0; i < nr; i++) {
+		sqes[i] = &ring->sqes[(sqe_tail + i) & sq_mask];
+		sqes[i]->flags = 0;
+		sqes[i]->prio = WQ_PRIO_NORMAL;
+	}
 
-	while (sq_head != sq_tail) {
-		idx = sq_head++ & sq_mask;
-		sqe = &ring->sqes[idx];
-		if (likely(submit_sqe(ring, sqe)))
-			ret++;
+	ring->sqe_tail = sqe_tail + nr;
+	return nr;
+}
+
+static int __gw_ring_wait_cqe(struct gw_ring *ring, struct gw_ring_cqe **cqe_p)
+{
+	uint32_t cq_head = atomic_load_explicit(&ring->cq_head,
+						memory_order_relaxed);
+	struct gw_ring_cqe *cqe;
+	int ret = 0;
+
+	cqe = gw_ring_load_head_cqe(ring, cq_head);
+	if (unlikely(!cqe)) {
+		if (likely(!gw_ring_cq_overflowed(ring)))
+			return -EAGAIN;
+
+		__gw_ring_cq_flush_overflow(ring);
+		cqe = gw_ring_load_head_cqe(ring, cq_head);
+		if (!cqe)
+			return -EAGAIN;
 	}
 
-	smp_store_release(&ring->sq_head, sq_head);
-out:
-	mutex_unlock(&ring->sq_lock);
+	*cqe_p = cqe;
+	do {
+		ret++;
+		cq_head++;
+	} while (gw_ring_load_head_cqe(ring, cq_head));
+
 	return ret;
 }
 
-struct gw_ring_sqe *gw_ring_get_sqe(struct gw_ring *ring)
+/*
+ * Set how long gw_ring_wait_cqe() may spin on an empty CQ before it goes
+ * to sleep. Spinning saves the futex sleep and wakeup when completions
+ * come in quick succession, at the cost of CPU time. 0 disables it.
+ *
+ * The actual spin time is adapted to the recent waits: twice their
+ * average, and none at all if completions are far apart compared to
+ * @max_spin_ns. The default is GW_RING_WAIT_MAX_SPIN_NS, or 0 on a
+ * single CPU.
+ */
+void gw_ring_set_wait_spin(struct gw_ring *ring, uint32_t max_spin_ns)
 {
-	struct gw_ring_sqe *sqe = NULL;
-	uint32_t sq_head, sq_tail;
+	ring->cq_wait_max_spin_ns = max_spin_ns;
+	ring->cq_wait_avg_ns = 0;
+}
 
-	mutex_lock(&ring->sq_lock);
-	sq_head = smp_load_acquire(&ring->sq_head);
-	sq_tail = smp_load_acquire(&ring->sq_tail);
-	if (unlikely(u32_diff(sq_head, sq_tail) >= ring->sq_mask + 1u))
-		goto out;
-	sqe = &ring->sqes[sq_tail & ring->sq_mask];
-	smp_store_release(&ring->sq_tail, sq_tail + 1u);
-out:
-	mutex_unlock(&ring->sq_lock);
-	return sqe;
+static uint64_t wait_spin_budget(struct gw_ring *ring)
+{
+	uint64_t max_spin = ring->cq_wait_max_spin_ns;
+	uint64_t avg = ring->cq_wait_avg_ns;
+
+	if (avg > max_spin * 4u)
+		return 0;
+
+	return (avg * 2u < max_spin) ? avg * 2u : max_spin;
 }
 
-static int __gw_ring_wait_cqe(struct gw_ring *ring, struct gw_ring_cqe **cqe_p)
-	__must_hold(&ring->cq_lock)
+/*
+ * Fold the time the last wait took into the moving average. Samples
+ * are capped so that the average recovers quickly once completions
+ * come in fast again.
+ */
+static void update_wait_avg(struct gw_ring *ring, uint64_t waited)
 {
-	struct gw_ring_cqe *cqe;
-	uint32_t cq_mask = ring->cq_mask;
-	uint32_t cq_tail;
-	uint32_t cq_head;
+	uint64_t cap = (uint64_t)ring->cq_wait_max_spin_ns * 8u;
+	int64_t avg = ring->cq_wait_avg_ns;
 
-	cq_tail = smp_load_acquire(&ring->cq_tail);
-	cq_head = smp_load_acquire(&ring->cq_head);
-	if (unlikely(cq_tail == cq_head))
-		return -EAGAIN;
+	if (waited > cap)
+		waited = cap;
 
-	cqe = &ring->cqes[cq_head & cq_mask];
-	*cqe_p = cqe;
-	return u32_diff(cq_tail, cq_head);
+	avg += ((int64_t)waited - avg) / 8;
+	ring->cq_wait_avg_ns = (uint64_t)avg;
 }
 
-int gw_ring_wait_cqe(struct gw_ring *ring, struct gw_ring_cqe **cqe_p)
+/*
+ * Spin until @min_nr CQEs are ready, for at most @budget nanoseconds
+ * (and not past @deadline if it is non-zero).
+ */
+static int spin_wait_cqe(struct gw_ring *ring, struct gw_ring_cqe **cqe_p,
+			 uint32_t min_nr, uint64_t start, uint64_t budget,
+			 uint64_t deadline)
+{
+	uint64_t end = start + budget;
+	uint32_t i = 0;
+	int ret;
+
+	if (deadline && deadline < end)
+		end = deadline;
+
+	while (1) {
+		cpu_relax();
+		ret = __gw_ring_wait_cqe(ring, cqe_p);
+		if (ret >= (int)min_nr)
+			return ret;
+
+		/*
+		 * Reading the clock costs more than a pause, so only
+		 * check it every few iterations.
+		 */
+		if (!(++i & 31u) && gw_time_now_ns() >= end)
+			return ret;
+	}
+}
+
+/*
+ * Sleep on cq_wait_cond until @min_nr CQEs are ready or @deadline has
+ * passed. On timeout, return the CQEs that are ready, if any.
+ */
+static int sleep_wait_cqe(struct gw_ring *ring, struct gw_ring_cqe **cqe_p,
+			  uint32_t min_nr, uint64_t deadline)
 {
+	struct timespec ts;
 	int ret;
 
-	mutex_lock(&ring->cq_lock);
+	if (deadline)
+		gw_ns_to_timespec(&ts, deadline);
+
+	atomic_store_explicit(&ring->cq_wait_nr, min_nr, memory_order_relaxed);
+	mutex_lock(&ring->cq_wait_lock);
 	while (1) {
-		if (unlikely(ring->should_stop)) {
+		if (unlikely(atomic_load_explicit(&ring->should_stop,
+						  memory_order_acquire))) {
 			ret = -EOWNERDEAD;
 			break;
 		}
 
+		atomic_fetch_add_explicit(&ring->nr_cq_waiters, 1u,
+					  memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
 		ret = __gw_ring_wait_cqe(ring, cqe_p);
-		if (likely(ret > 0))
+		if (likely(ret >= (int)min_nr)) {
+			atomic_fetch_sub_explicit(&ring->nr_cq_waiters, 1u,
+						  memory_order_relaxed);
+			break;
+		}
+
+		if (!deadline) {
+			cond_wait(&ring->cq_wait_cond, &ring->cq_wait_lock);
+		} else if (cond_timedwait(&ring->cq_wait_cond,
+					  &ring->cq_wait_lock, &ts) == -ETIMEDOUT) {
+			atomic_fetch_sub_explicit(&ring->nr_cq_waiters, 1u,
+						  memory_order_relaxed);
+			ret = __gw_ring_wait_cqe(ring, cqe_p);
+			if (ret <= 0)
+				ret = -ETIME;
 			break;
+		}
+		atomic_fetch_sub_explicit(&ring->nr_cq_waiters, 1u,
+					  memory_order_relaxed);
+	}
+	mutex_unlock(&ring->cq_wait_lock);
+	return ret;
+}
+
+/*
+ * Wait until at least @min_nr CQEs are ready or until @deadline
+ * (CLOCK_MONOTONIC nanoseconds) has passed. A zero @deadline means no
+ * limit.
+ */
+static int wait_cqe_deadline(struct gw_ring *ring, struct gw_ring_cqe **cqe_p,
+			     uint32_t min_nr, uint64_t deadline)
+{
+	uint64_t budget;
+	uint64_t start;
+	int ret;
+
+	/*
+	 * The CQ can't hold more than cq_mask + 1 CQEs, and the
+	 * consumer has to reap them to let the overflowed ones in.
+	 */
+	if (unlikely(min_nr > ring->cq_mask + 1u))
+		min_nr = ring->cq_mask + 1u;
+	else if (unlikely(!min_nr))
+		min_nr = 1;
 
-		ring->wait_cqe_cond_flag = true;
-		cond_wait(&ring->wait_cqe_cond, &ring->cq_lock);
-		ring->wait_cqe_cond_flag = false;
+	ret = __gw_ring_wait_cqe(ring, cqe_p);
+	if (likely(ret >= (int)min_nr))
+		return ret;
+
+	if (!ring->cq_wait_max_spin_ns)
+		return sleep_wait_cqe(ring, cqe_p, min_nr, deadline);
+
+	start = gw_time_now_ns();
+	budget = wait_spin_budget(ring);
+	if (budget) {
+		ret = spin_wait_cqe(ring, cqe_p, min_nr, start, budget,
+				    deadline);
+		if (ret >= (int)min_nr)
+			goto out;
 	}
-	mutex_unlock(&ring->cq_lock);
+
+	ret = sleep_wait_cqe(ring, cqe_p, min_nr, deadline);
+out:
+	if (ret > 0)
+		update_wait_avg(ring, gw_time_now_ns() - start);
+
 	return ret;
 }
 
-static bool __issue_op_tg_api_call(struct gw_ring *ring,
-				   struct gw_ring_sqe *sqe)
+int gw_ring_wait_cqe(struct gw_ring *ring, struct gw_ring_cqe **cqe_p)
+{
+	return wait_cqe_deadline(ring, cqe_p, 1, 0);
+}
+
+/*
+ * Like gw_ring_wait_cqe(), but give up after @ts (relative) and return
+ * -ETIME if no CQE is ready by then. A NULL @ts waits forever.
+ */
+int gw_ring_wait_cqe_timeout(struct gw_ring *ring, struct gw_ring_cqe **cqe_p,
+			     const struct timespec *ts)
+{
+	uint64_t deadline = 0;
+
+	if (ts)
+		deadline = gw_time_now_ns() + gw_timespec_to_ns(ts);
+
+	return wait_cqe_deadline(ring, cqe_p, 1, deadline);
+}
+
+/*
+ * Wait until at least @min_nr CQEs are ready, so that a busy consumer
+ * is woken up once per batch instead of once per CQE. If @ts (relative)
+ * runs out first, return whatever is ready, or -ETIME if the CQ is
+ * still empty. A NULL @ts waits forever. @min_nr is capped at the CQ
+ * size. Returns the number of ready CQEs, the first one in @cqe_p.
+ */
+int gw_ring_wait_cqes(struct gw_ring *ring, struct gw_ring_cqe **cqe_p,
+		      uint32_t min_nr, const struct timespec *ts)
+{
+	uint64_t deadline = 0;
+
+	if (ts)
+		deadline = gw_time_now_ns() + gw_timespec_to_ns(ts);
+
+	return wait_cqe_deadline(ring, cqe_p, min_nr, deadline);
+}
+
+static void sum_op_counters(struct gw_ring_op_stats *st,
+			    struct ring_op_counters *c)
+{
+	uint32_t i;
+
+	st->nr_submitted += atomic_load_explicit(&c->nr_submitted,
+						 memory_order_relaxed);
+	st->nr_completed += atomic_load_explicit(&c->nr_completed,
+						 memory_order_relaxed);
+	st->nr_punted += atomic_load_explicit(&c->nr_punted,
+					      memory_order_relaxed);
+	for (i = 0; i < GW_RING_LAT_NR_BUCKETS; i++) {
+		st->queue_lat[i] += atomic_load_explicit(&c->queue_lat[i],
+							 memory_order_relaxed);
+		st->run_lat[i] += atomic_load_explicit(&c->run_lat[i],
+						       memory_order_relaxed);
+	}
+}
+
+/*
+ * Take a snapshot of the ring counters. The shards are summed up
+ * without stopping the ring, so the numbers of a busy ring may be a
+ * little inconsistent with each other (e.g., a CQE counted as
+ * completed before its SQE is counted as punted).
+ */
+void gw_ring_get_stats(struct gw_ring *ring, struct gw_ring_stats *stats)
+{
+	struct workqueue_lane_stats lst;
+	struct gw_pool_stats pst;
+	uint32_t i;
+	uint32_t j;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->sq_depth = atomic_load_explicit(&ring->sq_tail,
+					       memory_order_relaxed) -
+			  atomic_load_explicit(&ring->sq_head,
+					       memory_order_relaxed);
+	stats->cq_depth = atomic_load_explicit(&ring->cq_tail,
+					       memory_order_relaxed) -
+			  atomic_load_explicit(&ring->cq_head,
+					       memory_order_relaxed);
+	for (i = 0; i < ring->nr_wqs; i++) {
+		for (j = 0; j < WQ_NR_PRIO; j++) {
+			workqueue_get_lane_stats(ring->wqs[i], j, &lst);
+			stats->wq_depth[j] += lst.depth;
+		}
+	}
+
+	stats->nr_sqe_full = atomic_load_explicit(&ring->nr_sqe_full,
+						  memory_order_relaxed);
+	stats->nr_sq_busy = atomic_load_explicit(&ring->nr_sq_busy,
+						 memory_order_relaxed);
+	stats->cq_overflow = atomic_load_explicit(&ring->cq_overflow,
+						  memory_order_relaxed);
+	stats->cq_dropped = atomic_load_explicit(&ring->cq_dropped,
+						 memory_order_relaxed);
+
+	/*
+	 * The counters of the other threads are folded in lazily, so
+	 * the frees may get ahead of the allocations for a while.
+	 */
+	gw_pool_get_stats(ring->sqe_pool, &pst);
+	stats->pool_nr_objs = pst.nr_objs;
+	if (pst.nr_alloc > pst.nr_free)
+		stats->pool_in_use = pst.nr_alloc - pst.nr_free;
+	stats->pool_nr_refill = pst.nr_refill;
+	stats->pool_nr_fallback = pst.nr_fallback;
+
+	for (i = 0; i < GW_RING_STATS_NR_SHARDS; i++) {
+		for (j = 0; j < GW_RING_NR_OPS; j++)
+			sum_op_counters(&stats->ops[j],
+					&ring->stats_shards[i].ops[j]);
+	}
+}
+
+/*
+ * Keep calling getUpdates and post one CQE with GW_RING_CQE_F_MORE per
+ * non-empty batch, advancing the offset past the last update seen.
+ * Returns the result of the final CQE.
+ */
+static int get_updates_multishot(struct wq_sqe_data *data)
+{
+	struct tg_api_call *call = &data->sqe.tg_api_call;
+	struct gw_ring *ring = data->ring;
+	struct tg_updates *updates;
+	int64_t offset = call->offset;
+	size_t i;
+	int res;
+
+	while (1) {
+		if (unlikely(gw_ring_cancel_requested() ||
+			     atomic_load_explicit(&ring->should_stop,
+						  memory_order_relaxed)))
+			return -ECANCELED;
+
+		updates = NULL;
+		res = tgapi_call_get_updates(call->ctx, &updates, offset);
+		if (unlikely(res < 0))
+			return res;
+
+		if (!updates)
+			continue;
+
+		if (!updates->len) {
+			tgapi_free_updates(updates);
+			continue;
+		}
+
+		/*
+		 * The batch belongs to the consumer once it is posted,
+		 * so compute the next offset first.
+		 */
+		for (i = 0; i < updates->len; i++) {
+			if ((int64_t)updates->updates[i].update_id >= offset)
+				offset = (int64_t)updates->updates[i].update_id + 1;
+		}
+
+		/*
+		 * Stop if even the overflow list is full. The consumer
+		 * re-arms from the last update it has seen, so the
+		 * batch is fetched again instead of being lost.
+		 */
+		if (unlikely(!post_cqe_flags(ring, &data->sqe, 0,
+					     GW_RING_CQE_F_MORE, updates))) {
+			tgapi_free_updates(updates);
+			return -EOVERFLOW;
+		}
+	}
+}
+
+static void __issue_op_tg_api_call(struct wq_sqe_data *data)
 {
-	struct tg_api_call *call = &sqe->tg_api_call;
+	struct tg_api_call *call = &data->sqe.tg_api_call;
 	int res;
 
+	gw_curl_set_cancel_flag(&data->cnode.cancel_requested);
 	switch (call->op) {
 	case TG_API_GET_UPDATES:
 		res = tgapi_call_get_updates(call->ctx, call->updates_p,
 					     call->offset);
 		break;
+	case TG_API_GET_UPDATES_MULTISHOT:
+		res = get_updates_multishot(data);
+		break;
 	default:
 		res = -EOPNOTSUPP;
 		break;
 	}
+	gw_curl_set_cancel_flag(NULL);
 
-	return post_cqe(ring, sqe, res);
+	finish_cancelable(data->ring, &data->cnode, &data->sqe, res, data->link);
 }
 
-static bool __issue_op_module_handle(struct gw_ring *ring,
-				     struct gw_ring_sqe *sqe)
+static void __issue_op_module_handle(struct wq_sqe_data *data)
 {
-	struct tg_module_handle *handle = &sqe->tg_module_handle;
+	struct tg_module_handle *handle = &data->sqe.tg_module_handle;
 	int res;
 
 	res = gw_module_handle(handle->ctx, handle->update);
-	return post_cqe(ring, sqe, res);
+	finish_cancelable(data->ring, &data->cnode, &data->sqe, res, data->link);
 }
 
-static bool punt_to_io_wq(struct gw_ring *ring, struct gw_ring_sqe *sqe)
-	__must_hold(&ring->sq_lock)
+static bool punt_to_io_wq(struct gw_ring *ring, struct gw_ring_sqe *sqe,
+			  struct link_data *link, struct punt_batch *pb)
 {
-	struct wq_sqe_data *data;
-	int ret;
-
-	data = malloc(sizeof(*data));
-	if (unlikely(!data))
-		return false;
-
-	data->ring = ring;
-	data->sqe = *sqe;
-	ret = queue_work(ring->wq, gw_ring_wq_sqe_exec, data,
-			 gw_ring_wq_sqe_delete);
-	if (unlikely(ret < 0)) {
-		free(data);
-		return false;
-	}
+	pb->sqes[pb->nr] = sqe;
+	pb->links[pb->nr] = link;
+	pb->pos[pb->nr] = pb->sq_pos;
+	pb->punted = true;
+	pb->nr++;
+	if (unlikely(pb->nr == GW_RING_PUNT_BATCH))
+		pb->nr_failed += flush_punt_batch(ring, pb);
 
 	return true;
 }
@@ -319,19 +2240,43 @@ static void gw_ring_wq_sqe_exec(void *data)
 {
 	struct wq_sqe_data *sqe_data = data;
 	struct gw_ring *ring = sqe_data->ring;
-	struct gw_ring_sqe *sqe = &sqe_data->sqe;
+	struct ring_op_counters *c;
+	uint64_t start;
 
-	switch (sqe->op) {
+	if (unlikely(!start_cancelable(ring, &sqe_data->cnode))) {
+		cancel_link(ring, sqe_data->link);
+		sqe_data->link = NULL;
+		return;
+	}
+
+	trace_ring_dispatch(ring, &sqe_data->sqe);
+	c = this_op_counters(ring, sqe_data->sqe.op);
+	start = gw_time_now_ns();
+	if (likely(c))
+		shard_inc(&c->queue_lat[lat_bucket(start - sqe_data->punt_ns)]);
+
+	current_cnode = &sqe_data->cnode;
+	switch (sqe_data->sqe.op) {
 	case GW_RING_OP_NOP:
-		issue_op_nop(ring, sqe);
+		finish_cancelable(ring, &sqe_data->cnode, &sqe_data->sqe, 0,
+				  sqe_data->link);
 		break;
 	case GW_RING_OP_TG_API_CALL:
-		__issue_op_tg_api_call(ring, sqe);
+		__issue_op_tg_api_call(sqe_data);
 		break;
 	case GW_RING_OP_MODULE_HANDLE:
-		__issue_op_module_handle(ring, sqe);
+		__issue_op_module_handle(sqe_data);
 		break;
 	}
+	current_cnode = NULL;
+	if (likely(c))
+		shard_inc(&c->run_lat[lat_bucket(gw_time_now_ns() - start)]);
+
+	/*
+	 * The chain now belongs to the next request, or it has been
+	 * cancelled.
+	 */
+	sqe_data->link = NULL;
 }
 
 static void gw_ring_wq_sqe_delete(void *data)
@@ -347,5 +2292,6 @@ static void gw_ring_wq_sqe_delete(void *data)
 		break;
 	}
 
-	free(data);
+	free_link(sqe_data->link);
+	gw_pool_free(sqe_data->ring->sqe_pool, sqe_data);
 }
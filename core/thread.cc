@@ -4,6 +4,7 @@
  */
 
 #include <mutex>
+#include <chrono>
 #include <cerrno>
 #include <thread>
 #include <cstdlib>
@@ -22,6 +23,11 @@ int thread_create(thread_t *ts_p, void *(*func)(void *), void *arg)
 	return pthread_create(ts_p, nullptr, func, arg);
 }
 
+int thread_once(thread_once_t *once, void (*func)(void))
+{
+	return pthread_once(once, func);
+}
+
 int thread_join(thread_t ts, void **ret)
 {
 	return pthread_join(ts, ret);
@@ -52,9 +58,25 @@ void mutex_destroy(mutex_t *m)
 	pthread_mutex_destroy(m);
 }
 
+/*
+ * Condition variables use CLOCK_MONOTONIC, so the abstime passed to
+ * cond_timedwait() is not affected by wall clock adjustments.
+ */
 int cond_init(cond_t *c)
 {
-	return pthread_cond_init(c, nullptr);
+	pthread_condattr_t attr;
+	int ret;
+
+	ret = pthread_condattr_init(&attr);
+	if (ret)
+		return ret;
+
+	ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (!ret)
+		ret = pthread_cond_init(c, &attr);
+
+	pthread_condattr_destroy(&attr);
+	return ret;
 }
 
 int cond_wait(cond_t *c, mutex_t *m)
@@ -62,6 +84,11 @@ int cond_wait(cond_t *c, mutex_t *m)
 	return pthread_cond_wait(c, m);
 }
 
+int cond_timedwait(cond_t *c, mutex_t *m, const struct timespec *abstime)
+{
+	return -pthread_cond_timedwait(c, m, abstime);
+}
+
 int cond_signal(cond_t *c)
 {
 	return pthread_cond_signal(c);
@@ -137,6 +164,22 @@ void thread_detach(struct thread_struct *ts)
 	free(ts);
 }
 
+int thread_once(thread_once_t *once, void (*func)(void))
+{
+	static std::mutex once_lock;
+
+	if (__atomic_load_n(once, __ATOMIC_ACQUIRE))
+		return 0;
+
+	std::lock_guard<std::mutex> lock(once_lock);
+	if (!__atomic_load_n(once, __ATOMIC_RELAXED)) {
+		func();
+		__atomic_store_n(once, 1, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+
 int mutex_init(struct mutex_struct **m)
 {
 	struct mutex_struct *mutex;
@@ -193,21 +236,53 @@ int cond_init(struct cond_struct **c)
 	return 0;
 }
 
+static std::unique_lock<std::mutex> *get_ulock(struct mutex_struct *m)
+{
+	std::unique_lock<std::mutex> *ulock = m->ulock;
+
+	/*
+	 * The mutex may already be owned by a unique_lock from a
+	 * previous wait in the same critical section.
+	 */
+	if (ulock)
+		return ulock;
+
+	ulock = new(std::nothrow)
+			std::unique_lock<std::mutex>(m->mutex, std::adopt_lock);
+	m->ulock = ulock;
+	return ulock;
+}
+
 int cond_wait(struct cond_struct **c, struct mutex_struct **m)
 {
 	std::unique_lock<std::mutex> *ulock;
 
-	ulock = new(std::nothrow)
-			std::unique_lock<std::mutex>((*m)->mutex,
-						     std::adopt_lock);
+	ulock = get_ulock(*m);
 	if (!ulock)
 		return -ENOMEM;
 
-	(*m)->ulock = ulock;
 	(*c)->cond.wait(*ulock);
 	return 0;
 }
 
+int cond_timedwait(struct cond_struct **c, struct mutex_struct **m,
+		   const struct timespec *abstime)
+{
+	std::chrono::steady_clock::time_point tp;
+	std::unique_lock<std::mutex> *ulock;
+	std::cv_status st;
+
+	ulock = get_ulock(*m);
+	if (!ulock)
+		return -ENOMEM;
+
+	tp += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::seconds(abstime->tv_sec) +
+		std::chrono::nanoseconds(abstime->tv_nsec));
+	st = (*c)->cond.wait_until(*ulock, tp);
+	return (st == std::cv_status::timeout) ? -ETIMEDOUT : 0;
+}
+
 int cond_signal(struct cond_struct **c)
 {
 	(*c)->cond.notify_one();
@@ -229,6 +304,43 @@ void cond_destroy(struct cond_struct **c)
 
 #endif /* #if defined(__linux__) */
 
+/*
+ * The hooks run from the destructor of a thread_local, which both
+ * std::thread and pthread threads call on exit.
+ */
+struct thread_exit_hooks {
+	struct {
+		void	(*func)(void *);
+		void	*arg;
+	} hooks[THREAD_MAX_AT_EXIT];
+	unsigned int	nr;
+
+	~thread_exit_hooks(void);
+};
+
+thread_exit_hooks::~thread_exit_hooks(void)
+{
+	while (nr) {
+		nr--;
+		hooks[nr].func(hooks[nr].arg);
+	}
+}
+
+static thread_local struct thread_exit_hooks exit_hooks;
+
+int thread_at_exit(void (*func)(void *), void *arg)
+{
+	struct thread_exit_hooks *h = &exit_hooks;
+
+	if (h->nr >= THREAD_MAX_AT_EXIT)
+		return -ENOMEM;
+
+	h->hooks[h->nr].func = func;
+	h->hooks[h->nr].arg = arg;
+	h->nr++;
+	return 0;
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
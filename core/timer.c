@@ -0,0 +1,412 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2023  Ammar Faizi <ammarfaizi2@gnuweeb.org>
+ *
+ * A single thread per timer base serves any number of timers. Pending
+ * timers are kept in a hierarchical timing wheel: GW_TIMER_LVL_DEPTH
+ * levels of 64 slots, where a slot of level n spans 64^n ticks. A timer
+ * goes to the level its distance from clk falls in. When clk reaches
+ * the start of a slot of level n > 0, the timers in that slot are
+ * cascaded to the lower levels. Adding and deleting a timer are O(1).
+ *
+ * The wheel only tells the timer thread when to look at a timer. The
+ * timers in the level 0 slot of the current tick still fire at their
+ * exact expiry time.
+ */
+
+#include <gw/common.h>
+#include <gw/thread.h>
+#include <gw/timer.h>
+#include <stdlib.h>
+
+enum {
+	GW_TIMER_LVL_BITS = 6,
+	GW_TIMER_LVL_SIZE = 1 << GW_TIMER_LVL_BITS,
+	GW_TIMER_LVL_MASK = GW_TIMER_LVL_SIZE - 1,
+	GW_TIMER_LVL_DEPTH = 6,
+	GW_TIMER_NR_SLOTS = GW_TIMER_LVL_SIZE * GW_TIMER_LVL_DEPTH,
+
+	/*
+	 * The slot of the timers that are due and waiting for the
+	 * timer thread to call them.
+	 */
+	GW_TIMER_SLOT_EXPIRED = GW_TIMER_NR_SLOTS,
+};
+
+#define GW_TIMER_TICK_NS	(1000ull * 1000ull)
+
+/*
+ * The farthest a timer is placed from clk, about 2 years with 1ms ticks.
+ * A timer expiring later goes to the top level, and gets placed again
+ * each time its slot is cascaded.
+ */
+#define GW_TIMER_MAX_DELTA \
+	((1ull << (GW_TIMER_LVL_BITS * GW_TIMER_LVL_DEPTH)) - 1ull)
+
+/*
+ * clk is the current tick. The timer thread only moves it forward once
+ * the level 0 slot of clk is empty. next_wake is when the timer thread
+ * is going to wake up, 0 while it is running.
+ */
+struct gw_timer_base {
+	bool			should_stop;
+	bool			thread_started;
+	uint64_t		clk;
+	uint64_t		next_wake;
+	uint64_t		pending[GW_TIMER_LVL_DEPTH];
+	struct gw_timer		*wheel[GW_TIMER_NR_SLOTS];
+	struct gw_timer		*expired;
+	thread_t		thread;
+	mutex_t			lock;
+	cond_t			cond;
+};
+
+static void *timer_thread_func(void *arg);
+
+int gw_timer_base_init(struct gw_timer_base **base_p)
+{
+	struct gw_timer_base *base;
+	int ret;
+
+	base = calloc(1u, sizeof(*base));
+	if (!base)
+		return -ENOMEM;
+
+	base->clk = gw_time_now_ns() / GW_TIMER_TICK_NS;
+	ret = mutex_init(&base->lock);
+	if (ret)
+		goto out_free_base;
+
+	ret = cond_init(&base->cond);
+	if (ret)
+		goto out_free_lock;
+
+	*base_p = base;
+	return 0;
+
+out_free_lock:
+	mutex_destroy(&base->lock);
+out_free_base:
+	free(base);
+	return ret;
+}
+
+/*
+ * Stop the timer thread. Once this returns, no callback is running or
+ * will run again, and gw_timer_add() fails with -EOWNERDEAD. Pending
+ * timers stay in the base until gw_timer_base_destroy().
+ */
+void gw_timer_base_stop(struct gw_timer_base *base)
+{
+	bool thread_started;
+
+	mutex_lock(&base->lock);
+	base->should_stop = true;
+	thread_started = base->thread_started;
+	base->thread_started = false;
+	cond_signal(&base->cond);
+	mutex_unlock(&base->lock);
+
+	if (thread_started)
+		thread_join(base->thread, NULL);
+}
+
+static struct gw_timer **slot_head(struct gw_timer_base *base, uint32_t slot)
+{
+	if (slot == GW_TIMER_SLOT_EXPIRED)
+		return &base->expired;
+
+	return &base->wheel[slot];
+}
+
+static void timer_link(struct gw_timer_base *base, struct gw_timer *t,
+		       uint32_t slot)
+	__must_hold(&base->lock)
+{
+	struct gw_timer **head = slot_head(base, slot);
+
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+	t->slot = slot;
+
+	if (slot != GW_TIMER_SLOT_EXPIRED)
+		base->pending[slot / GW_TIMER_LVL_SIZE] |=
+			1ull << (slot % GW_TIMER_LVL_SIZE);
+}
+
+static void timer_unlink(struct gw_timer_base *base, struct gw_timer *t)
+	__must_hold(&base->lock)
+{
+	uint32_t slot = t->slot;
+
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+
+	if (slot != GW_TIMER_SLOT_EXPIRED && !base->wheel[slot])
+		base->pending[slot / GW_TIMER_LVL_SIZE] &=
+			~(1ull << (slot % GW_TIMER_LVL_SIZE));
+}
+
+static void wheel_enqueue(struct gw_timer_base *base, struct gw_timer *t)
+	__must_hold(&base->lock)
+{
+	uint64_t tick = t->expires / GW_TIMER_TICK_NS;
+	uint64_t delta;
+	uint32_t lvl;
+	uint32_t idx;
+
+	if (tick < base->clk)
+		tick = base->clk;
+
+	delta = tick - base->clk;
+	if (delta > GW_TIMER_MAX_DELTA) {
+		delta = GW_TIMER_MAX_DELTA;
+		tick = base->clk + delta;
+	}
+
+	for (lvl = 0; lvl < GW_TIMER_LVL_DEPTH - 1; lvl++) {
+		if (delta < (1ull << (GW_TIMER_LVL_BITS * (lvl + 1))))
+			break;
+	}
+
+	idx = (uint32_t)(tick >> (GW_TIMER_LVL_BITS * lvl)) & GW_TIMER_LVL_MASK;
+	timer_link(base, t, lvl * GW_TIMER_LVL_SIZE + idx);
+}
+
+/*
+ * Move the timers of the current slot of @lvl to the lower levels.
+ */
+static void wheel_cascade(struct gw_timer_base *base, uint32_t lvl)
+	__must_hold(&base->lock)
+{
+	uint32_t idx = (uint32_t)(base->clk >> (GW_TIMER_LVL_BITS * lvl)) &
+		       GW_TIMER_LVL_MASK;
+	uint32_t slot = lvl * GW_TIMER_LVL_SIZE + idx;
+	struct gw_timer *t, *next;
+
+	t = base->wheel[slot];
+	base->wheel[slot] = NULL;
+	base->pending[lvl] &= ~(1ull << idx);
+	for (; t; t = next) {
+		next = t->next;
+		wheel_enqueue(base, t);
+	}
+}
+
+static uint64_t ror64(uint64_t x, uint32_t r)
+{
+	r &= 63u;
+	return r ? (x >> r) | (x << (64u - r)) : x;
+}
+
+/*
+ * Move clk towards @now_tick, to the next tick that has timers in
+ * level 0 or starts a slot of level 1, whichever comes first. The
+ * level 0 slot of clk must be empty.
+ */
+static void wheel_forward(struct gw_timer_base *base, uint64_t now_tick)
+	__must_hold(&base->lock)
+{
+	uint64_t next = (base->clk | GW_TIMER_LVL_MASK) + 1ull;
+	uint64_t map;
+	uint32_t lvl;
+
+	map = ror64(base->pending[0], (uint32_t)base->clk) & ~1ull;
+	if (map && base->clk + (uint64_t)__builtin_ctzll(map) < next)
+		next = base->clk + (uint64_t)__builtin_ctzll(map);
+	if (next > now_tick)
+		next = now_tick;
+
+	base->clk = next;
+	for (lvl = 1; lvl < GW_TIMER_LVL_DEPTH; lvl++) {
+		if (next & ((1ull << (GW_TIMER_LVL_BITS * lvl)) - 1ull))
+			break;
+		wheel_cascade(base, lvl);
+	}
+}
+
+/*
+ * Move the due timers of the current level 0 slot to the expired list.
+ * Returns the expiry time of the earliest timer left in the slot, or
+ * UINT64_MAX if it is empty.
+ */
+static uint64_t collect_expired(struct gw_timer_base *base, uint64_t now)
+	__must_hold(&base->lock)
+{
+	uint32_t slot = (uint32_t)base->clk & GW_TIMER_LVL_MASK;
+	uint64_t ret = UINT64_MAX;
+	struct gw_timer *t, *next;
+
+	for (t = base->wheel[slot]; t; t = next) {
+		next = t->next;
+		if (t->expires <= now) {
+			timer_unlink(base, t);
+			timer_link(base, t, GW_TIMER_SLOT_EXPIRED);
+		} else if (t->expires < ret) {
+			ret = t->expires;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * When the timer thread has to look at the wheel again: the start of
+ * the next non-empty level 0 slot, or the start of the next slot of a
+ * higher level that has to be cascaded.
+ */
+static uint64_t next_wheel_event(struct gw_timer_base *base)
+	__must_hold(&base->lock)
+{
+	uint64_t ret = UINT64_MAX;
+	uint64_t map, cur, tick;
+	uint32_t shift;
+	uint32_t lvl;
+
+	map = ror64(base->pending[0], (uint32_t)base->clk) & ~1ull;
+	if (map)
+		ret = base->clk + (uint64_t)__builtin_ctzll(map);
+
+	for (lvl = 1; lvl < GW_TIMER_LVL_DEPTH; lvl++) {
+		if (!base->pending[lvl])
+			continue;
+
+		shift = GW_TIMER_LVL_BITS * lvl;
+		cur = (base->clk >> shift) + 1ull;
+		map = ror64(base->pending[lvl], (uint32_t)cur);
+		tick = (cur + (uint64_t)__builtin_ctzll(map)) << shift;
+		if (tick < ret)
+			ret = tick;
+	}
+
+	if (ret == UINT64_MAX)
+		return ret;
+
+	return ret * GW_TIMER_TICK_NS;
+}
+
+void gw_timer_base_destroy(struct gw_timer_base *base,
+			   void (*drop)(struct gw_timer *t))
+{
+	struct gw_timer *t;
+	uint32_t i;
+
+	gw_timer_base_stop(base);
+
+	for (i = 0; i <= GW_TIMER_SLOT_EXPIRED; i++) {
+		while ((t = *slot_head(base, i))) {
+			timer_unlink(base, t);
+			if (drop)
+				drop(t);
+		}
+	}
+
+	cond_destroy(&base->cond);
+	mutex_destroy(&base->lock);
+	free(base);
+}
+
+/*
+ * Arm @t to expire at @expires (CLOCK_MONOTONIC nanoseconds). The timer
+ * must not be pending. The timer thread is started on the first call.
+ */
+int gw_timer_add(struct gw_timer_base *base, struct gw_timer *t,
+		 uint64_t expires)
+{
+	int ret = 0;
+
+	mutex_lock(&base->lock);
+	if (unlikely(base->should_stop)) {
+		ret = -EOWNERDEAD;
+		goto out;
+	}
+
+	if (unlikely(!base->thread_started)) {
+		ret = thread_create(&base->thread, &timer_thread_func, base);
+		if (ret)
+			goto out;
+		base->thread_started = true;
+	}
+
+	t->expires = expires;
+	wheel_enqueue(base, t);
+
+	/*
+	 * Only a timer expiring before the timer thread wakes up
+	 * changes how long it sleeps.
+	 */
+	if (expires < base->next_wake)
+		cond_signal(&base->cond);
+out:
+	mutex_unlock(&base->lock);
+	return ret;
+}
+
+/*
+ * Remove @t from @base. Returns true if the timer was pending, in which
+ * case its callback will not be called. Returns false if it has already
+ * expired, and its callback may still be running.
+ */
+bool gw_timer_del(struct gw_timer_base *base, struct gw_timer *t)
+{
+	bool ret = false;
+
+	mutex_lock(&base->lock);
+	if (t->pprev) {
+		timer_unlink(base, t);
+		ret = true;
+	}
+	mutex_unlock(&base->lock);
+	return ret;
+}
+
+static void *timer_thread_func(void *arg)
+{
+	struct gw_timer_base *base = arg;
+	uint64_t now, next, wheel;
+	struct timespec ts;
+	struct gw_timer *t;
+
+	mutex_lock(&base->lock);
+	while (!base->should_stop) {
+		t = base->expired;
+		if (t) {
+			timer_unlink(base, t);
+			mutex_unlock(&base->lock);
+			t->func(t);
+			mutex_lock(&base->lock);
+			continue;
+		}
+
+		now = gw_time_now_ns();
+		next = collect_expired(base, now);
+		if (base->expired)
+			continue;
+
+		if (next == UINT64_MAX && base->clk < now / GW_TIMER_TICK_NS) {
+			wheel_forward(base, now / GW_TIMER_TICK_NS);
+			continue;
+		}
+
+		wheel = next_wheel_event(base);
+		if (wheel < next)
+			next = wheel;
+
+		base->next_wake = next;
+		if (next == UINT64_MAX) {
+			cond_wait(&base->cond, &base->lock);
+		} else {
+			gw_ns_to_timespec(&ts, next);
+			cond_timedwait(&base->cond, &base->lock, &ts);
+		}
+		base->next_wake = 0;
+	}
+	mutex_unlock(&base->lock);
+	return arg;
+}
@@ -1,17 +1,49 @@
 // SPDX-License-Identifier: GPL-2.0-only
 /*
  * Copyright (C) 2023  Ammar Faizi <ammarfaizi2@gw.org>
+ *
+ * By default, all works go through the lanes under work_list_lock.
+ *
+ * With WQ_F_WORK_STEALING, each worker also owns a Chase-Lev deque
+ * (Le et al., "Correct and Efficient Work-Stealing for Weak Memory
+ * Models"). A work queued by a worker is pushed at the bottom of its
+ * deque. A worker looks for its next work in this order: the lanes if
+ * the high priority one is not empty, the bottom of its own deque, the
+ * lanes (taking up to WQ_INJECT_BATCH works at once and moving the
+ * extra ones to its deque), and finally the top of the deque of the
+ * other workers, starting from a random one.
+ *
+ * ws_nr_queued counts the works sitting in the lanes or in a deque,
+ * ws_nr_outstanding the ones that have not finished yet. Finishing a
+ * work never takes the lock.
+ *
+ * Idle workers, queuers waiting for room and wait_all_work_done() park
+ * on a struct wq_wait each: a futex word bumped on every wake up, and
+ * a count of the threads parked on it. The waker publishes its change
+ * first and only touches the futex word when the count is nonzero, so
+ * that it can do so after dropping work_list_lock and a busy workqueue
+ * makes no syscall to queue a work.
  */
 
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <errno.h>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#endif
+
 #include <gw/thread.h>
+#include <gw/timer.h>
 #include <gw/workqueue.h>
 
 #ifdef __CHECKER__
@@ -32,6 +64,11 @@
 #define unlikely(x)		(!!(x))
 #endif
 
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
 #if 1
 #define pr_debug(FMT, ...)						\
 do {									\
@@ -41,43 +78,690 @@ do {									\
 #define pr_debug(FMT, ...) do {} while (0)
 #endif
 
+#define WQ_CACHELINE_SIZE	64
+
+typedef void (*work_func_t)(void *);
+
+struct wq_wait {
+	_Atomic(uint32_t)	seq;
+	_Atomic(uint32_t)	nr_waiters;
+};
+
+enum {
+	WQ_WAKE_ALL = INT32_MAX,
+};
+
+enum {
+	WQ_INLINE_WORDS = WQ_INLINE_SIZE / sizeof(uint64_t),
+	WQ_NO_FLUSH_COLOR = 0xff,
+};
+
+/*
+ * A work queued with queue_work_inline*() carries its payload in data,
+ * inline_size bytes of it, and arg is unused. If the payload was too
+ * big for that, arg is a heap copy freed after the deleter.
+ *
+ * color is the flush color the work is counted in, see
+ * flush_workqueue(). The dispatch works of the keys are not counted
+ * (WQ_NO_FLUSH_COLOR), the keyed works they run are, one by one.
+ */
 struct work_struct {
 	void			(*func)(void *);
 	void			*arg;
 	void			(*deleter)(void *);
+	uint64_t		queued_ns;
+	uint32_t		inline_size;
+	bool			free_arg;
+	uint8_t			color;
+	uint64_t		data[WQ_INLINE_WORDS];
+};
+
+enum {
+	WQ_DEQUE_SIZE = 256,
+	WQ_INJECT_BATCH = 16,
+};
+
+/*
+ * A thief may read a slot while the owner rewrites it, in which case
+ * its CAS on top fails and the value is thrown away. The fields are
+ * atomic to keep that race well defined.
+ */
+struct ws_slot {
+	_Atomic(work_func_t)	func;
+	_Atomic(void *)		arg;
+	_Atomic(work_func_t)	deleter;
+	_Atomic(uint64_t)	queued_ns;
+	_Atomic(uint32_t)	inline_size;
+	_Atomic(bool)		free_arg;
+	_Atomic(uint8_t)	color;
+	_Atomic(uint64_t)	data[WQ_INLINE_WORDS];
+};
+
+struct ws_deque {
+	_Atomic(int64_t)	top __attribute__((__aligned__(WQ_CACHELINE_SIZE)));
+	_Atomic(int64_t)	bottom __attribute__((__aligned__(WQ_CACHELINE_SIZE)));
+	struct ws_slot		slots[WQ_DEQUE_SIZE];
+};
+
+/*
+ * One circular work list per priority. nr_skipped counts how many
+ * times a worker took a work from a higher lane while this one had
+ * pending works, see pick_work(). nr_keyed is the number of keyed
+ * works of this priority waiting in the list of their key, they count
+ * against max_pending_works like the works of the lane do.
+ */
+struct wq_lane {
+	uint32_t		head;
+	uint32_t		tail;
+	uint32_t		nr_skipped;
+	uint32_t		max_depth;
+	_Atomic(uint32_t)	nr_keyed;
+	uint64_t		nr_queued;
+	uint64_t		nr_aged;
+	struct work_struct	*works;
+};
+
+/*
+ * Keyed works. A key is active while it has an entry in the hash, and
+ * has at least one dispatch work queued or running. A dispatch work
+ * runs the works of the list in order until it is empty, unless
+ * another one is running already, in which case it does nothing. A
+ * work queued at a higher priority than all the queued dispatch works
+ * of its key queues one more at its own priority, so a key runs at the
+ * highest priority of its waiting works. The last dispatch work to go
+ * removes the entry.
+ *
+ * A keyed work reserves room in the lane of its priority before it is
+ * added to the list, and holds it in nr_keyed until the dispatch work
+ * takes it. A work that queues a dispatch work hands its room over to
+ * it instead, so that queueing the dispatch work can only fail once
+ * the workqueue is being destroyed.
+ */
+enum {
+	WQ_KEY_SHARD_BITS = 6,
+	WQ_KEY_BUCKET_BITS = 4,
+	WQ_NR_KEY_SHARDS = 1u << WQ_KEY_SHARD_BITS,
+	WQ_KEY_BUCKETS = 1u << WQ_KEY_BUCKET_BITS,
 };
 
+/*
+ * lane is the lane the work holds room in, NULL if it has handed it
+ * over to the dispatch work.
+ */
+struct wq_keyed_work {
+	struct work_struct	work;
+	struct wq_keyed_work	*next;
+	struct wq_lane		*lane;
+};
+
+struct wq_key_shard;
+
+/*
+ * nr_dispatch counts the dispatch works queued or running, nr_queued
+ * the ones not started yet by priority.
+ */
+struct wq_key {
+	uint64_t		key;
+	struct wq_key		*hnext;
+	struct wq_keyed_work	*head;
+	struct wq_keyed_work	**tail;
+	struct workqueue_struct	*wq;
+	struct wq_key_shard	*shard;
+	struct wq_key		**bucket;
+	uint32_t		nr_dispatch;
+	uint32_t		nr_queued[WQ_NR_PRIO];
+	bool			running;
+	bool			hashed;
+};
+
+/*
+ * The inline payload of a dispatch work.
+ */
+struct wq_key_dispatch {
+	struct wq_key		*key;
+	uint32_t		prio;
+	bool			done;
+};
+
+struct wq_key_shard {
+	mutex_t			lock;
+	struct wq_key		*buckets[WQ_KEY_BUCKETS];
+};
+
+/*
+ * Only the worker of the slot writes its stats, workqueue_get_stats()
+ * reads them without the lock. They outlive the thread, a reaped
+ * worker's numbers stay in the totals. The padding keeps the stats of
+ * two workers off the same cacheline.
+ */
+struct wq_worker_stats {
+	_Atomic(uint64_t)	nr_done;
+	_Atomic(uint64_t)	wait_ns[WQ_HIST_NR_BUCKETS];
+	_Atomic(uint64_t)	run_ns[WQ_HIST_NR_BUCKETS];
+	char			__pad[WQ_CACHELINE_SIZE];
+};
+
+/*
+ * A worker that exits on its own sets dead and keeps its slot, so that
+ * the thread gets joined before the slot is reused.
+ */
 struct worker_thread {
 	uint32_t		id;
+	uint32_t		rand;
+	bool			dead;
 	thread_t		thread;
 	struct workqueue_struct	*wq;
+	_Atomic(struct ws_deque *)	deque;
+	struct wq_worker_stats	stats;
 };
 
 struct workqueue_struct {
-	volatile bool		should_stop;
-	volatile bool		queue_is_blocked;
-	volatile bool		wait_all_is_waiting;
+	_Atomic(bool)		should_stop;
+	_Atomic(bool)		queue_is_blocked;
 	uint32_t		nr_sleeping_workers;
-	uint32_t		nr_sleeping_queuers;
 	uint32_t		nr_online_workers;
 	uint32_t		nr_running_workers;
+	uint32_t		nr_workers;
+	uint64_t		last_spawn_ns;
+	bool			grow_timer_armed;
+	struct gw_timer		grow_timer;
 	struct workqueue_attr	attr;
+#if defined(__linux__)
+	bool			pinned;
+	cpu_set_t		cpus;
+#endif
 	struct worker_thread	*workers;
-	cond_t			worker_cond;
-	cond_t			wait_all_cond;
-	cond_t			queue_work_cond;
+	struct wq_wait		worker_wait;
+	struct wq_wait		wait_all_wait;
+	struct wq_wait		queue_wait;
+	struct wq_wait		flush_wait;
+	mutex_t			flush_lock;
+	struct gw_timer_base	*timers;
+	mutex_t			delayed_lock;
+	struct wq_key_shard	*key_shards;
+
+	/*
+	 * See struct workqueue_stats.
+	 */
+	_Atomic(uint64_t)	nr_queue_waits;
+	_Atomic(uint64_t)	nr_queue_full;
+	_Atomic(uint64_t)	nr_spawns;
+	_Atomic(uint64_t)	nr_threads_spawned;
+	_Atomic(uint64_t)	nr_threads_exited;
 	uint32_t		mask;
-	uint32_t		head;
-	uint32_t		tail;
+	uint32_t		nr_pending;
+	struct wq_lane		lanes[WQ_NR_PRIO];
 	mutex_t			work_list_lock;
+
+	/*
+	 * WQ_F_WORK_STEALING only. ws_nr_injected and ws_nr_high
+	 * mirror nr_pending and the depth of the high lane so that
+	 * the workers can peek at them without the lock. The padding
+	 * keeps them off the cacheline of work_list_lock.
+	 */
+	char			__ws_pad[WQ_CACHELINE_SIZE];
+	_Atomic(uint32_t)	ws_nr_queued;
+	_Atomic(uint32_t)	ws_nr_outstanding;
+	_Atomic(uint32_t)	ws_nr_slots;
+	_Atomic(uint32_t)	ws_nr_injected;
+	_Atomic(uint32_t)	ws_nr_high;
+
+	/*
+	 * A work is counted in nr_inflight[color] from the moment it is
+	 * queued until it has been dropped, color being flush_color at
+	 * that time. See flush_workqueue().
+	 */
+	_Atomic(uint32_t)	flush_color;
+	_Atomic(uint64_t)	nr_inflight[2];
+
 	struct work_struct	work_list[];
 };
 
 static void *worker_func(void *arg);
+static void grow_timer_fire(struct gw_timer *t);
+
+static __thread struct worker_thread *current_worker;
+
+enum {
+	/*
+	 * A lane that has been passed over this many times gets the
+	 * next pick even if a higher lane still has pending works, so
+	 * a steady stream of high priority works can't starve it.
+	 */
+	WQ_AGING_THRESHOLD = 8,
+
+	/*
+	 * How long a delayed work that found the workqueue full waits
+	 * before trying again.
+	 */
+	WQ_DELAYED_RETRY_NS = 1000000,
+};
+
+#if defined(__linux__)
+static void wq_futex_wait(_Atomic(uint32_t) *word, uint32_t val,
+			  const struct timespec *rel)
+{
+	syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, val, rel,
+		NULL, 0);
+}
+
+static void wq_futex_wake(_Atomic(uint32_t) *word, uint32_t nr)
+{
+	syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, nr, NULL,
+		NULL, 0);
+}
+#else /* #if defined(__linux__) */
+/*
+ * No futex, poll the word every millisecond. Waiters recheck their
+ * condition anyway, so returning early is fine.
+ */
+static void wq_futex_wait(_Atomic(uint32_t) *word, uint32_t val,
+			  const struct timespec *rel)
+{
+	struct timespec ts = { 0, 1000000 };
+
+	if (rel && rel->tv_sec == 0 && rel->tv_nsec < ts.tv_nsec)
+		ts = *rel;
+	if (atomic_load_explicit(word, memory_order_acquire) == val)
+		nanosleep(&ts, NULL);
+}
+
+static void wq_futex_wake(_Atomic(uint32_t) *word, uint32_t nr)
+{
+	(void)word;
+	(void)nr;
+}
+#endif /* #if defined(__linux__) */
+
+/*
+ * Count the caller as a waiter of @w and return the seq to pass to
+ * wq_wait_sleep(). The caller must check its wake up condition after
+ * this, and call wq_wait_finish() once done waiting.
+ */
+static uint32_t wq_wait_prepare(struct wq_wait *w)
+{
+	atomic_fetch_add_explicit(&w->nr_waiters, 1u, memory_order_seq_cst);
+	return atomic_load_explicit(&w->seq, memory_order_seq_cst);
+}
+
+static void wq_wait_finish(struct wq_wait *w)
+{
+	atomic_fetch_sub_explicit(&w->nr_waiters, 1u, memory_order_relaxed);
+}
+
+/*
+ * Sleep until @w is woken up after wq_wait_prepare() returned @seq, or
+ * until @deadline if it is nonzero. Returns -ETIMEDOUT once the
+ * deadline has passed. May return early.
+ */
+static int wq_wait_sleep(struct wq_wait *w, uint32_t seq, uint64_t deadline)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	if (!deadline) {
+		wq_futex_wait(&w->seq, seq, NULL);
+		return 0;
+	}
+
+	now = gw_time_now_ns();
+	if (now >= deadline)
+		return -ETIMEDOUT;
+
+	gw_ns_to_timespec(&ts, deadline - now);
+	wq_futex_wait(&w->seq, seq, &ts);
+	return gw_time_now_ns() >= deadline ? -ETIMEDOUT : 0;
+}
+
+/*
+ * Wake up to @nr waiters of @w. The caller must have published the
+ * change they wait for. Pairs with wq_wait_prepare(): either we see
+ * the waiter, or it sees the change.
+ */
+static void wq_wake(struct wq_wait *w, uint32_t nr)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (likely(!atomic_load_explicit(&w->nr_waiters, memory_order_relaxed)))
+		return;
+
+	atomic_fetch_add_explicit(&w->seq, 1u, memory_order_seq_cst);
+	wq_futex_wake(&w->seq, nr);
+}
 
 static int64_t count_pending_works(struct workqueue_struct *wq)
 {
-	return (int64_t)llabs((int64_t)wq->tail - (int64_t)wq->head);
+	return (int64_t)wq->nr_pending;
+}
+
+static uint32_t lane_depth(struct wq_lane *lane)
+{
+	return lane->tail - lane->head;
+}
+
+static bool is_work_stealing(struct workqueue_struct *wq)
+{
+	return wq->attr.flags & WQ_F_WORK_STEALING;
+}
+
+static struct ws_deque *ws_deque_alloc(void)
+{
+	struct ws_deque *d;
+
+	d = aligned_alloc(WQ_CACHELINE_SIZE, sizeof(*d));
+	if (d)
+		memset(d, 0, sizeof(*d));
+
+	return d;
+}
+
+static uint32_t inline_words(uint32_t size)
+{
+	size = (size + sizeof(uint64_t) - 1u) / sizeof(uint64_t);
+	return size < WQ_INLINE_WORDS ? size : WQ_INLINE_WORDS;
+}
+
+static void init_work(struct work_struct *work, void (*func)(void *),
+		      void *arg, void (*deleter)(void *))
+{
+	work->func = func;
+	work->arg = arg;
+	work->deleter = deleter;
+	work->inline_size = 0;
+	work->free_arg = false;
+}
+
+/*
+ * Copy @src without the unused part of its payload.
+ */
+static void copy_work(struct work_struct *dst, const struct work_struct *src)
+{
+	memcpy(dst, src, offsetof(struct work_struct, data) +
+	       inline_words(src->inline_size) * sizeof(uint64_t));
+}
+
+static void *work_arg(struct work_struct *work)
+{
+	return work->inline_size ? (void *)work->data : work->arg;
+}
+
+static void drop_work(struct work_struct *work)
+{
+	if (work->deleter)
+		work->deleter(work_arg(work));
+	if (unlikely(work->free_arg))
+		free(work->arg);
+}
+
+static void run_work(struct work_struct *work)
+{
+	if (likely(work->func))
+		work->func(work_arg(work));
+	drop_work(work);
+}
+
+static uint32_t hist_bucket(uint64_t ns)
+{
+	uint32_t e, b;
+
+	if (ns < (1u << WQ_HIST_SUB_BITS))
+		return (uint32_t)ns;
+
+	e = 63u - (uint32_t)__builtin_clzll(ns);
+	b = ((e - WQ_HIST_SUB_BITS + 1u) << WQ_HIST_SUB_BITS) |
+	    (uint32_t)((ns >> (e - WQ_HIST_SUB_BITS)) &
+		       ((1u << WQ_HIST_SUB_BITS) - 1u));
+	return b < WQ_HIST_NR_BUCKETS ? b : WQ_HIST_NR_BUCKETS - 1u;
+}
+
+uint64_t workqueue_hist_bucket_min(uint32_t bucket)
+{
+	uint32_t sub = bucket & ((1u << WQ_HIST_SUB_BITS) - 1u);
+	uint32_t e = (bucket >> WQ_HIST_SUB_BITS) + WQ_HIST_SUB_BITS - 1u;
+
+	if (bucket < (1u << WQ_HIST_SUB_BITS))
+		return bucket;
+
+	return (uint64_t)((1u << WQ_HIST_SUB_BITS) | sub) <<
+	       (e - WQ_HIST_SUB_BITS);
+}
+
+/*
+ * The lowest value of the bucket holding the @pct percentile of @hist,
+ * 0 if it is empty.
+ */
+uint64_t workqueue_hist_percentile(const uint64_t *hist, double pct)
+{
+	uint64_t total = 0, sum = 0, rank;
+	uint32_t i;
+
+	for (i = 0; i < WQ_HIST_NR_BUCKETS; i++)
+		total += hist[i];
+
+	if (!total)
+		return 0;
+
+	rank = (uint64_t)((double)total * pct / 100.0);
+	if (rank >= total)
+		rank = total - 1u;
+
+	for (i = 0; i < WQ_HIST_NR_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum > rank)
+			break;
+	}
+
+	return workqueue_hist_bucket_min(i);
+}
+
+/*
+ * Bump a counter that only the calling thread writes. shared_inc() is
+ * for the ones several threads bump.
+ */
+static inline void owner_add(_Atomic(uint64_t) *p, uint64_t n)
+{
+	atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + n,
+			      memory_order_relaxed);
+}
+
+static inline void shared_inc(_Atomic(uint64_t) *p)
+{
+	atomic_fetch_add_explicit(p, 1u, memory_order_relaxed);
+}
+
+static void flush_color_put(struct workqueue_struct *wq, uint8_t color,
+			    uint32_t nr)
+{
+	if (color == WQ_NO_FLUSH_COLOR)
+		return;
+
+	if (atomic_fetch_sub(&wq->nr_inflight[color], nr) == nr)
+		wq_wake(&wq->flush_wait, WQ_WAKE_ALL);
+}
+
+/*
+ * Count @nr works about to be queued in the current flush color. The
+ * caller must not publish them before this returns. If the color has
+ * been flipped between the load and the count, the flip may have been
+ * followed by a flush seeing the old color drained, so count them
+ * again in the new color. Otherwise the flip comes after the count,
+ * and flush_workqueue() sees it.
+ */
+static uint8_t flush_color_get(struct workqueue_struct *wq, uint32_t nr)
+{
+	uint32_t c = atomic_load(&wq->flush_color);
+	uint32_t cur;
+
+	while (1) {
+		atomic_fetch_add(&wq->nr_inflight[c], nr);
+		cur = atomic_load(&wq->flush_color);
+		if (likely(cur == c))
+			return (uint8_t)c;
+
+		flush_color_put(wq, (uint8_t)c, nr);
+		c = cur;
+	}
+}
+
+/*
+ * Run @work on behalf of @worker and account it in its stats.
+ */
+static void worker_run_work(struct worker_thread *worker,
+			    struct work_struct *work)
+{
+	struct wq_worker_stats *st = &worker->stats;
+	uint64_t start = gw_time_now_ns();
+	uint8_t color = work->color;
+
+	owner_add(&st->wait_ns[hist_bucket(start - work->queued_ns)], 1u);
+	run_work(work);
+	owner_add(&st->run_ns[hist_bucket(gw_time_now_ns() - start)], 1u);
+	owner_add(&st->nr_done, 1u);
+	flush_color_put(worker->wq, color, 1u);
+}
+
+static void ws_slot_load(struct ws_slot *slot, struct work_struct *work)
+{
+	uint32_t i, n;
+
+	work->func = atomic_load_explicit(&slot->func, memory_order_relaxed);
+	work->arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+	work->deleter = atomic_load_explicit(&slot->deleter,
+					     memory_order_relaxed);
+	work->queued_ns = atomic_load_explicit(&slot->queued_ns,
+					       memory_order_relaxed);
+	work->free_arg = atomic_load_explicit(&slot->free_arg,
+					      memory_order_relaxed);
+	work->color = atomic_load_explicit(&slot->color, memory_order_relaxed);
+	work->inline_size = atomic_load_explicit(&slot->inline_size,
+						 memory_order_relaxed);
+	n = inline_words(work->inline_size);
+	for (i = 0; i < n; i++)
+		work->data[i] = atomic_load_explicit(&slot->data[i],
+						     memory_order_relaxed);
+}
+
+/*
+ * Owner only. Returns false if the deque is full.
+ */
+static bool ws_push(struct ws_deque *d, const struct work_struct *work)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	struct ws_slot *slot;
+	uint32_t i, n;
+
+	if (unlikely(b - t >= WQ_DEQUE_SIZE))
+		return false;
+
+	slot = &d->slots[b & (WQ_DEQUE_SIZE - 1)];
+	atomic_store_explicit(&slot->func, work->func, memory_order_relaxed);
+	atomic_store_explicit(&slot->arg, work->arg, memory_order_relaxed);
+	atomic_store_explicit(&slot->deleter, work->deleter,
+			      memory_order_relaxed);
+	atomic_store_explicit(&slot->queued_ns, work->queued_ns,
+			      memory_order_relaxed);
+	atomic_store_explicit(&slot->free_arg, work->free_arg,
+			      memory_order_relaxed);
+	atomic_store_explicit(&slot->color, work->color, memory_order_relaxed);
+	atomic_store_explicit(&slot->inline_size, work->inline_size,
+			      memory_order_relaxed);
+	n = inline_words(work->inline_size);
+	for (i = 0; i < n; i++)
+		atomic_store_explicit(&slot->data[i], work->data[i],
+				      memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+	return true;
+}
+
+/*
+ * Owner only. Take the newest work.
+ */
+static bool ws_pop(struct ws_deque *d, struct work_struct *work)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	bool ret = true;
+	int64_t t;
+
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if (t > b) {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return false;
+	}
+
+	ws_slot_load(&d->slots[b & (WQ_DEQUE_SIZE - 1)], work);
+	if (t == b) {
+		/*
+		 * Last one, race against the thieves for it.
+		 */
+		if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+							     memory_order_seq_cst,
+							     memory_order_relaxed))
+			ret = false;
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+
+	return ret;
+}
+
+/*
+ * Any thread. Take the oldest work. Fails if the deque is empty or if
+ * another thread won the race for the same work.
+ */
+static bool ws_steal(struct ws_deque *d, struct work_struct *work)
+{
+	int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	int64_t b;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (t >= b)
+		return false;
+
+	ws_slot_load(&d->slots[t & (WQ_DEQUE_SIZE - 1)], work);
+	return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+						       memory_order_seq_cst,
+						       memory_order_relaxed);
+}
+
+static uint32_t ws_rand(struct worker_thread *worker)
+{
+	uint32_t x = worker->rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	worker->rand = x;
+	return x;
+}
+
+/*
+ * Give a worker slot a deque before its thread starts, and make it
+ * visible to the thieves.
+ */
+static int ws_init_worker(struct workqueue_struct *wq,
+			  struct worker_thread *worker)
+{
+	struct ws_deque *d;
+	uint32_t nr;
+
+	if (!is_work_stealing(wq))
+		return 0;
+
+	if (!atomic_load_explicit(&worker->deque, memory_order_relaxed)) {
+		d = ws_deque_alloc();
+		if (!d)
+			return -ENOMEM;
+		atomic_store_explicit(&worker->deque, d, memory_order_release);
+	}
+
+	worker->rand = worker->id * 2654435761u + 1u;
+	nr = atomic_load_explicit(&wq->ws_nr_slots, memory_order_relaxed);
+	if (worker->id + 1u > nr)
+		atomic_store_explicit(&wq->ws_nr_slots, worker->id + 1u,
+				      memory_order_release);
+	return 0;
 }
 
 static int validate_and_adjust_workqueue_attr(struct workqueue_attr *attr)
@@ -105,226 +789,1733 @@ static int validate_and_adjust_workqueue_attr(struct workqueue_attr *attr)
 	return 0;
 }
 
-static int alloc_workers(struct workqueue_struct *wq)
+#if defined(__linux__)
+/*
+ * Parse a sysfs list like "0-3,8,10-11" into @set.
+ */
+static int parse_id_list(const char *path, cpu_set_t *set)
 {
-	struct worker_thread *workers, *worker;
-	uint32_t nr_thread_to_create;
+	unsigned long a, b;
+	int ret = 0;
+	FILE *f;
+	int c;
+
+	CPU_ZERO(set);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	while (fscanf(f, "%lu", &a) == 1) {
+		b = a;
+		c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%lu", &b) != 1) {
+				ret = -EINVAL;
+				break;
+			}
+			c = fgetc(f);
+		}
+
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+
+		if (c != ',')
+			break;
+	}
+
+	fclose(f);
+	return ret;
+}
+
+static int init_affinity(struct workqueue_struct *wq)
+{
+	struct workqueue_attr *attr = &wq->attr;
+	cpu_set_t allowed, node;
+	char path[64];
 	uint32_t i;
 	int ret;
 
-	workers = calloc(wq->attr.max_threads, sizeof(*workers));
-	if (!workers)
-		return -ENOMEM;
+	if (!(attr->flags & (WQ_F_CPU_AFFINITY | WQ_F_NUMA_NODE)))
+		return 0;
 
-	for (i = 0; i < wq->attr.max_threads; i++)
-		workers[i].id = i;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed))
+		return -errno;
 
-	if (wq->attr.flags & WQ_F_LAZY_THREAD_CREATION)
-		nr_thread_to_create = wq->attr.min_threads;
-	else
-		nr_thread_to_create = wq->attr.max_threads;
+	if (attr->flags & WQ_F_CPU_AFFINITY) {
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (!wq_cpumask_test(&attr->cpus, i))
+				CPU_CLR(i, &allowed);
+		}
+	}
 
-	for (i = 0; i < nr_thread_to_create; i++) {
-		worker = &workers[i];
-		worker->wq = wq;
-		ret = thread_create(&worker->thread, &worker_func, worker);
+	if (attr->flags & WQ_F_NUMA_NODE) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%u/cpulist",
+			 attr->numa_node);
+		ret = parse_id_list(path, &node);
+
+		/*
+		 * No NUMA support in the kernel, node 0 is the whole
+		 * machine.
+		 */
+		if (ret == -ENOENT && !attr->numa_node)
+			CPU_OR(&node, &node, &allowed);
+		else if (ret == -ENOENT)
+			return -ENODEV;
+		else if (ret)
+			return ret;
+
+		CPU_AND(&node, &node, &allowed);
+		if (CPU_COUNT(&node))
+			allowed = node;
+	}
+
+	if (!CPU_COUNT(&allowed))
+		return -EINVAL;
+
+	wq->cpus = allowed;
+	wq->pinned = true;
+	return 0;
+}
+
+static void apply_affinity(struct workqueue_struct *wq)
+{
+	if (wq->pinned)
+		sched_setaffinity(0, sizeof(wq->cpus), &wq->cpus);
+}
+
+uint32_t workqueue_get_nodes(uint32_t *nodes, uint32_t max)
+{
+	cpu_set_t set;
+	uint32_t nr = 0;
+	int i;
+
+	if (!parse_id_list("/sys/devices/system/node/online", &set)) {
+		for (i = 0; i < CPU_SETSIZE; i++) {
+			if (!CPU_ISSET(i, &set))
+				continue;
+			if (nr < max)
+				nodes[nr] = (uint32_t)i;
+			nr++;
+		}
+	}
+
+	if (nr)
+		return nr;
+
+	if (max)
+		nodes[0] = 0;
+	return 1u;
+}
+
+uint32_t workqueue_current_node(void)
+{
+	unsigned int cpu, node;
+
+	if (getcpu(&cpu, &node))
+		return 0;
+
+	return node;
+}
+#else /* #if defined(__linux__) */
+static int init_affinity(struct workqueue_struct *wq)
+{
+	if (wq->attr.flags & (WQ_F_CPU_AFFINITY | WQ_F_NUMA_NODE))
+		return -EOPNOTSUPP;
+
+	return 0;
+}
+
+static void apply_affinity(struct workqueue_struct *wq)
+{
+	(void)wq;
+}
+
+uint32_t workqueue_get_nodes(uint32_t *nodes, uint32_t max)
+{
+	if (max)
+		nodes[0] = 0;
+	return 1u;
+}
+
+uint32_t workqueue_current_node(void)
+{
+	return 0;
+}
+#endif /* #if defined(__linux__) */
+
+uint32_t workqueue_nr_nodes(void)
+{
+	return workqueue_get_nodes(NULL, 0);
+}
+
+static int alloc_workers(struct workqueue_struct *wq)
+{
+	struct worker_thread *workers, *worker;
+	uint32_t nr_thread_to_create;
+	uint32_t i;
+	int ret;
+
+	workers = calloc(wq->attr.max_threads, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < wq->attr.max_threads; i++)
+		workers[i].id = i;
+
+	if (wq->attr.flags & WQ_F_LAZY_THREAD_CREATION)
+		nr_thread_to_create = wq->attr.min_threads;
+	else
+		nr_thread_to_create = wq->attr.max_threads;
+
+	/*
+	 * Thieves walk the workers array, so it must be in place
+	 * before the first worker runs.
+	 */
+	wq->workers = workers;
+	wq->nr_workers = nr_thread_to_create;
+	for (i = 0; i < nr_thread_to_create; i++) {
+		worker = &workers[i];
+		worker->wq = wq;
+		ret = ws_init_worker(wq, worker);
+		if (!ret)
+			ret = thread_create(&worker->thread, &worker_func,
+					    worker);
 		if (ret)
 			goto out_err;
+		shared_inc(&wq->nr_threads_spawned);
 	}
 
-	wq->workers = workers;
+	if (nr_thread_to_create)
+		shared_inc(&wq->nr_spawns);
 	return 0;
 
 out_err:
 	mutex_lock(&wq->work_list_lock);
 	wq->should_stop = true;
-	cond_broadcast(&wq->worker_cond);
 	mutex_unlock(&wq->work_list_lock);
+	wq_wake(&wq->worker_wait, WQ_WAKE_ALL);
 
+	free(atomic_load_explicit(&workers[i].deque, memory_order_relaxed));
 	while (i--) {
 		worker = &workers[i];
 		thread_join(worker->thread, NULL);
+		free(atomic_load_explicit(&worker->deque, memory_order_relaxed));
 	}
+	wq->workers = NULL;
 	free(workers);
 	return ret;
 }
 
+static void free_key_shards(struct wq_key_shard *shards, uint32_t nr)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr; i++)
+		mutex_destroy(&shards[i].lock);
+	free(shards);
+}
+
+static int alloc_key_shards(struct workqueue_struct *wq)
+{
+	struct wq_key_shard *shards;
+	uint32_t i;
+	int ret;
+
+	shards = calloc(WQ_NR_KEY_SHARDS, sizeof(*shards));
+	if (!shards)
+		return -ENOMEM;
+
+	for (i = 0; i < WQ_NR_KEY_SHARDS; i++) {
+		ret = mutex_init(&shards[i].lock);
+		if (ret) {
+			free_key_shards(shards, i);
+			return ret;
+		}
+	}
+
+	wq->key_shards = shards;
+	return 0;
+}
+
 int alloc_workqueue(struct workqueue_struct **wq_p,
 		    const struct workqueue_attr *attr_arg)
 {
 	struct workqueue_attr attr = *attr_arg;
 	struct workqueue_struct *wq;
 	size_t size;
+	uint32_t i;
+	int ret;
+
+	ret = validate_and_adjust_workqueue_attr(&attr);
+	if (ret)
+		return ret;
+
+	size = sizeof(*wq) +
+	       WQ_NR_PRIO * attr.max_pending_works * sizeof(wq->work_list[0]);
+	wq = calloc(1u, size);
+	if (!wq)
+		return -ENOMEM;
+
+	wq->attr = attr;
+	wq->mask = attr.max_pending_works - 1u;
+	for (i = 0; i < WQ_NR_PRIO; i++)
+		wq->lanes[i].works = &wq->work_list[i * attr.max_pending_works];
+
+	ret = init_affinity(wq);
+	if (ret)
+		goto err_free_wq;
+
+	ret = mutex_init(&wq->work_list_lock);
+	if (ret)
+		goto err_free_wq;
+	ret = mutex_init(&wq->delayed_lock);
+	if (ret)
+		goto err_free_work_list_lock;
+	ret = mutex_init(&wq->flush_lock);
+	if (ret)
+		goto err_free_delayed_lock;
+	gw_timer_init(&wq->grow_timer, &grow_timer_fire);
+	ret = gw_timer_base_init(&wq->timers);
+	if (ret)
+		goto err_free_flush_lock;
+	ret = alloc_key_shards(wq);
+	if (ret)
+		goto err_free_timers;
+	ret = alloc_workers(wq);
+	if (ret)
+		goto err_free_key_shards;
+
+	*wq_p = wq;
+	return 0;
+
+err_free_key_shards:
+	free_key_shards(wq->key_shards, WQ_NR_KEY_SHARDS);
+err_free_timers:
+	gw_timer_base_destroy(wq->timers, NULL);
+err_free_flush_lock:
+	mutex_destroy(&wq->flush_lock);
+err_free_delayed_lock:
+	mutex_destroy(&wq->delayed_lock);
+err_free_work_list_lock:
+	mutex_destroy(&wq->work_list_lock);
+err_free_wq:
+	free(wq);
+	return ret;
+}
+
+static bool has_outstanding_works(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	if (is_work_stealing(wq))
+		return atomic_load_explicit(&wq->ws_nr_outstanding,
+					    memory_order_seq_cst) > 0;
+
+	return count_pending_works(wq) > 0 || wq->nr_running_workers;
+}
+
+static void wake_up_all_queue_work_callers(struct workqueue_struct *wq)
+{
+	wq_wake(&wq->queue_wait, WQ_WAKE_ALL);
+}
+
+void wait_all_work_done(struct workqueue_struct *wq)
+{
+	uint32_t seq;
+
+	mutex_lock(&wq->work_list_lock);
+	wq->queue_is_blocked = true;
+
+	while (!wq->should_stop) {
+		seq = wq_wait_prepare(&wq->wait_all_wait);
+		if (!has_outstanding_works(wq)) {
+			wq_wait_finish(&wq->wait_all_wait);
+			break;
+		}
+
+		mutex_unlock(&wq->work_list_lock);
+		wq_wait_sleep(&wq->wait_all_wait, seq, 0);
+		wq_wait_finish(&wq->wait_all_wait);
+		mutex_lock(&wq->work_list_lock);
+	}
+
+	/*
+	 * The callers that got blocked meanwhile may not see another
+	 * work finish to wake them up.
+	 */
+	wq->queue_is_blocked = false;
+	mutex_unlock(&wq->work_list_lock);
+	wake_up_all_queue_work_callers(wq);
+}
+
+/*
+ * Flip the flush color and wait for the works counted in the old one.
+ * The previous flush has drained the new color before flipping away
+ * from it, so it only counts works queued after this one started.
+ * Flushes are serialized by flush_lock.
+ */
+int flush_workqueue(struct workqueue_struct *wq)
+{
+	struct worker_thread *worker = current_worker;
+	uint32_t c, seq;
+
+	if (unlikely(worker && worker->wq == wq))
+		return -EDEADLK;
+
+	mutex_lock(&wq->flush_lock);
+	mutex_lock(&wq->work_list_lock);
+	c = atomic_load(&wq->flush_color);
+	atomic_store(&wq->flush_color, c ^ 1u);
+	mutex_unlock(&wq->work_list_lock);
+
+	while (!wq->should_stop) {
+		seq = wq_wait_prepare(&wq->flush_wait);
+		if (!atomic_load(&wq->nr_inflight[c])) {
+			wq_wait_finish(&wq->flush_wait);
+			break;
+		}
+
+		wq_wait_sleep(&wq->flush_wait, seq, 0);
+		wq_wait_finish(&wq->flush_wait);
+	}
+	mutex_unlock(&wq->flush_lock);
+	return 0;
+}
+
+static struct worker_thread *get_free_worker_slot(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	struct worker_thread *worker;
+	uint32_t i;
+
+	for (i = 0; i < wq->attr.max_threads; i++) {
+		worker = &wq->workers[i];
+		if (!worker->wq)
+			return worker;
+
+		/*
+		 * It has released the lock for good before setting
+		 * dead, so this doesn't block.
+		 */
+		if (worker->dead) {
+			thread_join(worker->thread, NULL);
+			worker->dead = false;
+			worker->wq = NULL;
+			return worker;
+		}
+	}
+
+	return NULL;
+}
+
+static int arm_spawn_worker(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	struct worker_thread *worker;
+	int ret;
+
+	worker = get_free_worker_slot(wq);
+	if (!worker)
+		return -EAGAIN;
+
+	worker->wq = wq;
+	ret = ws_init_worker(wq, worker);
+	if (!ret)
+		ret = thread_create(&worker->thread, &worker_func, worker);
+	if (unlikely(ret)) {
+		worker->wq = NULL;
+	} else {
+		wq->nr_workers++;
+		shared_inc(&wq->nr_threads_spawned);
+	}
+
+	return ret;
+}
+
+static uint64_t oldest_pending_ns(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	uint64_t ret = UINT64_MAX;
+	struct wq_lane *lane;
+	uint64_t t;
+	uint32_t i;
+
+	for (i = 0; i < WQ_NR_PRIO; i++) {
+		lane = &wq->lanes[i];
+		if (!lane_depth(lane))
+			continue;
+
+		t = lane->works[lane->head & wq->mask].queued_ns;
+		if (t < ret)
+			ret = t;
+	}
+
+	return ret;
+}
+
+/*
+ * Check again at @expires whether a worker should be spawned. Without
+ * it, a work queued behind busy workers would wait for the next queue
+ * or pick to get one, which may never come if they are all stuck.
+ */
+static void arm_grow_timer(struct workqueue_struct *wq, uint64_t expires)
+	__must_hold(&wq->work_list_lock)
+{
+	if (wq->grow_timer_armed || wq->should_stop)
+		return;
+
+	if (!gw_timer_add(wq->timers, &wq->grow_timer, expires))
+		wq->grow_timer_armed = true;
+}
+
+/*
+ * No worker is idle and there is at least one pending work. Without
+ * spawn_delay_us, spawn a worker right away.
+ * Otherwise, only spawn when the oldest pending work has waited for
+ * spawn_delay_us, and not more than once per spawn_delay_us, so that a
+ * burst of short works doesn't end up with a thread per work. Until
+ * then, grow_timer comes back to it.
+ */
+static int grow_workers(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	uint64_t delay = (uint64_t)wq->attr.spawn_delay_us * 1000ull;
+	uint64_t now, next, oldest;
 	int ret;
 
-	ret = validate_and_adjust_workqueue_attr(&attr);
-	if (ret)
+	if (!delay || !wq->nr_workers || wq->nr_workers < wq->attr.min_threads) {
+		ret = arm_spawn_worker(wq);
+		goto out;
+	}
+
+	if (wq->nr_workers >= wq->attr.max_threads)
+		return -EAGAIN;
+
+	now = gw_time_now_ns();
+	next = wq->last_spawn_ns + delay;
+	oldest = oldest_pending_ns(wq);
+	if (oldest != UINT64_MAX && oldest + delay > next)
+		next = oldest + delay;
+
+	if (now < next) {
+		arm_grow_timer(wq, next);
+		return -EAGAIN;
+	}
+
+	ret = arm_spawn_worker(wq);
+	if (!ret)
+		wq->last_spawn_ns = now;
+
+out:
+	if (!ret)
+		shared_inc(&wq->nr_spawns);
+	return ret;
+}
+
+static void grow_timer_fire(struct gw_timer *t)
+{
+	struct workqueue_struct *wq;
+
+	wq = container_of(t, struct workqueue_struct, grow_timer);
+	mutex_lock(&wq->work_list_lock);
+	wq->grow_timer_armed = false;
+	if (!wq->should_stop && wq->nr_pending && !wq->nr_sleeping_workers)
+		grow_workers(wq);
+	mutex_unlock(&wq->work_list_lock);
+}
+
+/*
+ * Called by a worker that just took a work. The works queued while all
+ * the workers were busy have gotten older, so check them again.
+ */
+static void grow_workers_on_pick(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	if (wq->attr.spawn_delay_us && wq->nr_pending &&
+	    !wq->nr_sleeping_workers)
+		grow_workers(wq);
+}
+
+/*
+ * Spawn a worker for a newly queued work if none is idle. The caller
+ * wakes the idle ones up with wake_up_workers() once it has dropped
+ * the lock.
+ */
+static int arm_worker(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	if (unlikely(!wq->nr_sleeping_workers))
+		return grow_workers(wq);
+
+	return 0;
+}
+
+/*
+ * Like arm_worker(), for @nr newly queued works. Spawn new workers for
+ * the works that cannot be covered by the sleeping ones.
+ */
+static void arm_workers(struct workqueue_struct *wq, uint32_t nr)
+	__must_hold(&wq->work_list_lock)
+{
+	uint32_t sleeping = wq->nr_sleeping_workers;
+	uint32_t i;
+
+	if (wq->attr.spawn_delay_us) {
+		if (nr > sleeping)
+			grow_workers(wq);
+	} else {
+		for (i = sleeping; i < nr; i++) {
+			if (arm_spawn_worker(wq))
+				break;
+		}
+		if (i > sleeping)
+			shared_inc(&wq->nr_spawns);
+	}
+}
+
+static void wake_up_workers(struct workqueue_struct *wq, uint32_t nr)
+{
+	wq_wake(&wq->worker_wait, nr);
+}
+
+static void ws_sync_injected(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	atomic_store_explicit(&wq->ws_nr_injected, wq->nr_pending,
+			      memory_order_relaxed);
+	atomic_store_explicit(&wq->ws_nr_high,
+			      lane_depth(&wq->lanes[WQ_PRIO_HIGH]),
+			      memory_order_relaxed);
+}
+
+static void lane_account_queued(struct workqueue_struct *wq,
+				struct wq_lane *lane, uint32_t nr)
+	__must_hold(&wq->work_list_lock)
+{
+	uint32_t depth = lane_depth(lane);
+
+	if (depth > lane->max_depth)
+		lane->max_depth = depth;
+
+	lane->nr_queued += nr;
+	wq->nr_pending += nr;
+
+	if (is_work_stealing(wq)) {
+		atomic_fetch_add_explicit(&wq->ws_nr_outstanding, nr,
+					  memory_order_relaxed);
+		atomic_fetch_add_explicit(&wq->ws_nr_queued, nr,
+					  memory_order_seq_cst);
+		ws_sync_injected(wq);
+	}
+}
+
+/*
+ * Wake up an idle worker after pushing to a deque without the lock.
+ * ws_wait_for_work() checks ws_nr_queued after wq_wait_prepare().
+ */
+static void ws_notify(struct workqueue_struct *wq, uint32_t nr)
+{
+	atomic_fetch_add_explicit(&wq->ws_nr_queued, nr, memory_order_seq_cst);
+	wake_up_workers(wq, 1u);
+}
+
+/*
+ * Queue up to @nr copies of @work on the deque of the calling worker,
+ * with the arg taken from @args if it is not NULL. Only works of
+ * normal priority go there, the others need the lanes to be ordered
+ * against the works of the other threads. Returns the number of works
+ * queued, 0 if the caller has to go through the lanes.
+ */
+static uint32_t ws_queue_local(struct workqueue_struct *wq, uint32_t prio,
+			       struct work_struct *work, void **args,
+			       uint32_t nr)
+{
+	struct worker_thread *worker = current_worker;
+	struct ws_deque *d;
+	uint32_t i;
+
+	if (!worker || worker->wq != wq || prio != WQ_PRIO_NORMAL)
+		return 0;
+
+	if (unlikely(wq->should_stop || wq->queue_is_blocked))
+		return 0;
+
+	d = atomic_load_explicit(&worker->deque, memory_order_relaxed);
+	atomic_fetch_add_explicit(&wq->ws_nr_outstanding, nr,
+				  memory_order_relaxed);
+	work->queued_ns = gw_time_now_ns();
+	work->color = flush_color_get(wq, nr);
+	for (i = 0; i < nr; i++) {
+		if (args)
+			work->arg = args[i];
+		if (unlikely(!ws_push(d, work)))
+			break;
+	}
+
+	if (unlikely(i < nr)) {
+		atomic_fetch_sub_explicit(&wq->ws_nr_outstanding, nr - i,
+					  memory_order_relaxed);
+		flush_color_put(wq, work->color, nr - i);
+	}
+	if (likely(i))
+		ws_notify(wq, i);
+
+	return i;
+}
+
+/*
+ * Sleep until a worker takes a work from the lanes, or until
+ * wait_all_work_done() stops blocking the queuers.
+ */
+static void wait_for_room(struct workqueue_struct *wq)
+	__must_hold(&wq->work_list_lock)
+{
+	uint32_t seq = wq_wait_prepare(&wq->queue_wait);
+
+	shared_inc(&wq->nr_queue_waits);
+	mutex_unlock(&wq->work_list_lock);
+	wq_wait_sleep(&wq->queue_wait, seq, 0);
+	wq_wait_finish(&wq->queue_wait);
+	mutex_lock(&wq->work_list_lock);
+}
+
+static bool lane_is_full(struct workqueue_struct *wq, struct wq_lane *lane)
+	__must_hold(&wq->work_list_lock)
+{
+	return lane_depth(lane) +
+	       atomic_load_explicit(&lane->nr_keyed, memory_order_relaxed) >=
+	       wq->attr.max_pending_works;
+}
+
+/*
+ * Returns -EAGAIN if a work cannot be queued on @lane right now.
+ */
+static int lane_check_room(struct workqueue_struct *wq, struct wq_lane *lane)
+	__must_hold(&wq->work_list_lock)
+{
+	if (unlikely(wq->should_stop))
+		return -EOWNERDEAD;
+
+	if (unlikely(wq->queue_is_blocked))
+		return -EAGAIN;
+
+	if (unlikely(lane_is_full(wq, lane)))
+		return -EAGAIN;
+
+	return 0;
+}
+
+/*
+ * The caller has set the flush color of @work.
+ */
+static void queue_work_locked(struct workqueue_struct *wq,
+			      struct wq_lane *lane, struct work_struct *work)
+	__must_hold(&wq->work_list_lock)
+{
+	work->queued_ns = gw_time_now_ns();
+	copy_work(&lane->works[lane->tail++ & wq->mask], work);
+	lane_account_queued(wq, lane, 1u);
+	arm_worker(wq);
+}
+
+static int try_queue_work_locked(struct workqueue_struct *wq,
+				 struct wq_lane *lane,
+				 struct work_struct *work)
+	__must_hold(&wq->work_list_lock)
+{
+	int ret;
+
+	ret = lane_check_room(wq, lane);
+	if (likely(!ret)) {
+		work->color = flush_color_get(wq, 1u);
+		queue_work_locked(wq, lane, work);
+	}
+
+	return ret;
+}
+
+int queue_work(struct workqueue_struct *wq, void (*func)(void *), void *arg,
+	       void (*deleter)(void *))
+{
+	return queue_work_prio(wq, WQ_PRIO_NORMAL, func, arg, deleter);
+}
+
+static int __queue_work(struct workqueue_struct *wq, uint32_t prio,
+			struct work_struct *work)
+{
+	struct wq_lane *lane = &wq->lanes[prio];
+	int ret;
+
+	if (is_work_stealing(wq) && ws_queue_local(wq, prio, work, NULL, 1u))
+		return 0;
+
+	mutex_lock(&wq->work_list_lock);
+	while (1) {
+		ret = try_queue_work_locked(wq, lane, work);
+		if (likely(ret <= 0 && ret != -EAGAIN))
+			break;
+
+		wait_for_room(wq);
+	}
+	mutex_unlock(&wq->work_list_lock);
+
+	if (likely(!ret))
+		wake_up_workers(wq, 1u);
+
+	return ret;
+}
+
+int queue_work_prio(struct workqueue_struct *wq, uint32_t prio,
+		    void (*func)(void *), void *arg, void (*deleter)(void *))
+{
+	struct work_struct work;
+
+	if (unlikely(prio >= WQ_NR_PRIO))
+		return -EINVAL;
+
+	init_work(&work, func, arg, deleter);
+	return __queue_work(wq, prio, &work);
+}
+
+int queue_work_inline(struct workqueue_struct *wq, void (*func)(void *),
+		      const void *data, size_t size)
+{
+	return queue_work_inline_prio(wq, WQ_PRIO_NORMAL, func, data, size,
+				      NULL);
+}
+
+/*
+ * Queue a copy of the @size bytes at @data. @func and @deleter get a
+ * pointer to the copy, aligned to 8 bytes, that is valid until the
+ * deleter returns. Up to WQ_INLINE_SIZE bytes, the copy lives in the
+ * work itself and nothing is allocated.
+ */
+int queue_work_inline_prio(struct workqueue_struct *wq, uint32_t prio,
+			   void (*func)(void *), const void *data, size_t size,
+			   void (*deleter)(void *))
+{
+	struct work_struct work;
+	void *copy;
+	int ret;
+
+	if (unlikely(prio >= WQ_NR_PRIO || !size))
+		return -EINVAL;
+
+	if (likely(size <= WQ_INLINE_SIZE)) {
+		init_work(&work, func, NULL, deleter);
+		work.inline_size = (uint32_t)size;
+		memcpy(work.data, data, size);
+		return __queue_work(wq, prio, &work);
+	}
+
+	copy = malloc(size);
+	if (unlikely(!copy))
+		return -ENOMEM;
+
+	memcpy(copy, data, size);
+	init_work(&work, func, copy, deleter);
+	work.free_arg = true;
+	ret = __queue_work(wq, prio, &work);
+	if (unlikely(ret))
+		free(copy);
+
+	return ret;
+}
+
+enum {
+	WORK_COMPLETION_DONE = 0,
+	WORK_COMPLETION_PENDING = 1,
+	WORK_COMPLETION_WAITERS = 2,
+};
+
+static _Atomic(uint32_t) *completion_state(struct work_completion *c)
+{
+	return (_Atomic(uint32_t) *)&c->state;
+}
+
+/*
+ * The inline payload of a work queued with queue_work_completion*().
+ */
+struct wq_completion_work {
+	void			(*func)(void *);
+	void			*arg;
+	void			(*deleter)(void *);
+	struct work_completion	*c;
+};
+
+static void completion_work_run(void *data)
+{
+	struct wq_completion_work *cw = data;
+
+	if (likely(cw->func))
+		cw->func(cw->arg);
+}
+
+/*
+ * The waiter may free the completion as soon as it sees it done, so
+ * the futex wake is the only thing left to touch it. A wake on a
+ * stale address is harmless, futex waiters recheck their word.
+ */
+static void completion_work_drop(void *data)
+{
+	struct wq_completion_work *cw = data;
+	_Atomic(uint32_t) *state = completion_state(cw->c);
+
+	if (cw->deleter)
+		cw->deleter(cw->arg);
+	if (atomic_exchange(state, WORK_COMPLETION_DONE) &
+	    WORK_COMPLETION_WAITERS)
+		wq_futex_wake(state, WQ_WAKE_ALL);
+}
+
+void init_work_completion(struct work_completion *c)
+{
+	atomic_store_explicit(completion_state(c), WORK_COMPLETION_DONE,
+			      memory_order_relaxed);
+}
+
+int queue_work_completion(struct workqueue_struct *wq,
+			  struct work_completion *c, void (*func)(void *),
+			  void *arg, void (*deleter)(void *))
+{
+	return queue_work_completion_prio(wq, WQ_PRIO_NORMAL, c, func, arg,
+					  deleter);
+}
+
+/*
+ * Like queue_work_prio(), and @c is done once the work has run and its
+ * deleter returned, or it has been dropped by destroy_workqueue(). If
+ * the work cannot be queued, @c is left done. @c must not be queued
+ * again before it is done.
+ */
+int queue_work_completion_prio(struct workqueue_struct *wq, uint32_t prio,
+			       struct work_completion *c, void (*func)(void *),
+			       void *arg, void (*deleter)(void *))
+{
+	struct wq_completion_work cw = {
+		.func = func,
+		.arg = arg,
+		.deleter = deleter,
+		.c = c,
+	};
+	int ret;
+
+	atomic_store(completion_state(c), WORK_COMPLETION_PENDING);
+	ret = queue_work_inline_prio(wq, prio, completion_work_run, &cw,
+				     sizeof(cw), completion_work_drop);
+	if (unlikely(ret))
+		atomic_store(completion_state(c), WORK_COMPLETION_DONE);
+
+	return ret;
+}
+
+bool work_completion_done(struct work_completion *c)
+{
+	return atomic_load_explicit(completion_state(c),
+				    memory_order_acquire) ==
+	       WORK_COMPLETION_DONE;
+}
+
+/*
+ * Wait for the work of @c to be done. Only the caller waits, the
+ * workqueue keeps taking new works. Returns false if it was done
+ * already.
+ */
+bool flush_work(struct work_completion *c)
+{
+	_Atomic(uint32_t) *state = completion_state(c);
+	uint32_t v = atomic_load(state);
+
+	if (v == WORK_COMPLETION_DONE)
+		return false;
+
+	while (v != WORK_COMPLETION_DONE) {
+		if (!(v & WORK_COMPLETION_WAITERS) &&
+		    !atomic_compare_exchange_weak(state, &v,
+						  v | WORK_COMPLETION_WAITERS))
+			continue;
+
+		v |= WORK_COMPLETION_WAITERS;
+		wq_futex_wait(state, v, NULL);
+		v = atomic_load(state);
+	}
+
+	return true;
+}
+
+static int __try_queue_work(struct workqueue_struct *wq, uint32_t prio,
+			    struct work_struct *work)
+{
+	int ret;
+
+	if (is_work_stealing(wq) && ws_queue_local(wq, prio, work, NULL, 1u))
+		return 0;
+
+	mutex_lock(&wq->work_list_lock);
+	ret = try_queue_work_locked(wq, &wq->lanes[prio], work);
+	mutex_unlock(&wq->work_list_lock);
+
+	if (likely(!ret))
+		wake_up_workers(wq, 1u);
+	else
+		shared_inc(&wq->nr_queue_full);
+
+	return ret;
+}
+
+/*
+ * Like queue_work(), but fail with -EAGAIN instead of waiting when the
+ * work list is full or wait_all_work_done() is running.
+ */
+int try_queue_work(struct workqueue_struct *wq, void (*func)(void *), void *arg,
+		   void (*deleter)(void *))
+{
+	struct work_struct work;
+
+	init_work(&work, func, arg, deleter);
+	return __try_queue_work(wq, WQ_PRIO_NORMAL, &work);
+}
+
+/*
+ * Queue @nr works sharing the same @func and @deleter under a single
+ * work_list_lock round-trip. If the work list is full, wait for space
+ * like queue_work() does. Returns the number of queued works, or a
+ * negative error code if none could be queued.
+ */
+int queue_work_batch(struct workqueue_struct *wq, void (*func)(void *),
+		     void **args, uint32_t nr, void (*deleter)(void *))
+{
+	return queue_work_batch_prio(wq, WQ_PRIO_NORMAL, func, args, nr,
+				     deleter);
+}
+
+static int __queue_work_batch(struct workqueue_struct *wq, uint32_t prio,
+			      void (*func)(void *), void **args, uint32_t nr,
+			      void (*deleter)(void *), bool nowait)
+{
+	struct work_struct tmpl, *work;
+	uint32_t nr_unwoken = 0;
+	struct wq_lane *lane;
+	uint32_t queued = 0;
+	uint64_t now = 0;
+	uint32_t n;
+	uint8_t c;
+	int ret = 0;
+
+	if (unlikely(prio >= WQ_NR_PRIO))
+		return -EINVAL;
+
+	if (is_work_stealing(wq)) {
+		init_work(&tmpl, func, NULL, deleter);
+		queued = ws_queue_local(wq, prio, &tmpl, args, nr);
+		if (likely(queued == nr))
+			return (int)queued;
+	}
+
+	lane = &wq->lanes[prio];
+	mutex_lock(&wq->work_list_lock);
+	while (queued < nr) {
+		if (unlikely(wq->should_stop)) {
+			ret = -EOWNERDEAD;
+			break;
+		}
+
+		n = 0;
+		now = gw_time_now_ns();
+		c = (uint8_t)atomic_load(&wq->flush_color);
+		if (likely(!wq->queue_is_blocked)) {
+			while (queued + n < nr && !lane_is_full(wq, lane)) {
+				work = &lane->works[lane->tail++ & wq->mask];
+				init_work(work, func, args[queued + n], deleter);
+				work->queued_ns = now;
+				work->color = c;
+				n++;
+			}
+		}
+
+		if (likely(n)) {
+			atomic_fetch_add(&wq->nr_inflight[c], n);
+			lane_account_queued(wq, lane, n);
+			arm_workers(wq, n);
+			queued += n;
+			nr_unwoken += n;
+			continue;
+		}
+
+		/*
+		 * The workers must see what has been queued so far to
+		 * make room.
+		 */
+		if (nr_unwoken) {
+			mutex_unlock(&wq->work_list_lock);
+			wake_up_workers(wq, nr_unwoken);
+			nr_unwoken = 0;
+			mutex_lock(&wq->work_list_lock);
+			continue;
+		}
+
+		if (nowait) {
+			shared_inc(&wq->nr_queue_full);
+			ret = -EAGAIN;
+			break;
+		}
+
+		wait_for_room(wq);
+	}
+	mutex_unlock(&wq->work_list_lock);
+
+	if (nr_unwoken)
+		wake_up_workers(wq, nr_unwoken);
+
+	if (likely(queued))
+		return (int)queued;
+
+	return ret;
+}
+
+int queue_work_batch_prio(struct workqueue_struct *wq, uint32_t prio,
+			  void (*func)(void *), void **args, uint32_t nr,
+			  void (*deleter)(void *))
+{
+	return __queue_work_batch(wq, prio, func, args, nr, deleter, false);
+}
+
+/*
+ * Like queue_work_batch_prio(), but stop at the first work that finds
+ * the lane full (or wait_all_work_done() running) instead of waiting
+ * for room. Returns the number of queued works, which may be less than
+ * @nr, or -EAGAIN if none could be queued.
+ */
+int try_queue_work_batch_prio(struct workqueue_struct *wq, uint32_t prio,
+			      void (*func)(void *), void **args, uint32_t nr,
+			      void (*deleter)(void *))
+{
+	return __queue_work_batch(wq, prio, func, args, nr, deleter, true);
+}
+
+/*
+ * Fill @st with the counters of the @prio lane. depth is the number of
+ * works waiting in the lane, max_depth its high watermark and nr_aged
+ * the number of works picked ahead of a higher lane by aging.
+ */
+int workqueue_get_lane_stats(struct workqueue_struct *wq, uint32_t prio,
+			     struct workqueue_lane_stats *st)
+{
+	struct wq_lane *lane;
+
+	if (unlikely(prio >= WQ_NR_PRIO))
+		return -EINVAL;
+
+	lane = &wq->lanes[prio];
+	mutex_lock(&wq->work_list_lock);
+	st->depth = lane_depth(lane);
+	st->max_depth = lane->max_depth;
+	st->nr_queued = lane->nr_queued;
+	st->nr_aged = lane->nr_aged;
+	mutex_unlock(&wq->work_list_lock);
+	return 0;
+}
+
+/*
+ * Lockless snapshot, the counters of a worker may be a few works
+ * behind each other.
+ */
+void workqueue_get_stats(struct workqueue_struct *wq,
+			 struct workqueue_stats *st)
+{
+	struct wq_worker_stats *ws;
+	uint32_t i, j;
+
+	memset(st, 0, sizeof(*st));
+	st->now_ns = gw_time_now_ns();
+	st->nr_queue_waits = atomic_load_explicit(&wq->nr_queue_waits,
+						  memory_order_relaxed);
+	st->nr_queue_full = atomic_load_explicit(&wq->nr_queue_full,
+						 memory_order_relaxed);
+	st->nr_spawns = atomic_load_explicit(&wq->nr_spawns,
+					     memory_order_relaxed);
+	st->nr_threads_spawned = atomic_load_explicit(&wq->nr_threads_spawned,
+						      memory_order_relaxed);
+	st->nr_threads_exited = atomic_load_explicit(&wq->nr_threads_exited,
+						     memory_order_relaxed);
+
+	for (i = 0; i < wq->attr.max_threads; i++) {
+		ws = &wq->workers[i].stats;
+		st->nr_done += atomic_load_explicit(&ws->nr_done,
+						    memory_order_relaxed);
+		for (j = 0; j < WQ_HIST_NR_BUCKETS; j++) {
+			st->wait_ns[j] += atomic_load_explicit(&ws->wait_ns[j],
+							       memory_order_relaxed);
+			st->run_ns[j] += atomic_load_explicit(&ws->run_ns[j],
+							      memory_order_relaxed);
+		}
+	}
+}
+
+static struct wq_key_shard *key_shard(struct workqueue_struct *wq,
+				      uint64_t key, struct wq_key ***bucket_p)
+{
+	uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+	struct wq_key_shard *shard;
+
+	shard = &wq->key_shards[hash >> (64u - WQ_KEY_SHARD_BITS)];
+	hash >>= 64u - WQ_KEY_SHARD_BITS - WQ_KEY_BUCKET_BITS;
+	*bucket_p = &shard->buckets[hash & (WQ_KEY_BUCKETS - 1u)];
+	return shard;
+}
+
+static void key_unhash(struct wq_key *k)
+	__must_hold(&k->shard->lock)
+{
+	struct wq_key **pp;
+
+	for (pp = k->bucket; *pp != k; pp = &(*pp)->hnext)
+		;
+	*pp = k->hnext;
+	k->hashed = false;
+}
+
+/*
+ * Give back the room @kw holds in its lane.
+ */
+static void keyed_work_unreserve(struct workqueue_struct *wq,
+				 struct wq_keyed_work *kw)
+{
+	if (!kw->lane)
+		return;
+
+	atomic_fetch_sub_explicit(&kw->lane->nr_keyed, 1u,
+				  memory_order_relaxed);
+	wake_up_all_queue_work_callers(wq);
+}
+
+static void keyed_work_drop_list(struct workqueue_struct *wq,
+				 struct wq_keyed_work *kw)
+{
+	struct wq_keyed_work *next;
+
+	for (; kw; kw = next) {
+		next = kw->next;
+		keyed_work_unreserve(wq, kw);
+		if (kw->work.deleter)
+			kw->work.deleter(kw->work.arg);
+		flush_color_put(wq, kw->work.color, 1u);
+		free(kw);
+	}
+}
+
+/*
+ * Run the works of the key until its list is empty, unless another
+ * dispatch work of the key is doing it already. Works queued meanwhile
+ * are appended and run by this loop.
+ */
+static void keyed_work_run(void *data)
+{
+	struct wq_key_dispatch *d = data;
+	struct wq_key *k = d->key;
+	struct wq_key_shard *shard = k->shard;
+	struct wq_keyed_work *kw;
+	bool last;
+
+	d->done = true;
+	mutex_lock(&shard->lock);
+	k->nr_queued[d->prio]--;
+	if (k->running)
+		goto out;
+
+	k->running = true;
+	while ((kw = k->head)) {
+		k->head = kw->next;
+		if (!k->head)
+			k->tail = &k->head;
+		mutex_unlock(&shard->lock);
+
+		keyed_work_unreserve(k->wq, kw);
+		kw->work.func(kw->work.arg);
+		if (kw->work.deleter)
+			kw->work.deleter(kw->work.arg);
+		flush_color_put(k->wq, kw->work.color, 1u);
+		free(kw);
+		mutex_lock(&shard->lock);
+	}
+	k->running = false;
+
+out:
+	last = !--k->nr_dispatch;
+	if (last)
+		key_unhash(k);
+	mutex_unlock(&shard->lock);
+
+	if (last)
+		free(k);
+}
+
+/*
+ * The deleter of a dispatch work. If it never ran and it was the last
+ * one of its key, the works of the key are dropped with it.
+ */
+static void keyed_work_drop(void *data)
+{
+	struct wq_key_dispatch *d = data;
+	struct wq_key *k = d->key;
+	struct wq_keyed_work *kw = NULL;
+	bool last;
+
+	if (d->done)
+		return;
+
+	mutex_lock(&k->shard->lock);
+	k->nr_queued[d->prio]--;
+	last = !--k->nr_dispatch;
+	if (last) {
+		key_unhash(k);
+		kw = k->head;
+	}
+	mutex_unlock(&k->shard->lock);
+
+	if (last) {
+		keyed_work_drop_list(k->wq, kw);
+		free(k);
+	}
+}
+
+/*
+ * A dispatch work of @prio could not be queued because the workqueue
+ * is being destroyed. The work that needed it stays on the key like
+ * the others: another dispatch work of the key runs it, or
+ * destroy_workqueue() drops it with the other pending works.
+ */
+static void keyed_work_abort(struct wq_key *k, uint32_t prio)
+{
+	bool last;
+
+	mutex_lock(&k->shard->lock);
+	k->nr_queued[prio]--;
+	last = !--k->nr_dispatch && !k->head;
+	if (last)
+		key_unhash(k);
+	mutex_unlock(&k->shard->lock);
+
+	if (last)
+		free(k);
+}
+
+/*
+ * A work of @prio needs a dispatch work of its own unless the key is
+ * running, or has one queued at the same or a higher priority.
+ */
+static bool key_needs_dispatch(struct wq_key *k, uint32_t prio)
+	__must_hold(&k->shard->lock)
+{
+	uint32_t i;
+
+	if (k->running)
+		return false;
+
+	for (i = 0; i <= prio; i++) {
+		if (k->nr_queued[i])
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Reserve room for a keyed work in @lane, waiting for it unless
+ * @nowait is set.
+ */
+static int keyed_work_reserve(struct workqueue_struct *wq,
+			      struct wq_lane *lane, bool nowait)
+{
+	int ret;
+
+	mutex_lock(&wq->work_list_lock);
+	while (1) {
+		ret = lane_check_room(wq, lane);
+		if (likely(!ret)) {
+			atomic_fetch_add_explicit(&lane->nr_keyed, 1u,
+						  memory_order_relaxed);
+			break;
+		}
+
+		if (ret != -EAGAIN)
+			break;
+
+		if (nowait) {
+			shared_inc(&wq->nr_queue_full);
+			break;
+		}
+
+		wait_for_room(wq);
+	}
+	mutex_unlock(&wq->work_list_lock);
+	return ret;
+}
+
+/*
+ * Queue a dispatch work in the room reserved by the work that needed
+ * it.
+ */
+static int queue_key_dispatch(struct workqueue_struct *wq, uint32_t prio,
+			      struct work_struct *work)
+{
+	struct wq_lane *lane = &wq->lanes[prio];
+	int ret = -EOWNERDEAD;
+
+	mutex_lock(&wq->work_list_lock);
+	atomic_fetch_sub_explicit(&lane->nr_keyed, 1u, memory_order_relaxed);
+	if (likely(!wq->should_stop)) {
+		work->color = WQ_NO_FLUSH_COLOR;
+		queue_work_locked(wq, lane, work);
+		ret = 0;
+	}
+	mutex_unlock(&wq->work_list_lock);
+
+	if (likely(!ret))
+		wake_up_workers(wq, 1u);
+
+	return ret;
+}
+
+/*
+ * Drop the keys left without a dispatch work, see keyed_work_abort().
+ * Called once all the workers are gone.
+ */
+static void free_keys(struct workqueue_struct *wq)
+{
+	struct wq_key_shard *shard;
+	struct wq_key *k;
+	uint32_t i, j;
+
+	for (i = 0; i < WQ_NR_KEY_SHARDS; i++) {
+		shard = &wq->key_shards[i];
+		for (j = 0; j < WQ_KEY_BUCKETS; j++) {
+			while ((k = shard->buckets[j])) {
+				shard->buckets[j] = k->hnext;
+				keyed_work_drop_list(wq, k->head);
+				free(k);
+			}
+		}
+	}
+}
+
+int queue_work_keyed(struct workqueue_struct *wq, uint64_t key,
+		     void (*func)(void *), void *arg, void (*deleter)(void *))
+{
+	return queue_work_keyed_prio(wq, WQ_PRIO_NORMAL, key, func, arg,
+				     deleter);
+}
+
+static int __queue_work_keyed(struct workqueue_struct *wq, uint32_t prio,
+			      uint64_t key, void (*func)(void *), void *arg,
+			      void (*deleter)(void *), bool nowait)
+{
+	struct wq_key_dispatch d;
+	struct work_struct work;
+	struct wq_key_shard *shard;
+	struct wq_keyed_work *kw;
+	struct wq_key **bucket;
+	struct wq_key *k;
+	bool dispatch;
+	int ret;
+
+	if (unlikely(prio >= WQ_NR_PRIO))
+		return -EINVAL;
+
+	kw = malloc(sizeof(*kw));
+	if (unlikely(!kw))
+		return -ENOMEM;
+
+	kw->work.func = func;
+	kw->work.arg = arg;
+	kw->work.deleter = deleter;
+	kw->next = NULL;
+	kw->lane = &wq->lanes[prio];
+
+	ret = keyed_work_reserve(wq, kw->lane, nowait);
+	if (unlikely(ret)) {
+		free(kw);
 		return ret;
+	}
 
-	size = sizeof(*wq) + attr.max_pending_works * sizeof(wq->work_list[0]);
-	wq = calloc(1u, size);
-	if (!wq)
-		return -ENOMEM;
+	shard = key_shard(wq, key, &bucket);
+	mutex_lock(&shard->lock);
+	for (k = *bucket; k; k = k->hnext) {
+		if (k->key == key)
+			break;
+	}
 
-	wq->attr = attr;
-	wq->mask = attr.max_pending_works - 1u;
-	wq->head = 0u;
-	wq->tail = 0u;
+	if (!k) {
+		k = calloc(1u, sizeof(*k));
+		if (unlikely(!k)) {
+			mutex_unlock(&shard->lock);
+			keyed_work_unreserve(wq, kw);
+			free(kw);
+			return -ENOMEM;
+		}
+
+		k->key = key;
+		k->tail = &k->head;
+		k->wq = wq;
+		k->shard = shard;
+		k->bucket = bucket;
+		k->hashed = true;
+		k->hnext = *bucket;
+		*bucket = k;
+	}
 
-	ret = mutex_init(&wq->work_list_lock);
-	if (ret)
-		goto err_free_wq;
-	ret = cond_init(&wq->worker_cond);
-	if (ret)
-		goto err_free_work_list_lock;
-	ret = cond_init(&wq->wait_all_cond);
-	if (ret)
-		goto err_free_work_list_cond;
-	ret = cond_init(&wq->queue_work_cond);
-	if (ret)
-		goto err_free_wait_all_cond;
-	ret = alloc_workers(wq);
-	if (ret)
-		goto err_free_queue_work_cond;
+	kw->work.color = flush_color_get(wq, 1u);
+	*k->tail = kw;
+	k->tail = &kw->next;
+	dispatch = key_needs_dispatch(k, prio);
+	if (dispatch) {
+		kw->lane = NULL;
+		k->nr_dispatch++;
+		k->nr_queued[prio]++;
+	}
+	mutex_unlock(&shard->lock);
 
-	*wq_p = wq;
-	return 0;
+	if (!dispatch)
+		return 0;
 
-err_free_queue_work_cond:
-	cond_destroy(&wq->queue_work_cond);
-err_free_wait_all_cond:
-	cond_destroy(&wq->wait_all_cond);
-err_free_work_list_cond:
-	cond_destroy(&wq->worker_cond);
-err_free_work_list_lock:
-	mutex_destroy(&wq->work_list_lock);
-err_free_wq:
-	free(wq);
-	return ret;
+	d.key = k;
+	d.prio = prio;
+	d.done = false;
+	init_work(&work, keyed_work_run, NULL, keyed_work_drop);
+	work.inline_size = sizeof(d);
+	memcpy(work.data, &d, sizeof(d));
+	if (unlikely(queue_key_dispatch(wq, prio, &work)))
+		keyed_work_abort(k, prio);
+
+	return 0;
 }
 
-void wait_all_work_done(struct workqueue_struct *wq)
+int queue_work_keyed_prio(struct workqueue_struct *wq, uint32_t prio,
+			  uint64_t key, void (*func)(void *), void *arg,
+			  void (*deleter)(void *))
 {
-	mutex_lock(&wq->work_list_lock);
-	wq->queue_is_blocked = true;
+	return __queue_work_keyed(wq, prio, key, func, arg, deleter, false);
+}
 
-	while (count_pending_works(wq) > 0 || wq->nr_running_workers) {
+/*
+ * Like queue_work_keyed_prio(), but fail with -EAGAIN instead of
+ * waiting when the lane of @prio is full, counting the keyed works
+ * waiting in it, or wait_all_work_done() is running.
+ */
+int try_queue_work_keyed_prio(struct workqueue_struct *wq, uint32_t prio,
+			      uint64_t key, void (*func)(void *), void *arg,
+			      void (*deleter)(void *))
+{
+	return __queue_work_keyed(wq, prio, key, func, arg, deleter, true);
+}
 
-		if (wq->should_stop)
-			break;
+static void delayed_work_put(void *arg)
+{
+	struct delayed_work *dw = arg;
+	struct workqueue_struct *wq = dw->wq;
+	bool last;
 
-		wq->wait_all_is_waiting = true;
-		cond_wait(&wq->wait_all_cond, &wq->work_list_lock);
-		wq->wait_all_is_waiting = false;
-	}
+	mutex_lock(&wq->delayed_lock);
+	last = !--dw->refs;
+	mutex_unlock(&wq->delayed_lock);
 
-	wq->queue_is_blocked = false;
-	mutex_unlock(&wq->work_list_lock);
+	if (last && dw->deleter)
+		dw->deleter(dw->arg);
 }
 
-static struct worker_thread *get_free_worker_slot(struct workqueue_struct *wq)
-	__must_hold(&wq->work_list_lock)
+static void delayed_work_run(void *arg)
 {
-	struct worker_thread *worker;
-	uint32_t i;
+	struct delayed_work *dw = arg;
 
-	for (i = 0; i < wq->attr.max_threads; i++) {
-		worker = &wq->workers[i];
-		if (!worker->wq)
-			return worker;
-	}
+	if (likely(dw->func))
+		dw->func(dw->arg);
+}
 
-	return NULL;
+/*
+ * The run of a delayed work found the workqueue full. Waiting for room
+ * would hold up every other timer of the base, so re-arm the timer
+ * instead. It keeps the reference of the run.
+ */
+static int delayed_work_retry(struct delayed_work *dw)
+{
+	struct workqueue_struct *wq = dw->wq;
+	int ret = -ECANCELED;
+
+	mutex_lock(&wq->delayed_lock);
+	if (likely(!dw->cancelled))
+		ret = gw_timer_add(wq->timers, &dw->timer,
+				   gw_time_now_ns() + WQ_DELAYED_RETRY_NS);
+	mutex_unlock(&wq->delayed_lock);
+	return ret;
 }
 
-static int arm_spawn_worker(struct workqueue_struct *wq)
-	__must_hold(&wq->work_list_lock)
+/*
+ * Timer callback. A delayed work hands the reference of its timer over
+ * to the run. A periodic work re-arms its timer first, and only queues
+ * a run (with a reference of its own) if the last one is done. The
+ * timer thread never waits for room: a delayed work tries again
+ * shortly, a periodic one skips the run.
+ */
+static void delayed_work_fire(struct gw_timer *t)
 {
-	struct worker_thread *worker;
+	struct delayed_work *dw = container_of(t, struct delayed_work, timer);
+	struct workqueue_struct *wq = dw->wq;
+	bool rearm_failed = false;
+	uint64_t next, now;
+	bool run = true;
+	int ret;
 
-	worker = get_free_worker_slot(wq);
-	if (!worker)
-		return -EAGAIN;
+	mutex_lock(&wq->delayed_lock);
+	if (unlikely(dw->cancelled)) {
+		mutex_unlock(&wq->delayed_lock);
+		delayed_work_put(dw);
+		return;
+	}
 
-	worker->wq = wq;
-	return thread_create(&worker->thread, &worker_func, worker);
+	if (dw->period_ns) {
+		run = (dw->refs == 1u);
+		if (run)
+			dw->refs++;
+
+		/*
+		 * Skip the periods the timer thread has missed.
+		 */
+		next = t->expires + dw->period_ns;
+		now = gw_time_now_ns();
+		if (unlikely(next <= now))
+			next += ((now - next) / dw->period_ns + 1u) * dw->period_ns;
+		rearm_failed = !!gw_timer_add(wq->timers, t, next);
+	}
+	mutex_unlock(&wq->delayed_lock);
+
+	if (run) {
+		ret = try_queue_work(wq, delayed_work_run, dw,
+				     delayed_work_put);
+		if (unlikely(ret == -EAGAIN) && !dw->period_ns)
+			ret = delayed_work_retry(dw);
+		if (unlikely(ret))
+			delayed_work_put(dw);
+	}
+	if (unlikely(rearm_failed))
+		delayed_work_put(dw);
 }
 
-static int arm_worker(struct workqueue_struct *wq)
-	__must_hold(&wq->work_list_lock)
+static void delayed_work_drop(struct gw_timer *t)
 {
-	if (unlikely(!wq->nr_sleeping_workers))
-		return arm_spawn_worker(wq);
+	delayed_work_put(container_of(t, struct delayed_work, timer));
+}
 
-	cond_signal(&wq->worker_cond);
-	return 0;
+void init_delayed_work(struct delayed_work *dw, void (*func)(void *),
+		       void *arg, void (*deleter)(void *))
+{
+	gw_timer_init(&dw->timer, &delayed_work_fire);
+	dw->wq = NULL;
+	dw->func = func;
+	dw->arg = arg;
+	dw->deleter = deleter;
+	dw->period_ns = 0;
+	dw->refs = 0;
+	dw->cancelled = false;
 }
 
-static int try_queue_work_locked(struct workqueue_struct *wq,
-				 struct work_struct *work)
-	__must_hold(&wq->work_list_lock)
+static int __queue_delayed_work(struct workqueue_struct *wq,
+				struct delayed_work *dw, uint64_t delay_ns,
+				uint64_t period_ns)
 {
-	if (unlikely(wq->should_stop))
-		return -EOWNERDEAD;
+	int ret;
 
-	if (unlikely(wq->queue_is_blocked))
-		return -EAGAIN;
+	mutex_lock(&wq->delayed_lock);
+	if (unlikely(dw->refs)) {
+		ret = -EBUSY;
+		goto out;
+	}
 
-	if (unlikely(count_pending_works(wq) >= wq->attr.max_pending_works))
-		return -EAGAIN;
+	dw->wq = wq;
+	dw->period_ns = period_ns;
+	dw->cancelled = false;
+	dw->refs = 1u;
+	ret = gw_timer_add(wq->timers, &dw->timer, gw_time_now_ns() + delay_ns);
+	if (unlikely(ret))
+		dw->refs = 0;
+out:
+	mutex_unlock(&wq->delayed_lock);
+	return ret;
+}
 
-	wq->work_list[wq->tail++ & wq->mask] = *work;
-	arm_worker(wq);
-	return 0;
+/*
+ * Queue @dw on @wq once @delay_ns has passed. Returns -EBUSY if @dw is
+ * still in use.
+ */
+int queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dw,
+		       uint64_t delay_ns)
+{
+	return __queue_delayed_work(wq, dw, delay_ns, 0);
 }
 
-int queue_work(struct workqueue_struct *wq, void (*func)(void *), void *arg,
-	       void (*deleter)(void *))
+/*
+ * Queue @dw on @wq every @period_ns, starting one period from now,
+ * until it is cancelled.
+ */
+int queue_periodic_work(struct workqueue_struct *wq, struct delayed_work *dw,
+			uint64_t period_ns)
 {
-	struct work_struct work;
-	int ret;
+	if (unlikely(!period_ns))
+		return -EINVAL;
 
-	work.func = func;
-	work.arg = arg;
-	work.deleter = deleter;
-	mutex_lock(&wq->work_list_lock);
-	while (1) {
-		ret = try_queue_work_locked(wq, &work);
-		if (likely(ret <= 0 && ret != -EAGAIN))
-			break;
+	return __queue_delayed_work(wq, dw, period_ns, period_ns);
+}
+
+/*
+ * Stop @dw from being queued again. Returns true if it was still
+ * pending. A run that is already queued or running still completes,
+ * and the deleter is called after it.
+ */
+bool cancel_delayed_work(struct delayed_work *dw)
+{
+	struct workqueue_struct *wq = dw->wq;
+	bool ret = false;
+
+	if (unlikely(!wq))
+		return false;
 
-		wq->nr_sleeping_queuers++;
-		cond_wait(&wq->queue_work_cond, &wq->work_list_lock);
-		wq->nr_sleeping_queuers--;
+	mutex_lock(&wq->delayed_lock);
+	if (dw->refs && !dw->cancelled) {
+		dw->cancelled = true;
+		ret = gw_timer_del(wq->timers, &dw->timer);
 	}
-	mutex_unlock(&wq->work_list_lock);
+	mutex_unlock(&wq->delayed_lock);
+
+	if (ret)
+		delayed_work_put(dw);
+
 	return ret;
 }
 
 static void clear_pending_works(struct workqueue_struct *wq)
 	__must_hold(&wq->work_list_lock)
 {
-	while (wq->head != wq->tail) {
-		struct work_struct *work;
+	struct work_struct *work;
+	struct wq_lane *lane;
+	uint32_t i;
 
-		work = &wq->work_list[wq->head++ & wq->mask];
-		if (work->deleter)
-			work->deleter(work->arg);
+	for (i = 0; i < WQ_NR_PRIO; i++) {
+		lane = &wq->lanes[i];
+		while (lane->head != lane->tail) {
+			work = &lane->works[lane->head++ & wq->mask];
+			drop_work(work);
+			flush_color_put(wq, work->color, 1u);
+		}
 	}
+	wq->nr_pending = 0;
+	if (is_work_stealing(wq))
+		ws_sync_injected(wq);
 }
 
 static void wake_up_all_workers(struct workqueue_struct *wq)
-	__must_hold(&wq->work_list_lock)
 {
-	uint32_t i = wq->nr_sleeping_workers;
-
-	if (i == 1u)
-		cond_signal(&wq->worker_cond);
-	else if (i > 1u)
-		cond_broadcast(&wq->worker_cond);
-	
-	if (wq->wait_all_is_waiting)
-		cond_broadcast(&wq->wait_all_cond);
+	wq_wake(&wq->worker_wait, WQ_WAKE_ALL);
+	wq_wake(&wq->wait_all_wait, WQ_WAKE_ALL);
+	wq_wake(&wq->flush_wait, WQ_WAKE_ALL);
 }
 
 static void join_all_workers(struct workqueue_struct *wq)
@@ -343,57 +2534,352 @@ static void join_all_workers(struct workqueue_struct *wq)
 	}
 }
 
+/*
+ * Drop the works left in the deques once all workers are gone, like
+ * clear_pending_works() does for the lanes.
+ */
+static void ws_free_deques(struct workqueue_struct *wq)
+{
+	struct work_struct work;
+	struct ws_deque *d;
+	uint32_t i;
+
+	for (i = 0; i < wq->attr.max_threads; i++) {
+		d = atomic_load_explicit(&wq->workers[i].deque,
+					 memory_order_relaxed);
+		if (!d)
+			continue;
+
+		while (ws_pop(d, &work)) {
+			drop_work(&work);
+			flush_color_put(wq, work.color, 1u);
+		}
+		free(d);
+	}
+}
+
 void destroy_workqueue(struct workqueue_struct *wq)
 {
+	/*
+	 * No delayed work gets queued, and grow_timer spawns no worker,
+	 * once the timer thread is gone. The pending delayed works are
+	 * dropped once the workers are.
+	 */
+	gw_timer_base_stop(wq->timers);
+	gw_timer_del(wq->timers, &wq->grow_timer);
+
 	mutex_lock(&wq->work_list_lock);
 	wq->should_stop = true;
 	clear_pending_works(wq);
-	wake_up_all_workers(wq);
 	mutex_unlock(&wq->work_list_lock);
+	wake_up_all_workers(wq);
+	wake_up_all_queue_work_callers(wq);
 
 	join_all_workers(wq);
+	if (is_work_stealing(wq))
+		ws_free_deques(wq);
+	gw_timer_base_destroy(wq->timers, &delayed_work_drop);
 	mutex_lock(&wq->work_list_lock);
 	mutex_unlock(&wq->work_list_lock);
-	cond_destroy(&wq->queue_work_cond);
-	cond_destroy(&wq->wait_all_cond);
-	cond_destroy(&wq->worker_cond);
+	free_keys(wq);
+	free_key_shards(wq->key_shards, WQ_NR_KEY_SHARDS);
+	mutex_destroy(&wq->flush_lock);
+	mutex_destroy(&wq->delayed_lock);
 	mutex_destroy(&wq->work_list_lock);
 	free(wq->workers);
 	free(wq);
 }
 
+/*
+ * Sleep on worker_wait with the lock dropped, @seq coming from
+ * wq_wait_prepare(). A worker that may be reaped only sleeps until
+ * *@deadline, which is set on the first call. Returns -ETIMEDOUT once
+ * the deadline has passed.
+ */
+static int worker_sleep(struct workqueue_struct *wq, uint32_t seq,
+			uint64_t *deadline)
+	__must_hold(&wq->work_list_lock)
+{
+	uint64_t until = 0;
+	int ret;
+
+	if (wq->attr.idle_timeout_ms && wq->nr_workers > wq->attr.min_threads) {
+		if (!*deadline)
+			*deadline = gw_time_now_ns() +
+				    (uint64_t)wq->attr.idle_timeout_ms *
+				    1000000ull;
+		until = *deadline;
+	}
+
+	mutex_unlock(&wq->work_list_lock);
+	ret = wq_wait_sleep(&wq->worker_wait, seq, until);
+	mutex_lock(&wq->work_list_lock);
+	return ret;
+}
+
+static bool should_reap_worker(struct workqueue_struct *wq, int sleep_ret)
+	__must_hold(&wq->work_list_lock)
+{
+	return sleep_ret == -ETIMEDOUT && !wq->nr_pending &&
+	       wq->nr_workers > wq->attr.min_threads;
+}
+
 static bool wait_for_event(struct workqueue_struct *wq)
 	__must_hold(&wq->work_list_lock)
 {
+	uint64_t deadline = 0;
+	uint32_t seq;
+	int ret;
+
 	while (1) {
 		if (unlikely(wq->should_stop && !wq->queue_is_blocked))
 			return false;
 
-		if (likely(wq->head != wq->tail))
+		if (likely(wq->nr_pending))
 			return true;
 
-		if (unlikely(wq->wait_all_is_waiting))
-			cond_broadcast(&wq->wait_all_cond);
-
+		wq_wake(&wq->wait_all_wait, WQ_WAKE_ALL);
+		seq = wq_wait_prepare(&wq->worker_wait);
 		wq->nr_sleeping_workers++;
-		cond_wait(&wq->worker_cond, &wq->work_list_lock);
+		ret = worker_sleep(wq, seq, &deadline);
 		wq->nr_sleeping_workers--;
+		wq_wait_finish(&wq->worker_wait);
+		if (should_reap_worker(wq, ret))
+			return false;
 	}
 }
 
-static void wake_up_all_queue_work_callers(struct workqueue_struct *wq)
+static void worker_exit(struct workqueue_struct *wq,
+			struct worker_thread *worker)
+	__must_hold(&wq->work_list_lock)
+{
+	wq->nr_online_workers--;
+	wq->nr_workers--;
+	worker->dead = true;
+	shared_inc(&wq->nr_threads_exited);
+}
+
+/*
+ * Take the next work in strict priority order, unless a lower lane has
+ * aged past WQ_AGING_THRESHOLD. The caller must make sure there is at
+ * least one pending work.
+ */
+static void pick_work(struct workqueue_struct *wq, struct work_struct *work)
 	__must_hold(&wq->work_list_lock)
 {
+	struct wq_lane *lane = NULL;
+	bool aged = false;
+	uint32_t i;
+
+	for (i = WQ_NR_PRIO - 1u; i > 0; i--) {
+		lane = &wq->lanes[i];
+		if (unlikely(lane->nr_skipped >= WQ_AGING_THRESHOLD) &&
+		    lane_depth(lane)) {
+			aged = true;
+			break;
+		}
+	}
+
+	if (likely(!aged)) {
+		for (i = 0; i < WQ_NR_PRIO; i++) {
+			lane = &wq->lanes[i];
+			if (lane_depth(lane))
+				break;
+		}
+	} else {
+		lane->nr_aged++;
+	}
+
+	assert(i < WQ_NR_PRIO);
+	lane->nr_skipped = 0;
+	copy_work(work, &lane->works[lane->head++ & wq->mask]);
+	wq->nr_pending--;
+
+	while (++i < WQ_NR_PRIO) {
+		lane = &wq->lanes[i];
+		if (lane_depth(lane))
+			lane->nr_skipped++;
+	}
+}
+
+/*
+ * Take up to WQ_INJECT_BATCH works from the lanes: the first one in
+ * @work, the others on the bottom of the caller's deque, in reverse so
+ * that they get popped in lane order.
+ */
+static bool ws_grab_injected(struct workqueue_struct *wq,
+			     struct worker_thread *worker,
+			     struct work_struct *work)
+{
+	struct work_struct batch[WQ_INJECT_BATCH - 1];
+	struct ws_deque *d;
+	int64_t room;
+	uint32_t nr = 0;
+
+	d = atomic_load_explicit(&worker->deque, memory_order_relaxed);
+	room = WQ_DEQUE_SIZE -
+	       (atomic_load_explicit(&d->bottom, memory_order_relaxed) -
+		atomic_load_explicit(&d->top, memory_order_relaxed));
+
+	mutex_lock(&wq->work_list_lock);
+	if (unlikely(!wq->nr_pending)) {
+		mutex_unlock(&wq->work_list_lock);
+		return false;
+	}
+
+	pick_work(wq, work);
+	while (nr < WQ_INJECT_BATCH - 1 && nr < room && wq->nr_pending)
+		pick_work(wq, &batch[nr++]);
+
+	ws_sync_injected(wq);
+	atomic_fetch_sub_explicit(&wq->ws_nr_queued, 1u, memory_order_relaxed);
+	grow_workers_on_pick(wq);
+	mutex_unlock(&wq->work_list_lock);
+	wake_up_all_queue_work_callers(wq);
+
+	/*
+	 * Let an idle worker steal the rest of the batch.
+	 */
+	if (nr) {
+		while (nr--)
+			ws_push(d, &batch[nr]);
+		wake_up_workers(wq, 1u);
+	}
+	return true;
+}
+
+static bool ws_steal_work(struct workqueue_struct *wq,
+			  struct worker_thread *worker,
+			  struct work_struct *work)
+{
+	uint32_t nr = atomic_load_explicit(&wq->ws_nr_slots,
+					   memory_order_acquire);
+	struct worker_thread *victim;
+	struct ws_deque *d;
+	uint32_t start;
 	uint32_t i;
 
-	if (likely(!wq->nr_running_workers))
+	start = ws_rand(worker) % nr;
+	for (i = 0; i < nr; i++) {
+		victim = &wq->workers[(start + i) % nr];
+		if (victim == worker)
+			continue;
+
+		d = atomic_load_explicit(&victim->deque, memory_order_acquire);
+		if (d && ws_steal(d, work))
+			return true;
+	}
+
+	return false;
+}
+
+static bool ws_find_work(struct workqueue_struct *wq,
+			 struct worker_thread *worker,
+			 struct work_struct *work)
+{
+	struct ws_deque *d;
+
+	if (unlikely(atomic_load_explicit(&wq->ws_nr_high,
+					  memory_order_relaxed)) &&
+	    ws_grab_injected(wq, worker, work))
+		return true;
+
+	d = atomic_load_explicit(&worker->deque, memory_order_relaxed);
+	if (ws_pop(d, work))
+		goto out_taken;
+
+	if (atomic_load_explicit(&wq->ws_nr_injected, memory_order_relaxed) &&
+	    ws_grab_injected(wq, worker, work))
+		return true;
+
+	if (ws_steal_work(wq, worker, work))
+		goto out_taken;
+
+	return false;
+
+out_taken:
+	atomic_fetch_sub_explicit(&wq->ws_nr_queued, 1u, memory_order_relaxed);
+	return true;
+}
+
+/*
+ * Sleep until some work is queued. Returns false if the worker has to
+ * exit.
+ */
+static bool ws_wait_for_work(struct workqueue_struct *wq)
+{
+	uint64_t deadline = 0;
+	bool ret = true;
+	uint32_t seq;
+	int err;
+
+	mutex_lock(&wq->work_list_lock);
+	wq->nr_sleeping_workers++;
+	while (1) {
+		if (unlikely(wq->should_stop && !wq->queue_is_blocked)) {
+			ret = false;
+			break;
+		}
+
+		seq = wq_wait_prepare(&wq->worker_wait);
+		if (atomic_load_explicit(&wq->ws_nr_queued,
+					 memory_order_seq_cst)) {
+			wq_wait_finish(&wq->worker_wait);
+			break;
+		}
+
+		/*
+		 * The deque of this worker is empty, it has just failed
+		 * to pop from it. So it can go without losing works.
+		 */
+		err = worker_sleep(wq, seq, &deadline);
+		wq_wait_finish(&wq->worker_wait);
+		if (should_reap_worker(wq, err)) {
+			ret = false;
+			break;
+		}
+	}
+	wq->nr_sleeping_workers--;
+	mutex_unlock(&wq->work_list_lock);
+	return ret;
+}
+
+static void ws_work_done(struct workqueue_struct *wq)
+{
+	if (likely(atomic_fetch_sub_explicit(&wq->ws_nr_outstanding, 1u,
+					     memory_order_acq_rel) != 1u))
 		return;
 
-	i = wq->nr_sleeping_queuers;
-	if (i == 1u)
-		cond_signal(&wq->queue_work_cond);
-	else if (i > 1u)
-		cond_broadcast(&wq->queue_work_cond);
+	wq_wake(&wq->wait_all_wait, WQ_WAKE_ALL);
+}
+
+static void ws_worker_func(struct worker_thread *worker)
+{
+	struct workqueue_struct *wq = worker->wq;
+	struct work_struct work;
+
+	mutex_lock(&wq->work_list_lock);
+	wq->nr_online_workers++;
+	mutex_unlock(&wq->work_list_lock);
+
+	while (1) {
+		if (unlikely(wq->should_stop && !wq->queue_is_blocked))
+			break;
+
+		if (!ws_find_work(wq, worker, &work)) {
+			if (!ws_wait_for_work(wq))
+				break;
+			continue;
+		}
+
+		worker_run_work(worker, &work);
+
+		ws_work_done(wq);
+	}
+
+	mutex_lock(&wq->work_list_lock);
+	worker_exit(wq, worker);
+	mutex_unlock(&wq->work_list_lock);
 }
 
 static void *worker_func(void *arg)
@@ -402,23 +2888,28 @@ static void *worker_func(void *arg)
 	struct workqueue_struct *wq = worker->wq;
 	struct work_struct work;
 
+	current_worker = worker;
+	apply_affinity(wq);
+	if (is_work_stealing(wq)) {
+		ws_worker_func(worker);
+		return arg;
+	}
+
 	mutex_lock(&wq->work_list_lock);
 	wq->nr_online_workers++;
 	while (wait_for_event(wq)) {
-		work = wq->work_list[wq->head++ & wq->mask];
+		pick_work(wq, &work);
+		grow_workers_on_pick(wq);
 		wq->nr_running_workers++;
 		mutex_unlock(&wq->work_list_lock);
+		wake_up_all_queue_work_callers(wq);
 
-		if (likely(work.func))
-			work.func(work.arg);
-		if (work.deleter)
-			work.deleter(work.arg);
+		worker_run_work(worker, &work);
 
 		mutex_lock(&wq->work_list_lock);
 		wq->nr_running_workers--;
-		wake_up_all_queue_work_callers(wq);
 	}
-	wq->nr_online_workers--;
+	worker_exit(wq, worker);
 	mutex_unlock(&wq->work_list_lock);
 	return arg;
 }
@@ -47,6 +47,29 @@
 #define __aligned(x)	__attribute__((__aligned__(x)))
 #endif
 
+#ifndef GW_CACHELINE_SIZE
+#define GW_CACHELINE_SIZE	64
+#endif
+
+#ifndef __cacheline_aligned
+#define __cacheline_aligned	__aligned(GW_CACHELINE_SIZE)
+#endif
+
+#ifndef cpu_relax
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()	__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()	__asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax()	__asm__ __volatile__("" ::: "memory")
+#endif
+#endif
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#endif
+
 #ifdef __CHECKER__
 #define __must_hold(x)		__attribute__((__context__(x, 1, 1)))
 #define __acquires(x)		__attribute__((__context__(x, 0, 1)))
@@ -68,9 +91,22 @@
 #include <gw/ring.h>
 struct tg_bot_ctx {
 	struct gw_ring		ring;
-	struct tg_updates	*updates;
 	struct tg_api_ctx	tctx;
 	int64_t			max_update_id;
+
+	/*
+	 * Updates from these chats, or carrying one of these commands,
+	 * are handled in the high priority io worker lane.
+	 */
+	int64_t			*prio_chats;
+	size_t			nr_prio_chats;
+	const char		*prio_commands;
+
+	/*
+	 * How long to back off while gw_ring_submit() fails with
+	 * -EBUSY, 0 when it doesn't.
+	 */
+	uint32_t		submit_busy_ns;
 };
 #include <gw/print.h>
 
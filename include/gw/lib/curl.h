@@ -6,8 +6,12 @@
 #ifndef GNUWEEB__LIB__CURL_H
 #define GNUWEEB__LIB__CURL_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+
 int gw_curl_global_init(long flags);
 void gw_curl_global_cleanup(void);
 void *gw_curl_thread_init(void);
+void gw_curl_set_cancel_flag(const _Atomic(bool) *flag);
 
 #endif /* #ifndef GNUWEEB__LIB__CURL_H */
@@ -206,8 +206,12 @@ struct tg_updates {
 	struct tg_update	updates[];
 };
 
+/*
+ * api_url is the Bot API server, "https://api.telegram.org" if NULL.
+ */
 struct tg_api_ctx {
 	const char		*token;
+	const char		*api_url;
 };
 
 struct tga_call_send_message {
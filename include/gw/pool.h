@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2023  Ammar Faizi <ammarfaizi2@gnuweeb.org>
+ */
+
+#ifndef GNUWEEB__POOL_H
+#define GNUWEEB__POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The counters are updated lazily from the per-thread caches, so they
+ * may lag behind a bit. nr_alloc - nr_free is the number of objects in
+ * use, nr_fallback the number of allocations served by malloc().
+ */
+struct gw_pool_stats {
+	uint64_t	nr_objs;
+	uint64_t	nr_alloc;
+	uint64_t	nr_free;
+	uint64_t	nr_refill;
+	uint64_t	nr_fallback;
+};
+
+struct gw_pool;
+
+int gw_pool_init(struct gw_pool **pool_p, size_t obj_size, uint32_t nr_objs);
+void gw_pool_destroy(struct gw_pool *pool);
+void *gw_pool_alloc(struct gw_pool *pool);
+void gw_pool_free(struct gw_pool *pool, void *obj);
+void gw_pool_get_stats(struct gw_pool *pool, struct gw_pool_stats *stats);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif /* #ifndef GNUWEEB__POOL_H */
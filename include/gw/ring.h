@@ -9,8 +9,11 @@
 #include <gw/common.h>
 #include <gw/workqueue.h>
 #include <gw/thread.h>
+#include <gw/timer.h>
+#include <gw/pool.h>
 #include <gw/lib/tgapi.h>
 #include <stdatomic.h>
+#include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
 
@@ -18,10 +21,121 @@ enum {
 	GW_RING_OP_NOP = 0,
 	GW_RING_OP_TG_API_CALL = 1,
 	GW_RING_OP_MODULE_HANDLE = 2,
+	GW_RING_OP_TIMEOUT = 3,
+	GW_RING_OP_ASYNC_CANCEL = 4,
+	GW_RING_NR_OPS = 5,
 };
 
+enum {
+	/*
+	 * Always punt the SQE to the io workqueue, even if the op
+	 * could be completed inline at submit time.
+	 */
+	GW_RING_SQE_F_ASYNC = (1u << 0u),
+
+	/*
+	 * Don't issue the next SQE until this one completes
+	 * successfully (res >= 0, or -ETIME for a timeout). If it
+	 * fails, every remaining SQE of the chain completes with
+	 * -ECANCELED. The chain ends at the first SQE without this
+	 * flag.
+	 */
+	GW_RING_SQE_F_LINK = (1u << 1u),
+};
+
+enum {
+	/*
+	 * Start a dedicated SQ thread that issues the SQEs. Submitting
+	 * then only publishes the new SQ tail (and wakes the thread up
+	 * if it has parked). Submission errors are reported with a CQE.
+	 */
+	GW_RING_SETUP_F_SQPOLL = (1u << 0u),
+
+	/*
+	 * Create one io workqueue per online NUMA node, with its
+	 * workers kept on the CPUs of that node. Punted SQEs are spread
+	 * over the workqueues round-robin, keyed ones by key.
+	 */
+	GW_RING_SETUP_F_NUMA = (1u << 1u),
+};
+
+#define GW_RING_SETUP_F_ALL (		\
+	GW_RING_SETUP_F_SQPOLL |	\
+	GW_RING_SETUP_F_NUMA		\
+)
+
+enum {
+	/*
+	 * The SQ thread has parked and must be woken up to see new
+	 * SQEs.
+	 */
+	GW_RING_SQ_F_NEED_WAKEUP = (1u << 0u),
+};
+
+enum {
+	/*
+	 * Only signal the eventfd when the CQ goes from empty to
+	 * non-empty. The consumer must call gw_ring_cq_ready() after
+	 * advancing the CQ and keep reaping while it returns true
+	 * before going back to poll the eventfd.
+	 */
+	GW_RING_EVFD_F_COALESCE = (1u << 0u),
+};
+
+#define GW_RING_EVFD_F_ALL (		\
+	GW_RING_EVFD_F_COALESCE		\
+)
+
+enum {
+	/*
+	 * The CQ was full and some CQEs are waiting in the overflow
+	 * list. They are moved into the CQ as the consumer advances it.
+	 */
+	GW_RING_CQ_F_OVERFLOW = (1u << 0u),
+};
+
+enum {
+	/*
+	 * The SQE is still active and will post more CQEs. The last
+	 * CQE of a multishot request doesn't have this flag.
+	 */
+	GW_RING_CQE_F_MORE = (1u << 0u),
+};
+
+enum {
+	/*
+	 * The timeout is an absolute CLOCK_MONOTONIC time instead of
+	 * being relative to the submission.
+	 */
+	GW_RING_TIMEOUT_F_ABS = (1u << 0u),
+};
+
+#define GW_RING_TIMEOUT_F_ALL (		\
+	GW_RING_TIMEOUT_F_ABS		\
+)
+
+enum {
+	/*
+	 * Cancel every matching request instead of only the first
+	 * one. The CQE res is the number of requests found.
+	 */
+	GW_RING_CANCEL_F_MATCH_ALL = (1u << 0u),
+};
+
+#define GW_RING_CANCEL_F_ALL (		\
+	GW_RING_CANCEL_F_MATCH_ALL	\
+)
+
 enum {
 	TG_API_GET_UPDATES = 0,
+
+	/*
+	 * Keep polling in the io worker and post one CQE with
+	 * GW_RING_CQE_F_MORE per batch of updates, with the batch in
+	 * cqe->data. The offset is advanced by the worker. It only
+	 * stops when it fails or gets cancelled.
+	 */
+	TG_API_GET_UPDATES_MULTISHOT = 1,
 };
 
 struct tg_api_call {
@@ -35,53 +149,276 @@ struct tg_api_call {
 	};
 };
 
+enum {
+	/*
+	 * Run the module handle SQEs with the same key one at a time, in
+	 * submission order. SQEs with different keys still run in
+	 * parallel. A key runs at the highest priority of its waiting
+	 * SQEs.
+	 */
+	GW_RING_MODULE_HANDLE_F_KEYED = (1u << 0u),
+};
+
 struct tg_module_handle {
 	struct tg_bot_ctx	*ctx;
 	struct tg_update	*update;
+	uint64_t		key;
+	uint32_t		flags;
+};
+
+/*
+ * Post a CQE with res = -ETIME once the timeout expires.
+ */
+struct gw_ring_timeout {
+	struct timespec		ts;
+	uint32_t		flags;
+};
+
+/*
+ * Cancel the punted SQEs and pending timeouts whose user_data matches.
+ * A request that has not started yet completes with -ECANCELED right
+ * away. A running one is asked to stop, see gw_ring_cancel_requested().
+ * The CQE res of the cancel itself is 0 if a request was cancelled,
+ * -EALREADY if it was already running, or -ENOENT if none matched.
+ */
+struct gw_ring_cancel {
+	uint64_t		user_data;
+	uint32_t		flags;
 };
 
+/*
+ * sqe->prio selects the io workqueue lane (WQ_PRIO_*) a punted SQE is
+ * queued on. gw_ring_get_sqe() sets it to WQ_PRIO_NORMAL. It has no
+ * effect on ops completed inline.
+ */
+
+/*
+ * SQEs and CQEs have a fixed size so that they never straddle a cache
+ * line: one SQE per line, two CQEs per line. The op specific part of
+ * the SQE must fit in the union's padding.
+ */
 struct gw_ring_sqe {
 	uint8_t		op;
+	uint8_t		flags;
+	uint8_t		prio;
+	uint8_t		__pad1;
+	uint32_t	__pad2;
 	uint64_t	user_data;
 	union {
 		struct tg_api_call	tg_api_call;
 		struct tg_module_handle	tg_module_handle;
+		struct gw_ring_timeout	timeout;
+		struct gw_ring_cancel	cancel;
+		uint64_t		__pad3[6];
 	};
 };
 
 struct gw_ring_cqe {
-	uint8_t		op;
+	uint64_t	user_data;
 	int64_t		res;
+	void		*data;
 	uint32_t	flags;
-	uint64_t	user_data;
+	uint8_t		op;
+	uint8_t		__pad1;
+	uint16_t	__pad2;
 };
 
-struct gw_ring {
-	volatile bool		should_stop;
-	volatile bool		wait_cqe_cond_flag;
+static_assert(sizeof(struct gw_ring_sqe) == 64, "gw_ring_sqe must be 64 bytes");
+static_assert(sizeof(struct gw_ring_cqe) == 32, "gw_ring_cqe must be 32 bytes");
 
-	_Atomic(uint32_t)	sq_head;
-	_Atomic(uint32_t)	sq_tail;
-	uint32_t		sq_mask;
-	mutex_t			sq_lock;
+enum {
+	GW_RING_LAT_NR_BUCKETS = 32,
+};
 
-	_Atomic(uint32_t)	cq_head;
-	_Atomic(uint32_t)	cq_tail;
-	uint32_t		cq_mask;
-	mutex_t			cq_lock;
+/*
+ * Latencies are counted in log2 buckets: bucket 0 counts the zero
+ * ones, bucket i the ones in [2^(i-1), 2^i) nanoseconds, and the last
+ * bucket everything above. queue_lat is the time a punted SQE waited
+ * in the io workqueue, run_lat the time its worker spent on it. SQEs
+ * completed inline only show up in the counters.
+ */
+struct gw_ring_op_stats {
+	uint64_t	nr_submitted;
+	uint64_t	nr_completed;
+	uint64_t	nr_punted;
+	uint64_t	queue_lat[GW_RING_LAT_NR_BUCKETS];
+	uint64_t	run_lat[GW_RING_LAT_NR_BUCKETS];
+};
+
+/*
+ * sq_depth is the number of submitted SQEs the SQ thread hasn't
+ * picked up yet, cq_depth the number of CQEs waiting to be reaped and
+ * wq_depth the works pending in each io workqueue lane. nr_sqe_full
+ * counts the gw_ring_get_sqe() and gw_ring_get_sqes() calls that
+ * found the SQ full, nr_sq_busy the submissions that found the io
+ * workqueues full.
+ *
+ * The pool_* fields describe sqe_pool, see struct gw_pool_stats:
+ * pool_in_use is the number of punted SQE copies not freed yet, and
+ * may lag a bit behind.
+ */
+struct gw_ring_stats {
+	uint32_t		sq_depth;
+	uint32_t		cq_depth;
+	uint32_t		wq_depth[WQ_NR_PRIO];
+	uint64_t		nr_sqe_full;
+	uint64_t		nr_sq_busy;
+	uint64_t		cq_overflow;
+	uint64_t		cq_dropped;
+	uint64_t		pool_nr_objs;
+	uint64_t		pool_in_use;
+	uint64_t		pool_nr_refill;
+	uint64_t		pool_nr_fallback;
+	struct gw_ring_op_stats	ops[GW_RING_NR_OPS];
+};
 
-	cond_t			wait_cqe_cond;
+/*
+ * The SQ is single producer single consumer: only the thread that owns
+ * the ring may call gw_ring_get_sqe() and gw_ring_submit(). The producer
+ * fills entries up to the private sqe_tail and gw_ring_submit() publishes
+ * them by storing sq_tail with release semantics.
+ *
+ * With GW_RING_SETUP_F_SQPOLL, sq_thread is the consumer. It polls
+ * sq_tail and parks on sq_wait_cond after a while without new SQEs,
+ * setting GW_RING_SQ_F_NEED_WAKEUP in sq_flags so that gw_ring_submit()
+ * knows it has to wake it up.
+ *
+ * The CQ is multi producer single consumer: completions are posted from
+ * the io workqueue threads. A producer reserves a slot by bumping cq_tail
+ * with CAS, fills the CQE, then publishes it by storing the slot's
+ * sequence number (position + 1) in cq_seqs[] with release semantics.
+ * The consumer only sees a CQE once its sequence number matches, so a
+ * slow producer never blocks the other producers.
+ *
+ * cq_wait_lock and cq_wait_cond are only used to put the consumer to
+ * sleep when the CQ is empty. Producers skip them entirely unless
+ * nr_cq_waiters is non-zero, and only wake the consumer up once the CQ
+ * holds the cq_wait_nr CQEs it waits for (see gw_ring_wait_cqes()).
+ * Before sleeping, the consumer spins for a while sized from
+ * cq_wait_avg_ns, the moving average of how long its recent waits
+ * took, and capped by cq_wait_max_spin_ns (see gw_ring_set_wait_spin()).
+ *
+ * If an eventfd is registered with gw_ring_register_eventfd(), posting
+ * a CQE also signals it, so the CQ can be polled with epoll together
+ * with other file descriptors.
+ *
+ * When the CQ is full, completions go to a bounded overflow list
+ * (max_cq_overflow entries) under cq_overflow_lock and
+ * GW_RING_CQ_F_OVERFLOW is set in cq_flags. Once the flag is set, new
+ * completions queue behind the list so they stay in order. The list is
+ * flushed into the CQ by gw_ring_cq_advance(). cq_overflow counts the
+ * CQEs that went through the list, cq_dropped the ones that didn't fit
+ * in it either.
+ *
+ * There is one io workqueue in wqs[], or one per online NUMA node
+ * with GW_RING_SETUP_F_NUMA. wq_next picks the one the next batch of
+ * punted SQEs goes to.
+ *
+ * SQEs punted to the io workqueue are copied into objects taken from
+ * sqe_pool, which keeps a per-thread cache so that the submitter and
+ * the workers don't go through malloc() for every request.
+ *
+ * Punted SQEs and pending timeouts are tracked in cancel_hash, keyed by
+ * user_data, until they complete, so GW_RING_OP_ASYNC_CANCEL can find them.
+ *
+ * The per-op counters and latency histograms live in stats_shards.
+ * Each thread takes the first free shard and gives it back when it
+ * exits. Once all are taken, the other threads share the last one.
+ * gw_ring_get_stats() sums the shards up.
+ *
+ * The fields are grouped by the side that writes them, and each group
+ * sits on its own cache line, so the submitter, the CQ consumer and the
+ * CQ producers don't false-share the indexes they update.
+ */
+struct gw_ring_cancel_bucket;
+struct gw_ring_stats_shard;
 
+struct gw_ring_overflow_cqe;
+
+struct gw_ring {
+	/*
+	 * Read-mostly.
+	 */
+	_Atomic(bool)		should_stop;
+	uint32_t		setup_flags;
+	uint32_t		sq_mask;
+	uint32_t		cq_mask;
+	_Atomic(uint32_t)	cq_flags;
+	_Atomic(int)		cq_evfd;
+	uint32_t		cq_evfd_flags;
+	uint32_t		max_cq_overflow;
+	_Atomic(uint32_t)	*cq_seqs;
 	struct gw_ring_cqe	*cqes;
 	struct gw_ring_sqe	*sqes;
-	struct workqueue_struct	*wq;
+	struct workqueue_struct	**wqs;
+	uint32_t		nr_wqs;
+	struct gw_timer_base	*timers;
+	struct gw_pool		*sqe_pool;
+	struct gw_ring_cancel_bucket	*cancel_hash;
+	struct gw_ring_stats_shard	*stats_shards;
+
+	/*
+	 * SQ producer.
+	 */
+	uint32_t		sqe_tail __cacheline_aligned;
+	_Atomic(uint32_t)	sq_tail;
+	_Atomic(uint64_t)	nr_sqe_full;
+
+	/*
+	 * SQ consumer.
+	 */
+	_Atomic(uint32_t)	sq_head __cacheline_aligned;
+	_Atomic(uint32_t)	sq_flags;
+	_Atomic(uint64_t)	nr_sq_busy;
+	_Atomic(uint32_t)	wq_next;
+	mutex_t			sq_wait_lock;
+	cond_t			sq_wait_cond;
+	thread_t		sq_thread;
+
+	/*
+	 * CQ consumer.
+	 */
+	_Atomic(uint32_t)	cq_head __cacheline_aligned;
+	_Atomic(uint32_t)	nr_cq_waiters;
+	_Atomic(uint32_t)	cq_wait_nr;
+	uint32_t		cq_wait_max_spin_ns;
+	uint64_t		cq_wait_avg_ns;
+
+	/*
+	 * CQ producers.
+	 */
+	_Atomic(uint32_t)	cq_tail __cacheline_aligned;
+	_Atomic(uint32_t)	nr_cq_evfd_users;
+
+	mutex_t			cq_wait_lock __cacheline_aligned;
+	cond_t			cq_wait_cond;
+
+	mutex_t			cq_overflow_lock;
+	struct gw_ring_overflow_cqe	*cq_overflow_head;
+	struct gw_ring_overflow_cqe	**cq_overflow_tail;
+	uint32_t		nr_cq_overflow;
+	_Atomic(uint64_t)	cq_overflow;
+	_Atomic(uint64_t)	cq_dropped;
 };
 
 int gw_ring_init(struct gw_ring *ring, uint32_t size);
+int gw_ring_init_flags(struct gw_ring *ring, uint32_t size, uint32_t flags);
 void gw_ring_destroy(struct gw_ring *ring);
 int gw_ring_submit(struct gw_ring *ring);
 struct gw_ring_sqe *gw_ring_get_sqe(struct gw_ring *ring);
+uint32_t gw_ring_get_sqes(struct gw_ring *ring, uint32_t nr,
+			  struct gw_ring_sqe **sqes);
 int gw_ring_wait_cqe(struct gw_ring *ring, struct gw_ring_cqe **cqe_p);
+int gw_ring_wait_cqe_timeout(struct gw_ring *ring, struct gw_ring_cqe **cqe_p,
+			     const struct timespec *ts);
+int gw_ring_wait_cqes(struct gw_ring *ring, struct gw_ring_cqe **cqe_p,
+		      uint32_t min_nr, const struct timespec *ts);
+void gw_ring_set_wait_spin(struct gw_ring *ring, uint32_t max_spin_ns);
+void gw_ring_get_stats(struct gw_ring *ring, struct gw_ring_stats *stats);
+int gw_ring_register_eventfd(struct gw_ring *ring, int fd, uint32_t flags);
+int gw_ring_unregister_eventfd(struct gw_ring *ring);
+void __gw_ring_cq_flush_overflow(struct gw_ring *ring);
+bool gw_ring_cancel_requested(void);
 
 static inline void gw_ring_prep_tg_get_updates(struct gw_ring_sqe *sqe,
 					       struct tg_api_ctx *ctx,
@@ -97,6 +434,19 @@ static inline void gw_ring_prep_tg_get_updates(struct gw_ring_sqe *sqe,
 	call->offset = offset;
 }
 
+static inline void gw_ring_prep_tg_get_updates_multishot(struct gw_ring_sqe *sqe,
+							 struct tg_api_ctx *ctx,
+							 int64_t offset)
+{
+	struct tg_api_call *call = &sqe->tg_api_call;
+
+	sqe->op = GW_RING_OP_TG_API_CALL;
+	call->op = TG_API_GET_UPDATES_MULTISHOT;
+	call->ctx = ctx;
+	call->updates_p = NULL;
+	call->offset = offset;
+}
+
 static inline void gw_ring_prep_tg_module_handle(struct gw_ring_sqe *sqe,
 						 struct tg_bot_ctx *ctx,
 						 struct tg_update *update)
@@ -106,6 +456,39 @@ static inline void gw_ring_prep_tg_module_handle(struct gw_ring_sqe *sqe,
 	sqe->op = GW_RING_OP_MODULE_HANDLE;
 	handle->ctx = ctx;
 	handle->update = update;
+	handle->key = 0;
+	handle->flags = 0;
+}
+
+static inline void gw_ring_prep_tg_module_handle_keyed(struct gw_ring_sqe *sqe,
+						       struct tg_bot_ctx *ctx,
+						       struct tg_update *update,
+						       uint64_t key)
+{
+	gw_ring_prep_tg_module_handle(sqe, ctx, update);
+	sqe->tg_module_handle.key = key;
+	sqe->tg_module_handle.flags = GW_RING_MODULE_HANDLE_F_KEYED;
+}
+
+static inline void gw_ring_prep_timeout(struct gw_ring_sqe *sqe,
+					const struct timespec *ts,
+					uint32_t flags)
+{
+	struct gw_ring_timeout *timeout = &sqe->timeout;
+
+	sqe->op = GW_RING_OP_TIMEOUT;
+	timeout->ts = *ts;
+	timeout->flags = flags;
+}
+
+static inline void gw_ring_prep_cancel(struct gw_ring_sqe *sqe,
+				       uint64_t user_data, uint32_t flags)
+{
+	struct gw_ring_cancel *cancel = &sqe->cancel;
+
+	sqe->op = GW_RING_OP_ASYNC_CANCEL;
+	cancel->user_data = user_data;
+	cancel->flags = flags;
 }
 
 static inline uint32_t u32_diff(uint32_t a, uint32_t b)
@@ -113,24 +496,56 @@ static inline uint32_t u32_diff(uint32_t a, uint32_t b)
 	return (uint32_t)llabs((int64_t)a - (int64_t)b);
 }
 
+/*
+ * Return true if some CQEs didn't fit in the CQ and are waiting in the
+ * overflow list, i.e., the consumer is falling behind.
+ */
+static inline bool gw_ring_cq_overflowed(struct gw_ring *ring)
+{
+	return atomic_load_explicit(&ring->cq_flags, memory_order_relaxed) &
+	       GW_RING_CQ_F_OVERFLOW;
+}
+
 static inline void gw_ring_cq_advance(struct gw_ring *ring, uint32_t n)
 {
 	atomic_fetch_add_explicit(&ring->cq_head, n, memory_order_release);
+	if (unlikely(gw_ring_cq_overflowed(ring)))
+		__gw_ring_cq_flush_overflow(ring);
 }
 
 static inline struct gw_ring_cqe *gw_ring_load_head_cqe(struct gw_ring *ring,
 							uint32_t head)
 {
-	uint32_t tail = smp_load_acquire(&ring->cq_tail);
-	uint32_t cq_mask = ring->cq_mask;
-	struct gw_ring_cqe *cqe;
+	uint32_t idx = head & ring->cq_mask;
+
+	if (smp_load_acquire(&ring->cq_seqs[idx]) != head + 1u)
+		return NULL;
+
+	return &ring->cqes[idx];
+}
+
+/*
+ * Return true if the CQ has a CQE ready to be reaped. Call this after
+ * gw_ring_cq_advance() before going back to wait on the eventfd.
+ */
+static inline bool gw_ring_cq_ready(struct gw_ring *ring)
+{
+	uint32_t head = atomic_load_explicit(&ring->cq_head,
+					     memory_order_relaxed);
+
+	/*
+	 * Pairs with the fence in post_cqe(). Either the producer sees
+	 * our new head and signals the eventfd, or we see its CQE.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (gw_ring_load_head_cqe(ring, head))
+		return true;
 
-	if (head != tail)
-		cqe = &ring->cqes[head & cq_mask];
-	else
-		cqe = NULL;
+	if (likely(!gw_ring_cq_overflowed(ring)))
+		return false;
 
-	return cqe;
+	__gw_ring_cq_flush_overflow(ring);
+	return gw_ring_load_head_cqe(ring, head) != NULL;
 }
 
 #define gw_ring_for_each_cqe(ring, head, cqe)		\
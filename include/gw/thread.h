@@ -6,6 +6,8 @@
 #ifndef GNUWEEB__THREAD_H
 #define GNUWEEB__THREAD_H
 
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -15,12 +17,21 @@ extern "C" {
 typedef pthread_t thread_t;
 typedef pthread_mutex_t mutex_t;
 typedef pthread_cond_t cond_t;
+typedef pthread_once_t thread_once_t;
+#define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #else /* #if defined(__linux__) */
 typedef struct thread_struct *thread_t;
 typedef struct mutex_struct *mutex_t;
 typedef struct cond_struct *cond_t;
+typedef int thread_once_t;
+#define THREAD_ONCE_INIT 0
 #endif /* #if defined(__linux__) */
 
+/*
+ * The most thread_at_exit() hooks a thread can register.
+ */
+#define THREAD_MAX_AT_EXIT 8
+
 int thread_create(thread_t *ts_p, void *(*func)(void *), void *arg);
 int thread_join(thread_t ts, void **ret);
 void thread_detach(thread_t ts);
@@ -30,10 +41,23 @@ int mutex_unlock(mutex_t *m);
 void mutex_destroy(mutex_t *m);
 int cond_init(cond_t *c);
 int cond_wait(cond_t *c, mutex_t *m);
+int cond_timedwait(cond_t *c, mutex_t *m, const struct timespec *abstime);
 int cond_signal(cond_t *c);
 int cond_broadcast(cond_t *c);
 void cond_destroy(cond_t *c);
 
+/*
+ * thread_once() calls @func once for all the callers sharing @once,
+ * which starts as THREAD_ONCE_INIT. It is the way to initialize a
+ * static mutex_t.
+ *
+ * thread_at_exit() makes the calling thread call @func(@arg) when it
+ * exits, the last registered first. Returns -ENOMEM once the thread
+ * has THREAD_MAX_AT_EXIT of them.
+ */
+int thread_once(thread_once_t *once, void (*func)(void));
+int thread_at_exit(void (*func)(void *), void *arg);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2023  Ammar Faizi <ammarfaizi2@gnuweeb.org>
+ */
+
+#ifndef GNUWEEB__TIMER_H
+#define GNUWEEB__TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A timer is embedded in the object that owns it. Once it expires,
+ * @func is called from the timer thread of the base it was added to,
+ * without any lock held. All times are CLOCK_MONOTONIC nanoseconds.
+ *
+ * next, pprev and slot link the timer into the wheel of its base, a
+ * NULL pprev means it is not pending.
+ */
+struct gw_timer {
+	uint64_t	expires;
+	void		(*func)(struct gw_timer *t);
+	struct gw_timer	*next;
+	struct gw_timer	**pprev;
+	uint32_t	slot;
+};
+
+struct gw_timer_base;
+
+int gw_timer_base_init(struct gw_timer_base **base_p);
+void gw_timer_base_stop(struct gw_timer_base *base);
+void gw_timer_base_destroy(struct gw_timer_base *base,
+			   void (*drop)(struct gw_timer *t));
+int gw_timer_add(struct gw_timer_base *base, struct gw_timer *t,
+		 uint64_t expires);
+bool gw_timer_del(struct gw_timer_base *base, struct gw_timer *t);
+
+static inline void gw_timer_init(struct gw_timer *t,
+				 void (*func)(struct gw_timer *t))
+{
+	t->expires = 0;
+	t->func = func;
+	t->next = NULL;
+	t->pprev = NULL;
+	t->slot = 0;
+}
+
+static inline uint64_t gw_timespec_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ull + (uint64_t)ts->tv_nsec;
+}
+
+static inline void gw_ns_to_timespec(struct timespec *ts, uint64_t ns)
+{
+	ts->tv_sec = (time_t)(ns / 1000000000ull);
+	ts->tv_nsec = (long)(ns % 1000000000ull);
+}
+
+static inline uint64_t gw_time_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return gw_timespec_to_ns(&ts);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif /* #ifndef GNUWEEB__TIMER_H */
@@ -6,6 +6,9 @@
 #ifndef GNUWEEB__WORKQUEUE_H
 #define GNUWEEB__WORKQUEUE_H
 
+#include <gw/timer.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -14,35 +17,252 @@ extern "C" {
 
 enum {
 	WQ_F_LAZY_THREAD_CREATION = (1ul << 0),
+
+	/*
+	 * Give every worker its own deque. Works queued by a worker
+	 * (with WQ_PRIO_NORMAL) go to its deque without taking the
+	 * work list lock, works queued from other threads go through
+	 * the lanes as usual. Idle workers steal from the others.
+	 */
+	WQ_F_WORK_STEALING = (1ul << 1),
+
+	/*
+	 * Keep the workers on the CPUs in attr.cpus.
+	 */
+	WQ_F_CPU_AFFINITY = (1ul << 2),
+
+	/*
+	 * Keep the workers on the CPUs of attr.numa_node (also limited
+	 * to attr.cpus with WQ_F_CPU_AFFINITY). If the node has no CPU,
+	 * the workers are not pinned.
+	 */
+	WQ_F_NUMA_NODE = (1ul << 3),
 };
 
 enum {
 	WQ_NAME_MAX_LEN = 32,
+	WQ_MAX_CPUS = 1024,
+
+	/*
+	 * Payloads of up to WQ_INLINE_SIZE bytes are copied into the
+	 * work itself, see queue_work_inline_prio().
+	 */
+	WQ_INLINE_SIZE = 64,
+};
+
+/*
+ * Workers drain the lanes in strict priority order (WQ_PRIO_HIGH
+ * first), with aging so that the lower lanes still make progress.
+ * queue_work() and queue_work_batch() use WQ_PRIO_NORMAL.
+ */
+enum {
+	WQ_PRIO_HIGH	= 0,
+	WQ_PRIO_NORMAL	= 1,
+	WQ_PRIO_LOW	= 2,
+	WQ_NR_PRIO	= 3,
 };
 
 #define WQ_F_ALL (			\
-	WQ_F_LAZY_THREAD_CREATION	\
+	WQ_F_LAZY_THREAD_CREATION |	\
+	WQ_F_WORK_STEALING |		\
+	WQ_F_CPU_AFFINITY |		\
+	WQ_F_NUMA_NODE			\
 )
 
 struct workqueue_struct;
 
+struct wq_cpumask {
+	uint64_t	bits[WQ_MAX_CPUS / 64];
+};
+
+static inline void wq_cpumask_set(struct wq_cpumask *mask, uint32_t cpu)
+{
+	if (cpu < WQ_MAX_CPUS)
+		mask->bits[cpu / 64] |= 1ull << (cpu % 64);
+}
+
+static inline bool wq_cpumask_test(const struct wq_cpumask *mask, uint32_t cpu)
+{
+	return cpu < WQ_MAX_CPUS && (mask->bits[cpu / 64] >> (cpu % 64)) & 1;
+}
+
+/*
+ * idle_timeout_ms: a worker above min_threads that has been idle this
+ * long exits. 0 keeps the workers until destroy_workqueue().
+ *
+ * spawn_delay_us: when no worker is idle, only spawn a new one once the
+ * oldest pending work has waited this long, and at most once per delay.
+ * 0 spawns a worker for every work that finds no idle worker.
+ */
 struct workqueue_attr {
 	char		name[WQ_NAME_MAX_LEN];
 	uint32_t	flags;
 	uint32_t	max_threads;
 	uint32_t	min_threads;
 	uint32_t	max_pending_works;
+	uint32_t	idle_timeout_ms;
+	uint32_t	spawn_delay_us;
+	uint32_t	numa_node;
+	struct wq_cpumask	cpus;
+};
+
+/*
+ * A work queued after a delay, or every period, embedded in the object
+ * that owns it. The pointer is the handle to cancel it with.
+ *
+ * @deleter is called with @arg once the work is done for good: after
+ * its run for a delayed work, or once it is cancelled (or the workqueue
+ * destroyed) and no run is in flight. The delayed_work must not be
+ * touched after that. A periodic run is skipped if the previous one
+ * has not finished yet, or if the workqueue is full. A delayed run
+ * that finds it full is retried shortly after.
+ *
+ * The other fields are protected by the delayed_lock of the workqueue.
+ */
+struct delayed_work {
+	struct gw_timer		timer;
+	struct workqueue_struct	*wq;
+	void			(*func)(void *);
+	void			*arg;
+	void			(*deleter)(void *);
+	uint64_t		period_ns;
+	uint32_t		refs;
+	bool			cancelled;
+};
+
+/*
+ * Tells when a work queued with queue_work_completion*() is done, see
+ * flush_work(). Owned by the caller, who may free it once it is done.
+ * state is only accessed atomically.
+ */
+struct work_completion {
+	uint32_t		state;
+};
+
+struct workqueue_lane_stats {
+	uint32_t	depth;
+	uint32_t	max_depth;
+	uint64_t	nr_queued;
+	uint64_t	nr_aged;
+};
+
+/*
+ * Latency histograms are log-linear, like HDR histograms: each power
+ * of two range of nanoseconds is split into 2^WQ_HIST_SUB_BITS
+ * buckets, so a bucket is within 25% of the values it counts. Buckets
+ * below 2^WQ_HIST_SUB_BITS count a single value, and the last one
+ * also counts everything above it (about 7.5s and up).
+ * workqueue_hist_bucket_min() is the lowest value of a bucket.
+ */
+enum {
+	WQ_HIST_SUB_BITS = 2,
+	WQ_HIST_NR_BUCKETS = 128,
+};
+
+/*
+ * wait_ns is the time from queueing a work to a worker starting it,
+ * and run_ns the time it ran, deleter included. nr_done over two
+ * snapshots taken now_ns apart gives the throughput.
+ *
+ * nr_queue_waits counts the times a queue_work*() caller had to wait
+ * for room (or for wait_all_work_done()), nr_queue_full the
+ * try_queue_work*() calls that found no room. nr_spawns counts
+ * the times new workers were started, nr_threads_spawned how many
+ * they were in total.
+ */
+struct workqueue_stats {
+	uint64_t	now_ns;
+	uint64_t	nr_done;
+	uint64_t	nr_queue_waits;
+	uint64_t	nr_queue_full;
+	uint64_t	nr_spawns;
+	uint64_t	nr_threads_spawned;
+	uint64_t	nr_threads_exited;
+	uint64_t	wait_ns[WQ_HIST_NR_BUCKETS];
+	uint64_t	run_ns[WQ_HIST_NR_BUCKETS];
 };
 
 int alloc_workqueue(struct workqueue_struct **wq_p,
 		    const struct workqueue_attr *attr);
 int queue_work(struct workqueue_struct *wq, void (*func)(void *), void *arg,
 	       void (*deleter)(void *));
+int queue_work_prio(struct workqueue_struct *wq, uint32_t prio,
+		    void (*func)(void *), void *arg, void (*deleter)(void *));
+int queue_work_inline(struct workqueue_struct *wq, void (*func)(void *),
+		      const void *data, size_t size);
+int queue_work_inline_prio(struct workqueue_struct *wq, uint32_t prio,
+			   void (*func)(void *), const void *data, size_t size,
+			   void (*deleter)(void *));
+void init_work_completion(struct work_completion *c);
+int queue_work_completion(struct workqueue_struct *wq,
+			  struct work_completion *c, void (*func)(void *),
+			  void *arg, void (*deleter)(void *));
+int queue_work_completion_prio(struct workqueue_struct *wq, uint32_t prio,
+			       struct work_completion *c, void (*func)(void *),
+			       void *arg, void (*deleter)(void *));
+bool work_completion_done(struct work_completion *c);
+bool flush_work(struct work_completion *c);
 int try_queue_work(struct workqueue_struct *wq, void (*func)(void *), void *arg,
 		   void (*deleter)(void *));
+int queue_work_batch(struct workqueue_struct *wq, void (*func)(void *),
+		     void **args, uint32_t nr, void (*deleter)(void *));
+int queue_work_batch_prio(struct workqueue_struct *wq, uint32_t prio,
+			  void (*func)(void *), void **args, uint32_t nr,
+			  void (*deleter)(void *));
+int try_queue_work_batch_prio(struct workqueue_struct *wq, uint32_t prio,
+			      void (*func)(void *), void **args, uint32_t nr,
+			      void (*deleter)(void *));
+/*
+ * Works queued with the same key run one at a time, in the order they
+ * were queued. Works with different keys still run in parallel. A key
+ * runs at the highest priority of the works waiting on it. A keyed work
+ * counts against the max_pending_works of the lane of its priority
+ * until it runs.
+ */
+int queue_work_keyed(struct workqueue_struct *wq, uint64_t key,
+		     void (*func)(void *), void *arg, void (*deleter)(void *));
+int queue_work_keyed_prio(struct workqueue_struct *wq, uint32_t prio,
+			  uint64_t key, void (*func)(void *), void *arg,
+			  void (*deleter)(void *));
+int try_queue_work_keyed_prio(struct workqueue_struct *wq, uint32_t prio,
+			      uint64_t key, void (*func)(void *), void *arg,
+			      void (*deleter)(void *));
+int workqueue_get_lane_stats(struct workqueue_struct *wq, uint32_t prio,
+			     struct workqueue_lane_stats *st);
+void workqueue_get_stats(struct workqueue_struct *wq,
+			 struct workqueue_stats *st);
+uint64_t workqueue_hist_bucket_min(uint32_t bucket);
+uint64_t workqueue_hist_percentile(const uint64_t *hist, double pct);
+void init_delayed_work(struct delayed_work *dw, void (*func)(void *),
+		       void *arg, void (*deleter)(void *));
+int queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dw,
+		       uint64_t delay_ns);
+int queue_periodic_work(struct workqueue_struct *wq, struct delayed_work *dw,
+			uint64_t period_ns);
+bool cancel_delayed_work(struct delayed_work *dw);
 void destroy_workqueue(struct workqueue_struct *wq);
+
+/*
+ * The NUMA topology, from sysfs. Without NUMA, there is a single node
+ * 0. workqueue_get_nodes() stores the ids of the online nodes in
+ * @nodes, up to @max of them in increasing order, and returns how many
+ * are online. The ids may have holes. workqueue_nr_nodes() is that
+ * number, workqueue_current_node() the node the caller is running on.
+ */
+uint32_t workqueue_get_nodes(uint32_t *nodes, uint32_t max);
+uint32_t workqueue_nr_nodes(void);
+uint32_t workqueue_current_node(void);
 void wait_all_work_done(struct workqueue_struct *wq);
 
+/*
+ * Wait for the works queued before the call to be done, without
+ * blocking the queuers like wait_all_work_done() does. Keyed works
+ * count one by one, so a key that keeps getting new works doesn't
+ * hold the flush up. Delayed works count once their timer has fired.
+ * Returns -EDEADLK when called from a worker of @wq.
+ */
+int flush_workqueue(struct workqueue_struct *wq);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -18,6 +18,29 @@ struct curl_handle_list {
 
 static struct curl_handle_list *g_gw_curl_data;
 static __thread CURL *current_thread_curl_handle;
+static __thread const _Atomic(bool) *current_cancel_flag;
+
+/*
+ * Abort the transfer running on this thread once @flag becomes true.
+ * curl_easy_perform() then fails with CURLE_ABORTED_BY_CALLBACK.
+ */
+void gw_curl_set_cancel_flag(const _Atomic(bool) *flag)
+{
+	current_cancel_flag = flag;
+}
+
+static int gw_curl_xferinfo(void *arg, curl_off_t dltotal, curl_off_t dlnow,
+			    curl_off_t ultotal, curl_off_t ulnow)
+{
+	const _Atomic(bool) *flag = current_cancel_flag;
+
+	(void)arg;
+	(void)dltotal;
+	(void)dlnow;
+	(void)ultotal;
+	(void)ulnow;
+	return flag && atomic_load_explicit(flag, memory_order_relaxed);
+}
 
 int gw_curl_global_init(long flags)
 {
@@ -100,6 +123,9 @@ void *gw_curl_thread_init(void)
 	if (!ret)
 		return NULL;
 
+	curl_easy_setopt(ret, CURLOPT_XFERINFOFUNCTION, gw_curl_xferinfo);
+	curl_easy_setopt(ret, CURLOPT_NOPROGRESS, 0L);
+
 	mutex_lock(&cd->mutex);
 	if (cd->nr_handles >= cd->allocated) {
 		if (gw_curl_realloc_handles(cd)) {
@@ -110,5 +136,6 @@ void *gw_curl_thread_init(void)
 	}
 	cd->handles[cd->nr_handles++] = ret;
 	mutex_unlock(&cd->mutex);
+	current_thread_curl_handle = ret;
 	return ret;
 }
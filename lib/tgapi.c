@@ -613,6 +613,9 @@ static int curl_http_get(const char *url, struct curl_data *data)
 	curl_easy_setopt(ch, CURLOPT_WRITEDATA, data);
 
 	res = curl_easy_perform(ch);
+	if (res == CURLE_ABORTED_BY_CALLBACK)
+		return -ECANCELED;
+
 	if (res != CURLE_OK) {
 		fprintf(stderr, "curl_easy_perform() to URL %s failed: %s\n",
 			url, curl_easy_strerror(res));
@@ -622,6 +625,11 @@ static int curl_http_get(const char *url, struct curl_data *data)
 	return 0;
 }
 
+static const char *api_url(struct tg_api_ctx *ctx)
+{
+	return ctx->api_url ? ctx->api_url : "https://api.telegram.org";
+}
+
 int tgapi_call_get_updates(struct tg_api_ctx *ctx,
 			   struct tg_updates **updates_p, int64_t offset)
 {
@@ -630,8 +638,8 @@ int tgapi_call_get_updates(struct tg_api_ctx *ctx,
 	int ret;
 
 	snprintf(url, sizeof(url),
-		 "https://api.telegram.org/bot%s/getUpdates?offset=%" PRId64,
-		 ctx->token, offset);
+		 "%s/bot%s/getUpdates?offset=%" PRId64,
+		 api_url(ctx), ctx->token, offset);
 
 	ret = curl_http_get(url, &data);
 	if (unlikely(ret))
@@ -660,9 +668,9 @@ int tgapi_call_send_message(struct tg_api_ctx *ctx,
 		return -ENOMEM;
 
 	snprintf(url, sizeof(url),
-		 "https://api.telegram.org/bot%s/sendMessage?chat_id=%" PRId64
+		 "%s/bot%s/sendMessage?chat_id=%" PRId64
 		 "&text=%s&reply_to_message_id=%" PRId64,
-		 ctx->token, call->chat_id, escape_text,
+		 api_url(ctx), ctx->token, call->chat_id, escape_text,
 		 call->reply_to_message_id);
 
 	curl_free(escape_text);
@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#undef NDEBUG
+#include <gw/common.h>
+#include <gw/pool.h>
+#include <gw/thread.h>
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * Test that freed objects are reused and that the pool falls back to
+ * malloc() once the slab is exhausted.
+ */
+static void test_pool_alloc_free(void)
+{
+	struct gw_pool_stats st;
+	struct gw_pool *pool;
+	void *objs[80];
+	int ret;
+	int it;
+	int i;
+
+	ret = gw_pool_init(&pool, 100, 64);
+	assert(ret == 0);
+
+	for (it = 0; it < 3; it++) {
+		for (i = 0; i < 64; i++) {
+			objs[i] = gw_pool_alloc(pool);
+			assert(objs[i]);
+			memset(objs[i], 0xaa, 100);
+		}
+
+		for (i = 0; i < 64; i++)
+			gw_pool_free(pool, objs[i]);
+	}
+
+	gw_pool_get_stats(pool, &st);
+	assert(st.nr_objs == 64);
+	assert(st.nr_alloc == 64 * 3);
+	assert(st.nr_free == 64 * 3);
+	assert(st.nr_fallback == 0);
+
+	for (i = 0; i < 80; i++) {
+		objs[i] = gw_pool_alloc(pool);
+		assert(objs[i]);
+		memset(objs[i], 0xaa, 100);
+	}
+
+	gw_pool_get_stats(pool, &st);
+	assert(st.nr_fallback == 16);
+
+	for (i = 0; i < 80; i++)
+		gw_pool_free(pool, objs[i]);
+
+	gw_pool_get_stats(pool, &st);
+	assert(st.nr_alloc == st.nr_free);
+	gw_pool_destroy(pool);
+}
+
+struct xfer {
+	struct gw_pool	*pool;
+	void		**objs;
+	uint32_t	nr;
+};
+
+static void *free_objs(void *arg)
+{
+	struct xfer *x = arg;
+	uint32_t i;
+
+	for (i = 0; i < x->nr; i++)
+		gw_pool_free(x->pool, x->objs[i]);
+
+	return NULL;
+}
+
+/*
+ * Test the producer/consumer pattern of the ring: one thread allocates,
+ * other threads free. The objects must come back to the allocating
+ * thread through the shared stack instead of malloc().
+ */
+static void test_pool_cross_thread(void)
+{
+	enum { NR_THREADS = 4, NR_OBJS = 256, NR_ROUNDS = 50 };
+	static void *objs[NR_THREADS][NR_OBJS];
+	struct xfer x[NR_THREADS];
+	thread_t threads[NR_THREADS];
+	struct gw_pool_stats st;
+	struct gw_pool *pool;
+	int ret;
+	int r;
+	int t;
+	int i;
+
+	ret = gw_pool_init(&pool, 64, NR_THREADS * NR_OBJS * 2);
+	assert(ret == 0);
+
+	for (r = 0; r < NR_ROUNDS; r++) {
+		for (t = 0; t < NR_THREADS; t++) {
+			for (i = 0; i < NR_OBJS; i++) {
+				objs[t][i] = gw_pool_alloc(pool);
+				assert(objs[t][i]);
+				*(uint64_t *)objs[t][i] = (uint64_t)r;
+			}
+
+			x[t].pool = pool;
+			x[t].objs = objs[t];
+			x[t].nr = NR_OBJS;
+			ret = thread_create(&threads[t], free_objs, &x[t]);
+			assert(ret == 0);
+		}
+
+		for (t = 0; t < NR_THREADS; t++)
+			thread_join(threads[t], NULL);
+	}
+
+	gw_pool_get_stats(pool, &st);
+	assert(st.nr_fallback == 0);
+	assert(st.nr_refill > 0);
+	gw_pool_destroy(pool);
+}
+
+/*
+ * Test that a thread using more pools than it has cache slots gives
+ * the caches it evicts back instead of stranding their objects. The
+ * first allocation from a pool takes its whole shared stack into the
+ * cache.
+ */
+static void test_pool_many(void)
+{
+	enum { NR_POOLS = 11, NR_OBJS = 16 };
+	struct gw_pool *pools[NR_POOLS];
+	void *objs[NR_OBJS];
+	struct gw_pool_stats st;
+	int ret;
+	int p;
+	int i;
+
+	for (p = 0; p < NR_POOLS; p++) {
+		ret = gw_pool_init(&pools[p], 32, NR_OBJS);
+		assert(ret == 0);
+		objs[0] = gw_pool_alloc(pools[p]);
+		assert(objs[0]);
+		gw_pool_free(pools[p], objs[0]);
+	}
+
+	for (p = 0; p < NR_POOLS; p++) {
+		for (i = 0; i < NR_OBJS; i++) {
+			objs[i] = gw_pool_alloc(pools[p]);
+			assert(objs[i]);
+		}
+
+		gw_pool_get_stats(pools[p], &st);
+		assert(st.nr_fallback == 0);
+
+		for (i = 0; i < NR_OBJS; i++)
+			gw_pool_free(pools[p], objs[i]);
+		gw_pool_destroy(pools[p]);
+	}
+}
+
+static void *alloc_one(void *arg)
+{
+	struct gw_pool *pool = arg;
+	void *obj;
+
+	obj = gw_pool_alloc(pool);
+	assert(obj);
+	gw_pool_free(pool, obj);
+	return NULL;
+}
+
+/*
+ * Test that a thread gives its cache back when it exits. The thread's
+ * first allocation takes the whole shared stack into its cache.
+ */
+static void test_pool_thread_exit(void)
+{
+	enum { NR_OBJS = 16 };
+	struct gw_pool_stats st;
+	struct gw_pool *pool;
+	void *objs[NR_OBJS];
+	thread_t thread;
+	int ret;
+	int i;
+
+	ret = gw_pool_init(&pool, 32, NR_OBJS);
+	assert(ret == 0);
+
+	ret = thread_create(&thread, alloc_one, pool);
+	assert(ret == 0);
+	thread_join(thread, NULL);
+
+	for (i = 0; i < NR_OBJS; i++) {
+		objs[i] = gw_pool_alloc(pool);
+		assert(objs[i]);
+	}
+
+	gw_pool_get_stats(pool, &st);
+	assert(st.nr_fallback == 0);
+
+	for (i = 0; i < NR_OBJS; i++)
+		gw_pool_free(pool, objs[i]);
+	gw_pool_destroy(pool);
+}
+
+int main(void)
+{
+	test_pool_alloc_free();
+	test_pool_cross_thread();
+	test_pool_many();
+	test_pool_thread_exit();
+	return 0;
+}
@@ -1,8 +1,21 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #undef NDEBUG
+#include <gw/common.h>
 #include <gw/ring.h>
+#include <gw/lib/tgapi.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include <assert.h>
+#include <sched.h>
+#include <unistd.h>
+#include <string.h>
 #include <stdio.h>
 
 static void test_nop(void)
@@ -86,9 +99,1394 @@ static void test_nop_full_cqe(void)
 	gw_ring_destroy(&ring);
 }
 
+/*
+ * Test batched SQE reservation and a batched punt to the io workqueue.
+ */
+static void test_get_sqes_async_nop(void)
+{
+	struct gw_ring_sqe *sqes[16];
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint32_t head;
+	uint32_t nr;
+	int ret;
+	int i;
+	int j;
+
+	ret = gw_ring_init(&ring, 10);
+	assert(ret == 0);
+
+	nr = gw_ring_get_sqes(&ring, 10, sqes);
+	assert(nr == 10);
+	nr = gw_ring_get_sqes(&ring, 10, &sqes[10]);
+	assert(nr == 6);
+	nr = gw_ring_get_sqes(&ring, 10, sqes);
+	assert(nr == 0);
+
+	for (i = 0; i < 16; i++) {
+		sqes[i]->op = GW_RING_OP_NOP;
+		sqes[i]->flags = GW_RING_SQE_F_ASYNC;
+		sqes[i]->user_data = (uint64_t)i;
+	}
+	ret = gw_ring_submit(&ring);
+	assert(ret == 16);
+
+	j = 0;
+	while (j < 16) {
+		ret = gw_ring_wait_cqe(&ring, &cqe);
+		assert(ret > 0);
+		i = 0;
+		gw_ring_for_each_cqe(&ring, head, cqe) {
+			assert(cqe->res == 0);
+			assert(cqe->user_data < 16);
+			i++;
+		}
+		gw_ring_cq_advance(&ring, i);
+		j += i;
+	}
+	assert(j == 16);
+	gw_ring_destroy(&ring);
+}
+
+static int reap_all_cqes(struct gw_ring *ring)
+{
+	struct gw_ring_cqe *cqe;
+	uint32_t head;
+	int i = 0;
+
+	gw_ring_for_each_cqe(ring, head, cqe) {
+		assert(cqe->res == 0);
+		i++;
+	}
+	gw_ring_cq_advance(ring, (uint32_t)i);
+	return i;
+}
+
+static void submit_nops(struct gw_ring *ring, int nr, uint8_t flags)
+{
+	struct gw_ring_sqe *sqe;
+	int ret;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		sqe = gw_ring_get_sqe(ring);
+		assert(sqe);
+		sqe->op = GW_RING_OP_NOP;
+		sqe->flags = flags;
+		sqe->user_data = (uint64_t)i;
+	}
+	ret = gw_ring_submit(ring);
+	assert(ret == nr);
+}
+
+/*
+ * Test that every CQE signals the eventfd without coalescing, and that
+ * only the empty to non-empty transition does with coalescing.
+ */
+static void test_eventfd(void)
+{
+	struct gw_ring ring;
+	eventfd_t val;
+	int ret;
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	assert(fd >= 0);
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	ret = gw_ring_register_eventfd(&ring, fd, 0);
+	assert(ret == 0);
+	ret = gw_ring_register_eventfd(&ring, fd, 0);
+	assert(ret == -EBUSY);
+	submit_nops(&ring, 4, 0);
+	assert(eventfd_read(fd, &val) == 0);
+	assert(val == 4);
+	assert(reap_all_cqes(&ring) == 4);
+	assert(!gw_ring_cq_ready(&ring));
+	ret = gw_ring_unregister_eventfd(&ring);
+	assert(ret == 0);
+
+	ret = gw_ring_register_eventfd(&ring, fd, GW_RING_EVFD_F_COALESCE);
+	assert(ret == 0);
+	submit_nops(&ring, 4, 0);
+	assert(eventfd_read(fd, &val) == 0);
+	assert(val == 1);
+	submit_nops(&ring, 4, 0);
+	assert(eventfd_read(fd, &val) < 0);
+	assert(reap_all_cqes(&ring) == 8);
+	submit_nops(&ring, 4, 0);
+	assert(eventfd_read(fd, &val) == 0);
+	assert(val == 1);
+	assert(reap_all_cqes(&ring) == 4);
+
+	gw_ring_destroy(&ring);
+	close(fd);
+}
+
+/*
+ * Test waiting for async completions with epoll on a coalescing
+ * eventfd.
+ */
+static void test_eventfd_epoll(void)
+{
+	struct epoll_event ev;
+	struct gw_ring ring;
+	eventfd_t val;
+	int epfd;
+	int ret;
+	int fd;
+	int i;
+
+	fd = eventfd(0, EFD_NONBLOCK);
+	assert(fd >= 0);
+	epfd = epoll_create1(0);
+	assert(epfd >= 0);
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	assert(ret == 0);
+
+	ret = gw_ring_init(&ring, 64);
+	assert(ret == 0);
+	ret = gw_ring_register_eventfd(&ring, fd, GW_RING_EVFD_F_COALESCE);
+	assert(ret == 0);
+	submit_nops(&ring, 64, GW_RING_SQE_F_ASYNC);
+
+	i = 0;
+	while (i < 64) {
+		ret = epoll_wait(epfd, &ev, 1, 5000);
+		assert(ret == 1);
+		eventfd_read(fd, &val);
+		do {
+			i += reap_all_cqes(&ring);
+		} while (gw_ring_cq_ready(&ring));
+	}
+	assert(i == 64);
+
+	gw_ring_destroy(&ring);
+	close(epfd);
+	close(fd);
+}
+
+static uint64_t now_ms(void)
+{
+	return gw_time_now_ns() / 1000000ull;
+}
+
+/*
+ * Test that relative and absolute timeouts complete with -ETIME in
+ * expiry order, and that they are served by a single timer thread.
+ */
+static void test_timeout(void)
+{
+	static const uint64_t delays_ms[] = { 60, 20, 40 };
+	static const uint64_t expected[] = { 20, 30, 40, 60 };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct timespec ts;
+	struct gw_ring ring;
+	uint64_t start;
+	uint32_t i;
+	int ret;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	start = now_ms();
+	for (i = 0; i < 3; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		assert(sqe);
+		ts.tv_sec = 0;
+		ts.tv_nsec = (long)(delays_ms[i] * 1000000ull);
+		gw_ring_prep_timeout(sqe, &ts, 0);
+		sqe->user_data = delays_ms[i];
+	}
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	gw_ns_to_timespec(&ts, gw_time_now_ns() + 30000000ull);
+	gw_ring_prep_timeout(sqe, &ts, GW_RING_TIMEOUT_F_ABS);
+	sqe->user_data = 30;
+
+	ret = gw_ring_submit(&ring);
+	assert(ret == 4);
+
+	for (i = 0; i < 4; i++) {
+		ret = gw_ring_wait_cqe(&ring, &cqe);
+		assert(ret > 0);
+		assert(cqe->op == GW_RING_OP_TIMEOUT);
+		assert(cqe->res == -ETIME);
+		assert(cqe->user_data == expected[i]);
+		assert(now_ms() - start >= cqe->user_data);
+		gw_ring_cq_advance(&ring, 1);
+	}
+
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that gw_ring_wait_cqe_timeout() gives up with -ETIME on an
+ * empty CQ, and returns early when a CQE arrives.
+ */
+static void test_wait_cqe_timeout(void)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 20000000 };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint64_t start;
+	int ret;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	start = now_ms();
+	ret = gw_ring_wait_cqe_timeout(&ring, &cqe, &ts);
+	assert(ret == -ETIME);
+	assert(now_ms() - start >= 20);
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	sqe->op = GW_RING_OP_NOP;
+	sqe->flags = GW_RING_SQE_F_ASYNC;
+	sqe->user_data = 1;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 1);
+
+	ts.tv_sec = 5;
+	ret = gw_ring_wait_cqe_timeout(&ring, &cqe, &ts);
+	assert(ret == 1);
+	assert(cqe->user_data == 1);
+	gw_ring_cq_advance(&ring, 1);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that pending timeouts are released when the ring is destroyed.
+ */
+static void test_timeout_destroy_pending(void)
+{
+	struct timespec ts = { .tv_sec = 60 };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring ring;
+	int ret;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	gw_ring_prep_timeout(sqe, &ts, 0);
+	ret = gw_ring_submit(&ring);
+	assert(ret == 1);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that a link chain runs strictly in order, across both inline
+ * and punted ops, and that a timeout expiring doesn't break it.
+ */
+static void test_link_chain(void)
+{
+	struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint64_t start;
+	uint64_t i;
+	int ret;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	sqe->op = GW_RING_OP_NOP;
+	sqe->flags = GW_RING_SQE_F_ASYNC | GW_RING_SQE_F_LINK;
+	sqe->user_data = 0;
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	gw_ring_prep_timeout(sqe, &ts, 0);
+	sqe->flags = GW_RING_SQE_F_LINK;
+	sqe->user_data = 1;
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	sqe->op = GW_RING_OP_NOP;
+	sqe->flags = GW_RING_SQE_F_LINK;
+	sqe->user_data = 2;
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	sqe->op = GW_RING_OP_NOP;
+	sqe->flags = GW_RING_SQE_F_ASYNC;
+	sqe->user_data = 3;
+
+	start = now_ms();
+	ret = gw_ring_submit(&ring);
+	assert(ret == 4);
+
+	for (i = 0; i < 4; i++) {
+		ret = gw_ring_wait_cqe(&ring, &cqe);
+		assert(ret > 0);
+		assert(cqe->user_data == i);
+		if (i == 1)
+			assert(cqe->res == -ETIME);
+		else
+			assert(cqe->res == 0);
+		if (i > 1)
+			assert(now_ms() - start >= 10);
+		gw_ring_cq_advance(&ring, 1);
+	}
+
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that a failing SQE cancels the rest of its chain with
+ * -ECANCELED, and that the chain doesn't affect the SQEs after it.
+ */
+static void test_link_chain_cancel(void)
+{
+	static const int64_t expected[] = { -EOPNOTSUPP, -ECANCELED,
+					    -ECANCELED };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint32_t head;
+	uint32_t nr;
+	uint64_t i;
+	int nr_indep;
+	int ret;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	memset(&sqe->tg_api_call, 0, sizeof(sqe->tg_api_call));
+	sqe->op = GW_RING_OP_TG_API_CALL;
+	sqe->tg_api_call.op = 0xff;
+	sqe->flags = GW_RING_SQE_F_LINK;
+	sqe->user_data = 0;
+
+	for (i = 1; i < 3; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		assert(sqe);
+		sqe->op = GW_RING_OP_NOP;
+		sqe->flags = (i == 1) ? GW_RING_SQE_F_LINK : 0;
+		sqe->user_data = i;
+	}
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	sqe->op = GW_RING_OP_NOP;
+	sqe->user_data = 100;
+
+	ret = gw_ring_submit(&ring);
+	assert(ret == 4);
+
+	i = 0;
+	nr_indep = 0;
+	while (i < 3 || !nr_indep) {
+		ret = gw_ring_wait_cqe(&ring, &cqe);
+		assert(ret > 0);
+		nr = 0;
+		gw_ring_for_each_cqe(&ring, head, cqe) {
+			nr++;
+			if (cqe->user_data == 100) {
+				assert(cqe->res == 0);
+				nr_indep++;
+				continue;
+			}
+			assert(cqe->user_data == i);
+			assert(cqe->res == expected[i]);
+			i++;
+		}
+		gw_ring_cq_advance(&ring, nr);
+	}
+	assert(nr_indep == 1);
+
+	gw_ring_destroy(&ring);
+}
+
+static void submit_ordered_nops(struct gw_ring *ring, int nr, uint64_t *seq)
+{
+	struct gw_ring_sqe *sqe;
+	int ret;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		sqe = gw_ring_get_sqe(ring);
+		assert(sqe);
+		sqe->op = GW_RING_OP_NOP;
+		sqe->user_data = (*seq)++;
+	}
+
+	ret = gw_ring_submit(ring);
+	assert(ret == nr);
+}
+
+/*
+ * Test that CQEs that don't fit in the CQ are kept in order in the
+ * overflow list and show up as the CQ is advanced, and that the list
+ * is bounded.
+ */
+static void test_cq_overflow(void)
+{
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint64_t expected;
+	uint64_t seq = 0;
+	uint32_t head;
+	uint32_t nr;
+	int ret;
+	int i;
+
+	ret = gw_ring_init(&ring, 4);
+	assert(ret == 0);
+
+	/* 8 CQ slots, 12 CQEs. */
+	for (i = 0; i < 3; i++)
+		submit_ordered_nops(&ring, 4, &seq);
+
+	assert(gw_ring_cq_overflowed(&ring));
+	assert(atomic_load(&ring.cq_overflow) == 4);
+	assert(atomic_load(&ring.cq_dropped) == 0);
+
+	expected = 0;
+	while (expected < seq) {
+		ret = gw_ring_wait_cqe(&ring, &cqe);
+		assert(ret > 0);
+		nr = 0;
+		gw_ring_for_each_cqe(&ring, head, cqe) {
+			assert(cqe->res == 0);
+			assert(cqe->user_data == expected);
+			expected++;
+			nr++;
+		}
+		gw_ring_cq_advance(&ring, nr);
+	}
+	assert(!gw_ring_cq_overflowed(&ring));
+
+	/* 8 CQ slots and 8 overflow entries, 4 CQEs are dropped. */
+	for (i = 0; i < 5; i++)
+		submit_ordered_nops(&ring, 4, &seq);
+
+	assert(gw_ring_cq_overflowed(&ring));
+	assert(atomic_load(&ring.cq_dropped) == 4);
+
+	nr = 0;
+	while (gw_ring_cq_ready(&ring)) {
+		gw_ring_for_each_cqe(&ring, head, cqe) {
+			assert(cqe->user_data == expected);
+			expected++;
+			nr++;
+			gw_ring_cq_advance(&ring, 1);
+		}
+	}
+	assert(nr == 16);
+	assert(!gw_ring_cq_overflowed(&ring));
+	gw_ring_destroy(&ring);
+}
+
+static struct gw_ring_cqe *wait_one_cqe(struct gw_ring *ring)
+{
+	struct gw_ring_cqe *cqe;
+	int ret;
+
+	ret = gw_ring_wait_cqe(ring, &cqe);
+	assert(ret > 0);
+	return cqe;
+}
+
+/*
+ * Submit until gw_ring_submit() has issued everything in the SQ, the
+ * io workqueue may be full for a while.
+ */
+static int submit_all(struct gw_ring *ring, int nr)
+{
+	int done = 0;
+	int ret;
+
+	while (done < nr) {
+		ret = gw_ring_submit(ring);
+		if (ret == -EBUSY) {
+			sched_yield();
+			continue;
+		}
+		assert(ret >= 0);
+		done += ret;
+	}
+
+	return done;
+}
+
+/*
+ * Test that a pending timeout can be cancelled by user_data, that the
+ * rest of its link chain is cancelled too, and the cancel results.
+ */
+static void test_cancel_timeout(void)
+{
+	struct timespec ts = { .tv_sec = 10 };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint64_t start;
+	int ret;
+	int i;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	start = now_ms();
+	sqe = gw_ring_get_sqe(&ring);
+	gw_ring_prep_timeout(sqe, &ts, 0);
+	sqe->flags = GW_RING_SQE_F_LINK;
+	sqe->user_data = 7;
+	sqe = gw_ring_get_sqe(&ring);
+	sqe->op = GW_RING_OP_NOP;
+	sqe->user_data = 8;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 2);
+
+	sqe = gw_ring_get_sqe(&ring);
+	gw_ring_prep_cancel(sqe, 7, 0);
+	sqe->user_data = 100;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 1);
+
+	for (i = 0; i < 3; i++) {
+		cqe = wait_one_cqe(&ring);
+		switch (cqe->user_data) {
+		case 7:
+			assert(cqe->op == GW_RING_OP_TIMEOUT);
+			assert(cqe->res == -ECANCELED);
+			break;
+		case 8:
+			assert(cqe->res == -ECANCELED);
+			break;
+		case 100:
+			assert(cqe->op == GW_RING_OP_ASYNC_CANCEL);
+			assert(cqe->res == 0);
+			break;
+		default:
+			assert(0);
+		}
+		gw_ring_cq_advance(&ring, 1);
+	}
+	assert(now_ms() - start < 5000);
+
+	sqe = gw_ring_get_sqe(&ring);
+	gw_ring_prep_cancel(sqe, 7, 0);
+	sqe = gw_ring_get_sqe(&ring);
+	gw_ring_prep_cancel(sqe, 7, ~0u);
+	ret = gw_ring_submit(&ring);
+	assert(ret == 2);
+	cqe = wait_one_cqe(&ring);
+	assert(cqe->res == -ENOENT);
+	gw_ring_cq_advance(&ring, 1);
+	cqe = wait_one_cqe(&ring);
+	assert(cqe->res == -EINVAL);
+	gw_ring_cq_advance(&ring, 1);
+
+	/* Cancel several timeouts sharing the same user_data. */
+	for (i = 0; i < 4; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		gw_ring_prep_timeout(sqe, &ts, 0);
+		sqe->user_data = 9;
+	}
+	sqe = gw_ring_get_sqe(&ring);
+	gw_ring_prep_cancel(sqe, 9, GW_RING_CANCEL_F_MATCH_ALL);
+	sqe->user_data = 100;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 5);
+	for (i = 0; i < 5; i++) {
+		cqe = wait_one_cqe(&ring);
+		if (cqe->user_data == 100)
+			assert(cqe->res == 4);
+		else
+			assert(cqe->res == -ECANCELED);
+		gw_ring_cq_advance(&ring, 1);
+	}
+
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Race cancellation against the io workers: every punted NOP must
+ * complete exactly once, either normally or with -ECANCELED.
+ */
+static void test_cancel_async_race(void)
+{
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	int nr_cancelled = 0;
+	int cancel_res = 0;
+	uint32_t head;
+	uint32_t nr;
+	int it;
+	int ret;
+	int i;
+
+	ret = gw_ring_init(&ring, 256);
+	assert(ret == 0);
+
+	for (it = 0; it < 20; it++) {
+		for (i = 0; i < 255; i++) {
+			sqe = gw_ring_get_sqe(&ring);
+			sqe->op = GW_RING_OP_NOP;
+			sqe->flags = GW_RING_SQE_F_ASYNC;
+			sqe->user_data = 5;
+		}
+		/*
+		 * The cancelled NOPs stay in the lanes until a worker
+		 * picks them up, which may fill the io workqueue.
+		 */
+		ret = submit_all(&ring, 255);
+		assert(ret == 255);
+
+		sqe = gw_ring_get_sqe(&ring);
+		gw_ring_prep_cancel(sqe, 5, GW_RING_CANCEL_F_MATCH_ALL);
+		sqe->user_data = 6;
+		ret = gw_ring_submit(&ring);
+		assert(ret == 1);
+
+		i = 0;
+		while (i < 256) {
+			wait_one_cqe(&ring);
+			nr = 0;
+			gw_ring_for_each_cqe(&ring, head, cqe) {
+				nr++;
+				if (cqe->user_data == 6) {
+					assert(cqe->res == -ENOENT || cqe->res > 0);
+					cancel_res = (int)cqe->res;
+					continue;
+				}
+				assert(cqe->user_data == 5);
+				assert(cqe->res == 0 || cqe->res == -ECANCELED);
+				if (cqe->res == -ECANCELED)
+					nr_cancelled++;
+			}
+			gw_ring_cq_advance(&ring, nr);
+			i += (int)nr;
+		}
+		assert(i == 256);
+		(void)cancel_res;
+	}
+
+	printf("cancelled %d of %d punted NOPs\n", nr_cancelled, 20 * 255);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that the SQ thread issues the SQEs, including after it has
+ * parked, and that it reports an invalid SQE with a CQE.
+ */
+static void test_sqpoll(void)
+{
+	static const int64_t sqpoll_link_res[] = { 0, -EINVAL, -ECANCELED };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint32_t head;
+	uint32_t nr;
+	int it;
+	int ret;
+	int i;
+
+	ret = gw_ring_init_flags(&ring, 16, ~0u);
+	assert(ret == -EINVAL);
+
+	ret = gw_ring_init_flags(&ring, 16, GW_RING_SETUP_F_SQPOLL);
+	assert(ret == 0);
+
+	for (it = 0; it < 3; it++) {
+		for (i = 0; i < 8; i++) {
+			sqe = gw_ring_get_sqe(&ring);
+			assert(sqe);
+			sqe->op = GW_RING_OP_NOP;
+			sqe->flags = (i & 1) ? GW_RING_SQE_F_ASYNC : 0;
+			sqe->user_data = (uint64_t)i;
+		}
+		ret = gw_ring_submit(&ring);
+		assert(ret == 8);
+
+		i = 0;
+		while (i < 8) {
+			wait_one_cqe(&ring);
+			nr = 0;
+			gw_ring_for_each_cqe(&ring, head, cqe) {
+				assert(cqe->res == 0);
+				nr++;
+			}
+			gw_ring_cq_advance(&ring, nr);
+			i += (int)nr;
+		}
+
+		/*
+		 * Let the SQ thread park, so the next submit has to
+		 * wake it up.
+		 */
+		for (i = 0; i < 100; i++) {
+			if (atomic_load(&ring.sq_flags) & GW_RING_SQ_F_NEED_WAKEUP)
+				break;
+			usleep(10000);
+		}
+		assert(i < 100);
+	}
+
+	sqe = gw_ring_get_sqe(&ring);
+	sqe->op = 0xff;
+	sqe->user_data = 77;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 1);
+	cqe = wait_one_cqe(&ring);
+	assert(cqe->user_data == 77);
+	assert(cqe->res == -EINVAL);
+	gw_ring_cq_advance(&ring, 1);
+
+	/*
+	 * An SQE of a chain that fails to be issued by the SQ thread
+	 * completes once, with its error, and cancels the rest.
+	 */
+	for (i = 0; i < 3; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		sqe->op = (i == 1) ? 0xff : GW_RING_OP_NOP;
+		sqe->flags = (i < 2) ? GW_RING_SQE_F_LINK : 0;
+		sqe->user_data = (uint64_t)i;
+	}
+	ret = gw_ring_submit(&ring);
+	assert(ret == 3);
+
+	i = 0;
+	while (i < 3) {
+		wait_one_cqe(&ring);
+		nr = 0;
+		gw_ring_for_each_cqe(&ring, head, cqe) {
+			assert(cqe->user_data == (uint64_t)i);
+			assert(cqe->res == sqpoll_link_res[i]);
+			nr++;
+			i++;
+		}
+		gw_ring_cq_advance(&ring, nr);
+	}
+
+	usleep(50000);
+	nr = 0;
+	gw_ring_for_each_cqe(&ring, head, cqe)
+		nr++;
+	assert(nr == 0);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test waiting with spinning enabled: completions from the timer thread
+ * are still picked up, the average wait gets tracked, and a timed wait
+ * still times out.
+ */
+static void test_wait_spin(void)
+{
+	struct timespec short_ts = { .tv_nsec = 20000 };
+	struct timespec ts = { .tv_nsec = 20000000 };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint64_t start;
+	int ret;
+	int i;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+	gw_ring_set_wait_spin(&ring, 200000);
+
+	/*
+	 * A short timeout makes sure that every iteration has to wait,
+	 * which an async NOP doesn't if its worker beats us to it.
+	 */
+	for (i = 0; i < 100; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		gw_ring_prep_timeout(sqe, &short_ts, 0);
+		sqe->user_data = (uint64_t)i;
+		ret = gw_ring_submit(&ring);
+		assert(ret == 1);
+
+		cqe = wait_one_cqe(&ring);
+		assert(cqe->user_data == (uint64_t)i);
+		assert(cqe->res == -ETIME);
+		gw_ring_cq_advance(&ring, 1);
+	}
+	assert(ring.cq_wait_avg_ns > 0);
+
+	start = now_ms();
+	ret = gw_ring_wait_cqe_timeout(&ring, &cqe, &ts);
+	assert(ret == -ETIME);
+	assert(now_ms() - start >= 19);
+
+	gw_ring_set_wait_spin(&ring, 0);
+	ret = gw_ring_wait_cqe_timeout(&ring, &cqe, &ts);
+	assert(ret == -ETIME);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that gw_ring_wait_cqes() waits for the whole batch, and returns
+ * what it has (or -ETIME) when the timeout runs out first.
+ */
+static void test_wait_cqes(void)
+{
+	static const uint64_t delays_ms[] = { 10, 20, 30, 40 };
+	struct timespec wait_ts = { .tv_sec = 5 };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct timespec ts;
+	struct gw_ring ring;
+	uint64_t start;
+	uint32_t i;
+	int ret;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	start = now_ms();
+	for (i = 0; i < 4; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		assert(sqe);
+		ts.tv_sec = 0;
+		ts.tv_nsec = (long)(delays_ms[i] * 1000000ull);
+		gw_ring_prep_timeout(sqe, &ts, 0);
+		sqe->user_data = delays_ms[i];
+	}
+	ret = gw_ring_submit(&ring);
+	assert(ret == 4);
+
+	ret = gw_ring_wait_cqes(&ring, &cqe, 4, &wait_ts);
+	assert(ret == 4);
+	assert(now_ms() - start >= 40);
+	assert(cqe->user_data == 10);
+	gw_ring_cq_advance(&ring, 4);
+
+	start = now_ms();
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	gw_ring_prep_timeout(sqe, &ts, 0);
+	sqe->user_data = 10;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 1);
+
+	wait_ts.tv_sec = 0;
+	wait_ts.tv_nsec = 50000000;
+	ret = gw_ring_wait_cqes(&ring, &cqe, 2, &wait_ts);
+	assert(ret == 1);
+	assert(now_ms() - start >= 49);
+	assert(cqe->user_data == 10);
+	gw_ring_cq_advance(&ring, 1);
+
+	wait_ts.tv_nsec = 10000000;
+	ret = gw_ring_wait_cqes(&ring, &cqe, 2, &wait_ts);
+	assert(ret == -ETIME);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that the per-op counters and histograms add up across the
+ * submitter and the io workers, and that a full SQ is counted.
+ */
+static void test_stats(void)
+{
+	struct gw_ring_op_stats *ost;
+	struct gw_ring_stats st;
+	struct gw_ring_sqe *sqes[8];
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint64_t nr_queue;
+	uint64_t nr_run;
+	uint32_t nr;
+	uint32_t i;
+	int it;
+	int ret;
+
+	ret = gw_ring_init(&ring, 8);
+	assert(ret == 0);
+
+	for (i = 0; i < 8; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		assert(sqe);
+		sqe->op = GW_RING_OP_NOP;
+		sqe->flags = (i & 1) ? GW_RING_SQE_F_ASYNC : 0;
+		sqe->user_data = i;
+	}
+	assert(!gw_ring_get_sqe(&ring));
+	nr = gw_ring_get_sqes(&ring, 8, sqes);
+	assert(nr == 0);
+
+	ret = gw_ring_submit(&ring);
+	assert(ret == 8);
+	ret = gw_ring_wait_cqes(&ring, &cqe, 8, NULL);
+	assert(ret == 8);
+
+	gw_ring_get_stats(&ring, &st);
+	assert(st.sq_depth == 0);
+	assert(st.cq_depth == 8);
+	assert(st.nr_sqe_full == 2);
+	ost = &st.ops[GW_RING_OP_NOP];
+	assert(ost->nr_submitted == 8);
+	assert(ost->nr_completed == 8);
+	assert(ost->nr_punted == 4);
+
+	/*
+	 * The worker counts the run time after posting the CQE.
+	 */
+	wait_all_work_done(ring.wqs[0]);
+	gw_ring_get_stats(&ring, &st);
+	nr_queue = 0;
+	nr_run = 0;
+	for (i = 0; i < GW_RING_LAT_NR_BUCKETS; i++) {
+		nr_queue += ost->queue_lat[i];
+		nr_run += ost->run_lat[i];
+	}
+	assert(nr_queue == 4);
+	assert(nr_run == 4);
+
+	gw_ring_cq_advance(&ring, 8);
+	gw_ring_get_stats(&ring, &st);
+	assert(st.cq_depth == 0);
+	assert(st.ops[GW_RING_OP_TIMEOUT].nr_submitted == 0);
+
+	/*
+	 * A burst of async NOPs goes through the SQE pool: the
+	 * submitter refills its cache from the frees of the workers
+	 * and never falls back to malloc().
+	 */
+	for (it = 0; it < 16; it++) {
+		for (i = 0; i < 8; i++) {
+			sqe = gw_ring_get_sqe(&ring);
+			assert(sqe);
+			sqe->op = GW_RING_OP_NOP;
+			sqe->flags = GW_RING_SQE_F_ASYNC;
+			sqe->user_data = i;
+		}
+		ret = gw_ring_submit(&ring);
+		assert(ret == 8);
+		ret = gw_ring_wait_cqes(&ring, &cqe, 8, NULL);
+		assert(ret == 8);
+		gw_ring_cq_advance(&ring, 8);
+	}
+
+	wait_all_work_done(ring.wqs[0]);
+	gw_ring_get_stats(&ring, &st);
+	assert(st.pool_nr_objs > 0);
+	assert(st.pool_nr_refill > 0);
+	assert(st.pool_nr_fallback == 0);
+	assert(st.pool_in_use <= 8);
+	gw_ring_destroy(&ring);
+}
+
+static atomic_bool busy_release;
+
+static void busy_block(void *arg)
+{
+	(void)arg;
+	while (!atomic_load(&busy_release))
+		usleep(1000);
+}
+
+static void fill_io_wq(struct gw_ring *ring)
+{
+	while (!try_queue_work(ring->wqs[0], busy_block, NULL, NULL))
+		;
+}
+
+/*
+ * Test that gw_ring_submit() doesn't wait for room in a full io
+ * workqueue: the SQEs stay in the SQ and are issued once by a later
+ * call, each completing exactly once.
+ */
+static void test_submit_busy(void)
+{
+	struct gw_ring_op_stats *ost;
+	struct gw_ring_stats st;
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint32_t seen = 0;
+	uint32_t head;
+	uint32_t nr;
+	int issued;
+	int ret;
+	int i;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+	atomic_store(&busy_release, false);
+
+	/*
+	 * Let the workers that are around take a blocker each, so
+	 * that they don't make room behind our back.
+	 */
+	fill_io_wq(&ring);
+	usleep(20000);
+	fill_io_wq(&ring);
+
+	for (i = 0; i < 8; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		assert(sqe);
+		sqe->op = GW_RING_OP_NOP;
+		sqe->flags = GW_RING_SQE_F_ASYNC;
+		sqe->user_data = (uint64_t)i;
+	}
+
+	ret = gw_ring_submit(&ring);
+	assert(ret == -EBUSY || (ret >= 0 && ret < 8));
+	issued = ret > 0 ? ret : 0;
+	gw_ring_get_stats(&ring, &st);
+	assert(st.nr_sq_busy >= 1);
+	assert(st.sq_depth == 8u - (uint32_t)issued);
+	assert(st.ops[GW_RING_OP_NOP].nr_submitted == (uint64_t)issued);
+
+	atomic_store(&busy_release, true);
+	issued += submit_all(&ring, 8 - issued);
+	assert(issued == 8);
+
+	i = 0;
+	while (i < 8) {
+		wait_one_cqe(&ring);
+		nr = 0;
+		gw_ring_for_each_cqe(&ring, head, cqe) {
+			assert(cqe->res == 0);
+			assert(cqe->user_data < 8);
+			assert(!(seen & (1u << cqe->user_data)));
+			seen |= 1u << cqe->user_data;
+			nr++;
+		}
+		gw_ring_cq_advance(&ring, nr);
+		i += (int)nr;
+	}
+
+	gw_ring_get_stats(&ring, &st);
+	ost = &st.ops[GW_RING_OP_NOP];
+	assert(st.sq_depth == 0);
+	assert(ost->nr_submitted == 8);
+	assert(ost->nr_punted == 8);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that a link chain whose next SQE finds the io workqueue full
+ * completes it with -EBUSY and the rest of the chain with -ECANCELED,
+ * instead of waiting for room.
+ */
+static void test_link_busy(void)
+{
+	static const int64_t res[3] = { 0, -EBUSY, -ECANCELED };
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint32_t seen = 0;
+	uint32_t head;
+	uint32_t nr;
+	int ret;
+	int i;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+	atomic_store(&busy_release, false);
+	fill_io_wq(&ring);
+	usleep(20000);
+	fill_io_wq(&ring);
+
+	for (i = 0; i < 3; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		assert(sqe);
+		sqe->op = GW_RING_OP_NOP;
+		sqe->flags = (i < 2) ? GW_RING_SQE_F_LINK : 0;
+		if (i == 1)
+			sqe->flags |= GW_RING_SQE_F_ASYNC;
+		sqe->user_data = (uint64_t)i;
+	}
+
+	ret = gw_ring_submit(&ring);
+	assert(ret == 3);
+
+	nr = 0;
+	gw_ring_for_each_cqe(&ring, head, cqe) {
+		assert(cqe->user_data < 3);
+		assert(cqe->res == res[cqe->user_data]);
+		seen |= 1u << cqe->user_data;
+		nr++;
+	}
+	assert(nr == 3);
+	assert(seen == 7);
+	gw_ring_cq_advance(&ring, nr);
+
+	atomic_store(&busy_release, true);
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * Test that a ring with one io workqueue per NUMA node still completes
+ * the punted SQEs.
+ */
+static void test_numa(void)
+{
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct gw_ring ring;
+	uint32_t nodes[64];
+	uint32_t head;
+	uint32_t nr;
+	int ret;
+	int i;
+
+	nr = workqueue_get_nodes(nodes, 64);
+	assert(nr >= 1 && nr == workqueue_nr_nodes());
+	for (i = 1; i < (int)nr && i < 64; i++)
+		assert(nodes[i] > nodes[i - 1]);
+
+	ret = gw_ring_init_flags(&ring, 16, GW_RING_SETUP_F_NUMA);
+	assert(ret == 0);
+	assert(ring.nr_wqs == nr);
+
+	for (i = 0; i < 8; i++) {
+		sqe = gw_ring_get_sqe(&ring);
+		assert(sqe);
+		sqe->op = GW_RING_OP_NOP;
+		sqe->flags = GW_RING_SQE_F_ASYNC;
+		sqe->user_data = (uint64_t)i;
+	}
+	ret = gw_ring_submit(&ring);
+	assert(ret == 8);
+
+	i = 0;
+	while (i < 8) {
+		wait_one_cqe(&ring);
+		nr = 0;
+		gw_ring_for_each_cqe(&ring, head, cqe) {
+			assert(cqe->res == 0);
+			nr++;
+		}
+		gw_ring_cq_advance(&ring, nr);
+		i += (int)nr;
+	}
+
+	gw_ring_destroy(&ring);
+}
+
+/*
+ * A Bot API server on 127.0.0.1 that answers the first
+ * FAKE_API_NR_BATCHES getUpdates calls with the updates offset and
+ * offset + 1, and the later ones with an empty result.
+ */
+enum {
+	FAKE_API_NR_BATCHES = 3,
+};
+
+struct fake_api {
+	int		fd;
+	char		url[64];
+	thread_t	thread;
+	int64_t		offsets[FAKE_API_NR_BATCHES];
+	_Atomic(int)	nr_batches;
+};
+
+static void fake_api_reply(struct fake_api *api, int fd)
+{
+	char buf[1024], body[256], *p;
+	size_t len = 0;
+	int64_t offset;
+	ssize_t ret;
+	int nr;
+
+	while (len < sizeof(buf) - 1u) {
+		ret = read(fd, buf + len, sizeof(buf) - 1u - len);
+		if (ret <= 0)
+			return;
+		len += (size_t)ret;
+		buf[len] = '\0';
+		if (strstr(buf, "\r\n\r\n"))
+			break;
+	}
+
+	p = strstr(buf, "/getUpdates?offset=");
+	assert(p);
+	offset = strtoll(p + strlen("/getUpdates?offset="), NULL, 10);
+
+	nr = atomic_load(&api->nr_batches);
+	if (nr < FAKE_API_NR_BATCHES) {
+		api->offsets[nr] = offset;
+		atomic_store(&api->nr_batches, nr + 1);
+		snprintf(body, sizeof(body),
+			 "{\"ok\":true,\"result\":[{\"update_id\":%" PRId64
+			 "},{\"update_id\":%" PRId64 "}]}",
+			 offset, offset + 1);
+	} else {
+		usleep(1000);
+		snprintf(body, sizeof(body), "{\"ok\":true,\"result\":[]}");
+	}
+
+	len = (size_t)snprintf(buf, sizeof(buf),
+			       "HTTP/1.1 200 OK\r\n"
+			       "Content-Type: application/json\r\n"
+			       "Content-Length: %zu\r\n"
+			       "Connection: close\r\n\r\n%s",
+			       strlen(body), body);
+	ret = write(fd, buf, len);
+	(void)ret;
+}
+
+static void *fake_api_func(void *arg)
+{
+	struct fake_api *api = arg;
+	int fd;
+
+	while (1) {
+		fd = accept(api->fd, NULL, NULL);
+		if (fd < 0)
+			break;
+		fake_api_reply(api, fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+static void fake_api_start(struct fake_api *api)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int ret;
+
+	memset(api, 0, sizeof(*api));
+	api->fd = socket(AF_INET, SOCK_STREAM, 0);
+	assert(api->fd >= 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ret = bind(api->fd, (struct sockaddr *)&addr, sizeof(addr));
+	assert(ret == 0);
+	ret = getsockname(api->fd, (struct sockaddr *)&addr, &len);
+	assert(ret == 0);
+	ret = listen(api->fd, 16);
+	assert(ret == 0);
+
+	snprintf(api->url, sizeof(api->url), "http://127.0.0.1:%u",
+		 (unsigned)ntohs(addr.sin_port));
+	ret = thread_create(&api->thread, fake_api_func, api);
+	assert(ret == 0);
+}
+
+static void fake_api_stop(struct fake_api *api)
+{
+	shutdown(api->fd, SHUT_RDWR);
+	thread_join(api->thread, NULL);
+	close(api->fd);
+}
+
+/*
+ * Test that a multishot getUpdates posts one CQE with
+ * GW_RING_CQE_F_MORE per non-empty batch, advances the offset past
+ * each batch by itself, skips the empty ones, and ends with a final
+ * CQE without the flag once it is cancelled.
+ */
+static void test_get_updates_multishot(void)
+{
+	struct tg_api_ctx ctx = { .token = "test" };
+	struct tg_updates *updates;
+	struct gw_ring_sqe *sqe;
+	struct gw_ring_cqe *cqe;
+	struct fake_api api;
+	struct gw_ring ring;
+	bool done = false;
+	int nr_batches = 0;
+	int nr_cancel = 0;
+	int ret;
+	int i;
+
+	fake_api_start(&api);
+	ctx.api_url = api.url;
+
+	ret = gw_ring_init(&ring, 16);
+	assert(ret == 0);
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	gw_ring_prep_tg_get_updates_multishot(sqe, &ctx, 100);
+	sqe->user_data = 1;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 1);
+
+	while (nr_batches < FAKE_API_NR_BATCHES) {
+		cqe = wait_one_cqe(&ring);
+		assert(cqe->user_data == 1);
+		assert(cqe->res == 0);
+		assert(cqe->flags & GW_RING_CQE_F_MORE);
+
+		updates = cqe->data;
+		assert(updates && updates->len == 2);
+		assert(updates->updates[0].update_id ==
+		       (uint64_t)(100 + 2 * nr_batches));
+		tgapi_free_updates(updates);
+		gw_ring_cq_advance(&ring, 1);
+		nr_batches++;
+	}
+
+	assert(atomic_load(&api.nr_batches) == FAKE_API_NR_BATCHES);
+	for (i = 0; i < FAKE_API_NR_BATCHES; i++)
+		assert(api.offsets[i] == 100 + 2 * i);
+
+	sqe = gw_ring_get_sqe(&ring);
+	assert(sqe);
+	gw_ring_prep_cancel(sqe, 1, 0);
+	sqe->user_data = 2;
+	ret = gw_ring_submit(&ring);
+	assert(ret == 1);
+
+	while (!done || !nr_cancel) {
+		cqe = wait_one_cqe(&ring);
+		if (cqe->user_data == 2) {
+			assert(cqe->res == 0 || cqe->res == -EALREADY);
+			nr_cancel++;
+		} else {
+			assert(cqe->user_data == 1);
+			assert(!(cqe->flags & GW_RING_CQE_F_MORE));
+			assert(cqe->res == -ECANCELED);
+			done = true;
+		}
+		gw_ring_cq_advance(&ring, 1);
+	}
+
+	gw_ring_destroy(&ring);
+	fake_api_stop(&api);
+}
+
 int main(void)
 {
 	test_nop();
 	test_nop_full_cqe();
+	test_get_sqes_async_nop();
+	test_eventfd();
+	test_eventfd_epoll();
+	test_timeout();
+	test_wait_cqe_timeout();
+	test_timeout_destroy_pending();
+	test_link_chain();
+	test_link_chain_cancel();
+	test_cq_overflow();
+	test_cancel_timeout();
+	test_cancel_async_race();
+	test_sqpoll();
+	test_wait_spin();
+	test_wait_cqes();
+	test_stats();
+	test_submit_busy();
+	test_link_busy();
+	test_numa();
+	test_get_updates_multishot();
 	return 0;
 }
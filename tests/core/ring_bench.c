@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Contention benchmark for the gw_ring CQ.
+ *
+ * Every SQE is an async NOP, so the completion is posted from the io
+ * workqueue threads. With the default workqueue attributes there are at
+ * least 32 threads posting CQEs concurrently.
+ *
+ * The inline NOP run completes everything at submit time on a single
+ * thread, so it mostly measures the cost of moving SQEs and CQEs
+ * through the rings. The sqpoll run issues the SQEs from the SQ thread.
+ * The wait_nr run sleeps until a batch of CQEs is ready instead of
+ * waking up for every single one.
+ */
+
+#undef NDEBUG
+#include <gw/common.h>
+#include <gw/ring.h>
+#include <assert.h>
+#include <sched.h>
+#include <stdio.h>
+#include <time.h>
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t reap_cqes(struct gw_ring *ring, uint32_t min_nr)
+{
+	struct gw_ring_cqe *cqe;
+	uint32_t head;
+	uint32_t i;
+	int ret;
+
+	ret = gw_ring_wait_cqes(ring, &cqe, min_nr, NULL);
+	assert(ret > 0);
+
+	i = 0;
+	gw_ring_for_each_cqe(ring, head, cqe) {
+		assert(cqe->res == 0);
+		i++;
+	}
+	gw_ring_cq_advance(ring, i);
+	return i;
+}
+
+static void bench_async_nop(uint32_t ring_size, uint64_t total,
+			    uint32_t flags, uint32_t wait_nr)
+{
+	uint64_t submitted = 0, completed = 0;
+	uint32_t min_nr;
+	uint64_t start, end;
+	struct gw_ring_sqe *sqe;
+	struct gw_ring ring;
+	int ret;
+
+	ret = gw_ring_init_flags(&ring, ring_size, flags);
+	assert(ret == 0);
+
+	start = now_ns();
+	while (completed < total) {
+		while (submitted < total && submitted - completed < ring_size) {
+			sqe = gw_ring_get_sqe(&ring);
+			if (!sqe)
+				break;
+			sqe->op = GW_RING_OP_NOP;
+			sqe->flags = GW_RING_SQE_F_ASYNC;
+			sqe->user_data = submitted++;
+		}
+
+		ret = gw_ring_submit(&ring);
+		assert(ret >= 0);
+
+		/*
+		 * With an SQ thread, the CQEs may all be in before the
+		 * SQ thread has handed the SQ slots back.
+		 */
+		if (submitted == completed) {
+			sched_yield();
+			continue;
+		}
+
+		min_nr = wait_nr;
+		if (submitted - completed < min_nr)
+			min_nr = (uint32_t)(submitted - completed);
+		completed += reap_cqes(&ring, min_nr);
+	}
+	end = now_ns();
+
+	printf("%sring_size=%-6u wait_nr=%-3u completions=%-9llu "
+	       "time=%-8.3fms rate=%.0f cqe/s\n",
+	       (flags & GW_RING_SETUP_F_SQPOLL) ? "sqpoll " : "",
+	       ring_size, wait_nr, (unsigned long long)completed,
+	       (double)(end - start) / 1e6,
+	       (double)completed * 1e9 / (double)(end - start));
+	gw_ring_destroy(&ring);
+}
+
+static void bench_inline_nop(uint32_t ring_size, uint64_t total)
+{
+	uint64_t completed = 0;
+	uint64_t start, end;
+	struct gw_ring_sqe *sqe;
+	struct gw_ring ring;
+	uint32_t i;
+	int ret;
+
+	ret = gw_ring_init(&ring, ring_size);
+	assert(ret == 0);
+
+	start = now_ns();
+	while (completed < total) {
+		for (i = 0; i < ring_size; i++) {
+			sqe = gw_ring_get_sqe(&ring);
+			assert(sqe);
+			sqe->op = GW_RING_OP_NOP;
+			sqe->user_data = completed + i;
+		}
+
+		ret = gw_ring_submit(&ring);
+		assert(ret == (int)ring_size);
+		completed += reap_cqes(&ring, 1);
+	}
+	end = now_ns();
+
+	printf("inline ring_size=%-6u completions=%-9llu time=%-8.3fms "
+	       "rate=%.0f cqe/s\n", ring_size, (unsigned long long)completed,
+	       (double)(end - start) / 1e6,
+	       (double)completed * 1e9 / (double)(end - start));
+	gw_ring_destroy(&ring);
+}
+
+int main(void)
+{
+	bench_inline_nop(4096, 20000000);
+	bench_async_nop(64, 200000, 0, 1);
+	bench_async_nop(512, 500000, 0, 1);
+	bench_async_nop(4096, 1000000, 0, 1);
+	bench_async_nop(4096, 1000000, 0, 64);
+	bench_async_nop(4096, 1000000, GW_RING_SETUP_F_SQPOLL, 1);
+	return 0;
+}
@@ -0,0 +1,1405 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#undef NDEBUG
+#include <gw/common.h>
+#include <gw/workqueue.h>
+#include <gw/thread.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static atomic_bool blocker_started;
+static atomic_bool blocker_release;
+static uintptr_t order[64];
+static atomic_uint nr_order;
+
+static void blocker(void *arg)
+{
+	(void)arg;
+	atomic_store(&blocker_started, true);
+	while (!atomic_load(&blocker_release))
+		sched_yield();
+}
+
+static void record(void *arg)
+{
+	order[atomic_fetch_add(&nr_order, 1u)] = (uintptr_t)arg;
+}
+
+/*
+ * Occupy the only worker so that the works queued after this stay in
+ * their lanes until release_worker() is called.
+ */
+static struct workqueue_struct *alloc_blocked_wq(void)
+{
+	struct workqueue_attr attr = {
+		.name = "test-prio",
+		.max_threads = 1,
+		.min_threads = 1,
+		.max_pending_works = 64,
+	};
+	struct workqueue_struct *wq;
+	int ret;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+
+	atomic_store(&blocker_started, false);
+	atomic_store(&blocker_release, false);
+	atomic_store(&nr_order, 0u);
+	ret = queue_work(wq, blocker, NULL, NULL);
+	assert(ret == 0);
+	while (!atomic_load(&blocker_started))
+		sched_yield();
+
+	return wq;
+}
+
+static void release_worker(struct workqueue_struct *wq)
+{
+	atomic_store(&blocker_release, true);
+	wait_all_work_done(wq);
+}
+
+/*
+ * Test that the works are drained in strict priority order and FIFO
+ * within a lane, and that the lane counters follow.
+ */
+static void test_prio_order(void)
+{
+	struct workqueue_lane_stats st;
+	struct workqueue_struct *wq;
+	void *args[2] = { (void *)20, (void *)21 };
+	int ret;
+
+	wq = alloc_blocked_wq();
+	ret = queue_work_prio(wq, WQ_PRIO_LOW, record, (void *)30, NULL);
+	assert(ret == 0);
+	ret = queue_work(wq, record, (void *)10, NULL);
+	assert(ret == 0);
+	ret = queue_work_batch_prio(wq, WQ_PRIO_HIGH, record, args, 2, NULL);
+	assert(ret == 2);
+	ret = queue_work_prio(wq, WQ_NR_PRIO, record, NULL, NULL);
+	assert(ret == -EINVAL);
+
+	workqueue_get_lane_stats(wq, WQ_PRIO_HIGH, &st);
+	assert(st.depth == 2 && st.max_depth == 2 && st.nr_queued == 2);
+	workqueue_get_lane_stats(wq, WQ_PRIO_LOW, &st);
+	assert(st.depth == 1 && st.nr_queued == 1);
+
+	release_worker(wq);
+	assert(atomic_load(&nr_order) == 4);
+	assert(order[0] == 20);
+	assert(order[1] == 21);
+	assert(order[2] == 10);
+	assert(order[3] == 30);
+
+	workqueue_get_lane_stats(wq, WQ_PRIO_HIGH, &st);
+	assert(st.depth == 0 && st.max_depth == 2);
+	workqueue_get_lane_stats(wq, WQ_PRIO_LOW, &st);
+	assert(st.depth == 0 && st.nr_aged == 0);
+	destroy_workqueue(wq);
+}
+
+/*
+ * Test that a low priority work is not starved by a backlog of high
+ * priority ones.
+ */
+static void test_prio_aging(void)
+{
+	enum { NR_HIGH = 40 };
+	struct workqueue_lane_stats st;
+	struct workqueue_struct *wq;
+	uint32_t i;
+	int ret;
+
+	wq = alloc_blocked_wq();
+	ret = queue_work_prio(wq, WQ_PRIO_LOW, record, (void *)1, NULL);
+	assert(ret == 0);
+	for (i = 0; i < NR_HIGH; i++) {
+		ret = queue_work_prio(wq, WQ_PRIO_HIGH, record, (void *)0, NULL);
+		assert(ret == 0);
+	}
+
+	release_worker(wq);
+	assert(atomic_load(&nr_order) == NR_HIGH + 1);
+	for (i = 0; i < NR_HIGH + 1; i++) {
+		if (order[i])
+			break;
+	}
+	assert(i > 0 && i < NR_HIGH);
+
+	workqueue_get_lane_stats(wq, WQ_PRIO_LOW, &st);
+	assert(st.nr_aged == 1);
+	destroy_workqueue(wq);
+}
+
+static struct workqueue_struct *ws_wq;
+static atomic_uint nr_nodes;
+static atomic_uint nr_deleted;
+
+/*
+ * Queue two children from the worker until the depth runs out, so that
+ * most of the tree goes through the deques.
+ */
+static void tree_node(void *arg)
+{
+	uintptr_t depth = (uintptr_t)arg;
+	int ret;
+
+	atomic_fetch_add(&nr_nodes, 1u);
+	if (!depth)
+		return;
+
+	ret = queue_work(ws_wq, tree_node, (void *)(depth - 1), NULL);
+	assert(ret == 0);
+	ret = try_queue_work(ws_wq, tree_node, (void *)(depth - 1), NULL);
+	assert(ret == 0);
+}
+
+static void count_deleted(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add(&nr_deleted, 1u);
+}
+
+/*
+ * Test that works queued from the outside and from the workers all run
+ * exactly once in work-stealing mode, and that wait_all_work_done()
+ * still waits for them.
+ */
+static void test_work_stealing(void)
+{
+	enum { DEPTH = 12, NR_FLAT = 1000 };
+	struct workqueue_attr attr = {
+		.name = "test-ws",
+		.max_threads = 4,
+		.min_threads = 4,
+		.max_pending_works = 64,
+		.flags = WQ_F_WORK_STEALING,
+	};
+	static void *args[NR_FLAT];
+	int ret;
+	int i;
+
+	ret = alloc_workqueue(&ws_wq, &attr);
+	assert(ret == 0);
+
+	atomic_store(&nr_nodes, 0u);
+	atomic_store(&nr_deleted, 0u);
+	ret = queue_work(ws_wq, tree_node, (void *)(uintptr_t)DEPTH, NULL);
+	assert(ret == 0);
+
+	/*
+	 * wait_all_work_done() blocks the queuers, so let the tree grow
+	 * completely before calling it.
+	 */
+	while (atomic_load(&nr_nodes) < (1u << (DEPTH + 1)) - 1u)
+		sched_yield();
+	wait_all_work_done(ws_wq);
+	assert(atomic_load(&nr_nodes) == (1u << (DEPTH + 1)) - 1u);
+
+	atomic_store(&nr_nodes, 0u);
+	ret = queue_work_batch(ws_wq, tree_node, args, NR_FLAT, count_deleted);
+	assert(ret == NR_FLAT);
+	for (i = 0; i < NR_FLAT; i++) {
+		ret = try_queue_work(ws_wq, tree_node, NULL, count_deleted);
+		if (ret == -EAGAIN) {
+			i--;
+			sched_yield();
+			continue;
+		}
+		assert(ret == 0);
+	}
+	wait_all_work_done(ws_wq);
+	assert(atomic_load(&nr_nodes) == 2 * NR_FLAT);
+	assert(atomic_load(&nr_deleted) == 2 * NR_FLAT);
+	destroy_workqueue(ws_wq);
+}
+
+static __thread uint32_t nr_runs_on_thread;
+static atomic_uint last_nr_runs;
+
+static void count_thread_runs(void *arg)
+{
+	(void)arg;
+	atomic_store(&last_nr_runs, ++nr_runs_on_thread);
+}
+
+/*
+ * Test that an idle worker above min_threads exits after idle_timeout_ms
+ * and that the next work gets a fresh thread.
+ */
+static void test_idle_reap(uint32_t flags)
+{
+	struct workqueue_attr attr = {
+		.name = "test-reap",
+		.flags = WQ_F_LAZY_THREAD_CREATION | flags,
+		.max_threads = 1,
+		.min_threads = 0,
+		.max_pending_works = 64,
+		.idle_timeout_ms = 20,
+	};
+	struct workqueue_struct *wq;
+	int ret;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+
+	ret = queue_work(wq, count_thread_runs, NULL, NULL);
+	assert(ret == 0);
+	ret = queue_work(wq, count_thread_runs, NULL, NULL);
+	assert(ret == 0);
+	wait_all_work_done(wq);
+	assert(atomic_load(&last_nr_runs) == 2);
+
+	usleep(200000);
+	ret = queue_work(wq, count_thread_runs, NULL, NULL);
+	assert(ret == 0);
+	wait_all_work_done(wq);
+	assert(atomic_load(&last_nr_runs) == 1);
+	destroy_workqueue(wq);
+}
+
+/*
+ * Test that with spawn_delay_us, the works queued behind a busy worker
+ * don't get a new thread until they have waited long enough.
+ */
+static void test_spawn_delay(void)
+{
+	struct workqueue_attr attr = {
+		.name = "test-spawn",
+		.flags = WQ_F_LAZY_THREAD_CREATION,
+		.max_threads = 4,
+		.min_threads = 1,
+		.max_pending_works = 64,
+		.spawn_delay_us = 1000000,
+	};
+	struct workqueue_lane_stats st;
+	struct workqueue_struct *wq;
+	int ret;
+	int i;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+
+	atomic_store(&blocker_started, false);
+	atomic_store(&blocker_release, false);
+	atomic_store(&nr_order, 0u);
+	ret = queue_work(wq, blocker, NULL, NULL);
+	assert(ret == 0);
+	while (!atomic_load(&blocker_started))
+		sched_yield();
+
+	for (i = 0; i < 3; i++) {
+		ret = queue_work(wq, record, (void *)(uintptr_t)i, NULL);
+		assert(ret == 0);
+	}
+
+	usleep(50000);
+	workqueue_get_lane_stats(wq, WQ_PRIO_NORMAL, &st);
+	assert(st.depth == 3);
+	assert(atomic_load(&nr_order) == 0);
+
+	release_worker(wq);
+	assert(atomic_load(&nr_order) == 3);
+	destroy_workqueue(wq);
+}
+
+/*
+ * Test that a work queued behind a stuck worker gets a new thread once
+ * it has waited spawn_delay_us, with nothing else queued or picked.
+ */
+static void test_spawn_delay_timer(void)
+{
+	struct workqueue_attr attr = {
+		.name = "test-spawn",
+		.flags = WQ_F_LAZY_THREAD_CREATION,
+		.max_threads = 2,
+		.min_threads = 1,
+		.max_pending_works = 64,
+		.spawn_delay_us = 20000,
+	};
+	struct workqueue_struct *wq;
+	int ret;
+	int i;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+
+	atomic_store(&blocker_started, false);
+	atomic_store(&blocker_release, false);
+	atomic_store(&nr_order, 0u);
+	ret = queue_work(wq, blocker, NULL, NULL);
+	assert(ret == 0);
+	while (!atomic_load(&blocker_started))
+		sched_yield();
+
+	ret = queue_work(wq, record, (void *)1, NULL);
+	assert(ret == 0);
+
+	for (i = 0; i < 5000 && !atomic_load(&nr_order); i++)
+		usleep(1000);
+	assert(atomic_load(&nr_order) == 1);
+
+	release_worker(wq);
+	assert(order[0] == 1);
+	destroy_workqueue(wq);
+}
+
+static atomic_int work_cpus;
+
+static void record_affinity(void *arg)
+{
+	int cpu = (int)(uintptr_t)arg;
+	cpu_set_t set;
+
+	assert(sched_getaffinity(0, sizeof(set), &set) == 0);
+	if (CPU_COUNT(&set) == 1 && CPU_ISSET(cpu, &set))
+		atomic_store(&work_cpus, 1);
+	else
+		atomic_store(&work_cpus, -1);
+}
+
+/*
+ * Test that the workers stay on the CPUs given in the attributes.
+ */
+static void test_affinity(void)
+{
+	struct workqueue_attr attr = {
+		.name = "test-affinity",
+		.max_threads = 2,
+		.min_threads = 2,
+		.max_pending_works = 64,
+		.flags = WQ_F_CPU_AFFINITY,
+	};
+	struct workqueue_struct *wq;
+	cpu_set_t set;
+	int cpu;
+	int ret;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == -EINVAL);
+
+	assert(sched_getaffinity(0, sizeof(set), &set) == 0);
+	for (cpu = 0; !CPU_ISSET(cpu, &set); cpu++)
+		;
+
+	wq_cpumask_set(&attr.cpus, (uint32_t)cpu);
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+	ret = queue_work(wq, record_affinity, (void *)(uintptr_t)cpu, NULL);
+	assert(ret == 0);
+	wait_all_work_done(wq);
+	assert(atomic_load(&work_cpus) == 1);
+	destroy_workqueue(wq);
+
+	attr.flags = WQ_F_NUMA_NODE;
+	attr.numa_node = workqueue_current_node();
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+	destroy_workqueue(wq);
+
+	attr.numa_node = 4096;
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == -ENODEV);
+}
+
+static atomic_uint nr_dw_runs;
+static atomic_uint nr_dw_deleted;
+
+static void count_dw_run(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add(&nr_dw_runs, 1u);
+}
+
+static void count_dw_deleted(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add(&nr_dw_deleted, 1u);
+}
+
+static struct workqueue_struct *alloc_dw_wq(void)
+{
+	struct workqueue_attr attr = {
+		.name = "test-delayed",
+		.max_threads = 2,
+		.min_threads = 2,
+		.max_pending_works = 64,
+	};
+	struct workqueue_struct *wq;
+	int ret;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+
+	atomic_store(&nr_order, 0u);
+	atomic_store(&nr_dw_runs, 0u);
+	atomic_store(&nr_dw_deleted, 0u);
+	return wq;
+}
+
+/*
+ * Test that delayed works run in expiry order, and that a cancelled one
+ * never runs but still gets its deleter called.
+ */
+static void test_delayed_work(void)
+{
+	static const uint64_t delays_ms[] = { 60, 20, 40 };
+	struct delayed_work dw[4];
+	struct workqueue_struct *wq;
+	uint32_t i;
+	int ret;
+
+	wq = alloc_dw_wq();
+	for (i = 0; i < 3; i++) {
+		init_delayed_work(&dw[i], record, (void *)(uintptr_t)delays_ms[i],
+				  count_dw_deleted);
+		ret = queue_delayed_work(wq, &dw[i], delays_ms[i] * 1000000ull);
+		assert(ret == 0);
+	}
+	ret = queue_delayed_work(wq, &dw[0], 1);
+	assert(ret == -EBUSY);
+
+	init_delayed_work(&dw[3], record, NULL, count_dw_deleted);
+	ret = queue_delayed_work(wq, &dw[3], 30 * 1000000ull);
+	assert(ret == 0);
+	assert(cancel_delayed_work(&dw[3]));
+	assert(!cancel_delayed_work(&dw[3]));
+	assert(atomic_load(&nr_dw_deleted) == 1);
+
+	while (atomic_load(&nr_dw_deleted) < 4)
+		usleep(1000);
+
+	assert(atomic_load(&nr_order) == 3);
+	assert(order[0] == 20 && order[1] == 40 && order[2] == 60);
+	assert(!cancel_delayed_work(&dw[0]));
+	destroy_workqueue(wq);
+}
+
+/*
+ * Test that a periodic work keeps running until it is cancelled, and
+ * that its deleter is called exactly once.
+ */
+static void test_periodic_work(void)
+{
+	struct workqueue_struct *wq;
+	struct delayed_work dw;
+	uint32_t nr;
+	int ret;
+
+	wq = alloc_dw_wq();
+	init_delayed_work(&dw, count_dw_run, NULL, count_dw_deleted);
+	ret = queue_periodic_work(wq, &dw, 0);
+	assert(ret == -EINVAL);
+	ret = queue_periodic_work(wq, &dw, 5 * 1000000ull);
+	assert(ret == 0);
+
+	while (atomic_load(&nr_dw_runs) < 5)
+		usleep(1000);
+
+	assert(cancel_delayed_work(&dw));
+	while (!atomic_load(&nr_dw_deleted))
+		usleep(1000);
+
+	nr = atomic_load(&nr_dw_runs);
+	usleep(30000);
+	assert(atomic_load(&nr_dw_runs) == nr);
+	assert(atomic_load(&nr_dw_deleted) == 1);
+	destroy_workqueue(wq);
+}
+
+/*
+ * Test a lot of far away delayed works: cancelling some and destroying
+ * the workqueue with the others still pending must call every deleter.
+ */
+static void test_delayed_work_many(void)
+{
+	enum { NR_DW = 200000 };
+	struct workqueue_struct *wq;
+	struct delayed_work *dw;
+	uint32_t i;
+	int ret;
+
+	dw = malloc(NR_DW * sizeof(*dw));
+	assert(dw);
+
+	wq = alloc_dw_wq();
+	for (i = 0; i < NR_DW; i++) {
+		init_delayed_work(&dw[i], count_dw_run, NULL, count_dw_deleted);
+		ret = queue_delayed_work(wq, &dw[i],
+					 (1000ull + i * 7919ull % 3600000ull) *
+					 1000000ull);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < NR_DW; i += 2)
+		assert(cancel_delayed_work(&dw[i]));
+	assert(atomic_load(&nr_dw_deleted) == NR_DW / 2);
+
+	destroy_workqueue(wq);
+	assert(atomic_load(&nr_dw_deleted) == NR_DW);
+	assert(atomic_load(&nr_dw_runs) == 0);
+	free(dw);
+}
+
+/*
+ * Test that a delayed work whose lane is full waits for room on its
+ * timer instead of holding up the timer thread: it can still be
+ * cancelled, and another one still fires and runs once there is room.
+ */
+static void test_delayed_work_full(void)
+{
+	struct delayed_work dw[2];
+	struct workqueue_struct *wq;
+	int ret;
+
+	wq = alloc_blocked_wq();
+	atomic_store(&nr_dw_runs, 0u);
+	atomic_store(&nr_dw_deleted, 0u);
+	while (!try_queue_work(wq, NULL, NULL, NULL))
+		;
+
+	init_delayed_work(&dw[0], count_dw_run, NULL, count_dw_deleted);
+	ret = queue_delayed_work(wq, &dw[0], 1000000ull);
+	assert(ret == 0);
+	usleep(20000);
+	assert(cancel_delayed_work(&dw[0]));
+	assert(atomic_load(&nr_dw_deleted) == 1);
+
+	init_delayed_work(&dw[1], count_dw_run, NULL, count_dw_deleted);
+	ret = queue_delayed_work(wq, &dw[1], 1000000ull);
+	assert(ret == 0);
+	usleep(20000);
+	assert(atomic_load(&nr_dw_runs) == 0);
+
+	atomic_store(&blocker_release, true);
+	while (atomic_load(&nr_dw_deleted) < 2)
+		usleep(1000);
+	assert(atomic_load(&nr_dw_runs) == 1);
+	destroy_workqueue(wq);
+}
+
+enum {
+	NR_KEYS = 8,
+	NR_KEYED_WORKS = 2000,
+};
+
+struct keyed_arg {
+	uint32_t	key;
+	uint32_t	seq;
+};
+
+static atomic_uint key_running[NR_KEYS];
+static uint32_t key_next_seq[NR_KEYS];
+static atomic_uint nr_keyed_deleted;
+
+static void keyed_func(void *arg)
+{
+	struct keyed_arg *ka = arg;
+
+	assert(atomic_fetch_add(&key_running[ka->key], 1u) == 0);
+	assert(key_next_seq[ka->key] == ka->seq);
+	key_next_seq[ka->key]++;
+	if (!(ka->seq % 64))
+		sched_yield();
+	atomic_fetch_sub(&key_running[ka->key], 1u);
+}
+
+static void keyed_deleter(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add(&nr_keyed_deleted, 1u);
+}
+
+static struct workqueue_struct *alloc_keyed_wq(uint64_t flags,
+					      uint32_t nr_threads)
+{
+	struct workqueue_attr attr = {
+		.name = "test-keyed",
+		.max_threads = nr_threads,
+		.min_threads = nr_threads,
+		.max_pending_works = 64,
+		.flags = flags,
+	};
+	struct workqueue_struct *wq;
+	int ret;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+	memset(key_next_seq, 0, sizeof(key_next_seq));
+	atomic_store(&nr_keyed_deleted, 0u);
+	return wq;
+}
+
+/*
+ * Test that the works of a key run one at a time and in order, while
+ * the keys are interleaved.
+ */
+static void test_keyed_work(uint64_t flags)
+{
+	static struct keyed_arg args[NR_KEYS * NR_KEYED_WORKS];
+	struct workqueue_struct *wq;
+	struct keyed_arg *ka;
+	uint32_t i;
+	int ret;
+
+	wq = alloc_keyed_wq(flags, 4);
+	for (i = 0; i < NR_KEYS * NR_KEYED_WORKS; i++) {
+		ka = &args[i];
+		ka->key = i % NR_KEYS;
+		ka->seq = i / NR_KEYS;
+		ret = queue_work_keyed_prio(wq, ka->key % WQ_NR_PRIO,
+					    1000000007ull * ka->key, keyed_func,
+					    ka, keyed_deleter);
+		assert(ret == 0);
+	}
+
+	ret = queue_work_keyed_prio(wq, WQ_NR_PRIO, 0, keyed_func, NULL, NULL);
+	assert(ret == -EINVAL);
+
+	wait_all_work_done(wq);
+	assert(atomic_load(&nr_keyed_deleted) == NR_KEYS * NR_KEYED_WORKS);
+	for (i = 0; i < NR_KEYS; i++)
+		assert(key_next_seq[i] == NR_KEYED_WORKS);
+	destroy_workqueue(wq);
+}
+
+static void keyed_block(void *arg)
+{
+	atomic_bool *go = arg;
+
+	while (!atomic_load(go))
+		usleep(1000);
+}
+
+/*
+ * Test that keyed works queued behind a running one wait for it.
+ */
+static void test_keyed_work_wait(void)
+{
+	static struct keyed_arg args[16];
+	struct workqueue_struct *wq;
+	atomic_bool go = false;
+	uint32_t i;
+	int ret;
+
+	wq = alloc_keyed_wq(0, 4);
+	ret = queue_work_keyed(wq, 1, keyed_block, &go, keyed_deleter);
+	assert(ret == 0);
+	for (i = 0; i < 16; i++) {
+		args[i].key = 1;
+		args[i].seq = i;
+		ret = queue_work_keyed(wq, 1, keyed_func, &args[i],
+				       keyed_deleter);
+		assert(ret == 0);
+	}
+
+	usleep(10000);
+	assert(key_next_seq[1] == 0);
+	atomic_store(&go, true);
+	wait_all_work_done(wq);
+	assert(atomic_load(&nr_keyed_deleted) == 17);
+	assert(key_next_seq[1] == 16);
+
+	destroy_workqueue(wq);
+}
+
+/*
+ * Test that the works waiting on a key count against the lane limit,
+ * and that the works accepted before the lane got full all run.
+ */
+static void test_keyed_work_full(void)
+{
+	static struct keyed_arg args[64];
+	struct workqueue_lane_stats st;
+	struct workqueue_struct *wq;
+	atomic_bool go = false;
+	uint32_t i;
+	int ret;
+
+	wq = alloc_keyed_wq(0, 1);
+	ret = queue_work_keyed(wq, 3, keyed_block, &go, keyed_deleter);
+	assert(ret == 0);
+	do {
+		usleep(1000);
+		workqueue_get_lane_stats(wq, WQ_PRIO_NORMAL, &st);
+	} while (st.depth);
+
+	for (i = 0; i < 64; i++) {
+		args[i].key = 3;
+		args[i].seq = i;
+		ret = try_queue_work_keyed_prio(wq, WQ_PRIO_NORMAL, 3,
+						keyed_func, &args[i],
+						keyed_deleter);
+		assert(ret == 0);
+	}
+
+	ret = try_queue_work_keyed_prio(wq, WQ_PRIO_NORMAL, 3, keyed_func,
+					NULL, keyed_deleter);
+	assert(ret == -EAGAIN);
+	ret = try_queue_work_keyed_prio(wq, WQ_PRIO_NORMAL, 4, keyed_func,
+					NULL, keyed_deleter);
+	assert(ret == -EAGAIN);
+	ret = try_queue_work(wq, keyed_func, NULL, keyed_deleter);
+	assert(ret == -EAGAIN);
+
+	atomic_store(&go, true);
+	wait_all_work_done(wq);
+	assert(atomic_load(&nr_keyed_deleted) == 65);
+	assert(key_next_seq[3] == 64);
+
+	ret = try_queue_work_keyed_prio(wq, WQ_PRIO_NORMAL, 3, keyed_block,
+					&go, keyed_deleter);
+	assert(ret == 0);
+	wait_all_work_done(wq);
+	destroy_workqueue(wq);
+}
+
+static atomic_uint keyed_order;
+
+static void keyed_order_func(void *arg)
+{
+	uint32_t *order = arg;
+
+	*order = atomic_fetch_add(&keyed_order, 1u);
+}
+
+/*
+ * Test that a high priority keyed work pulls the works queued before it
+ * on its key ahead of the normal priority works.
+ */
+static void test_keyed_work_prio(void)
+{
+	uint32_t order[8], plain[4];
+	struct workqueue_lane_stats st;
+	struct workqueue_struct *wq;
+	atomic_bool go = false;
+	uint32_t i;
+	int ret;
+
+	wq = alloc_keyed_wq(0, 1);
+	atomic_store(&keyed_order, 0u);
+	ret = queue_work(wq, keyed_block, &go, NULL);
+	assert(ret == 0);
+	do {
+		usleep(1000);
+		workqueue_get_lane_stats(wq, WQ_PRIO_NORMAL, &st);
+	} while (st.depth);
+
+	for (i = 0; i < 7; i++) {
+		ret = queue_work_keyed_prio(wq, WQ_PRIO_LOW, 5,
+					    keyed_order_func, &order[i], NULL);
+		assert(ret == 0);
+	}
+	for (i = 0; i < 4; i++) {
+		ret = queue_work(wq, keyed_order_func, &plain[i], NULL);
+		assert(ret == 0);
+	}
+	ret = queue_work_keyed_prio(wq, WQ_PRIO_HIGH, 5, keyed_order_func,
+				    &order[7], NULL);
+	assert(ret == 0);
+
+	atomic_store(&go, true);
+	wait_all_work_done(wq);
+	for (i = 0; i < 8; i++)
+		assert(order[i] == i);
+	for (i = 0; i < 4; i++)
+		assert(plain[i] == 8 + i);
+	destroy_workqueue(wq);
+}
+
+static void keyed_sleep(void *arg)
+{
+	(void)arg;
+	usleep(50000);
+}
+
+/*
+ * Test that destroying the workqueue drops the works of a key whose
+ * dispatch work is still pending.
+ */
+static void test_keyed_work_destroy(void)
+{
+	static struct keyed_arg args[16];
+	struct workqueue_struct *wq;
+	uint32_t i;
+	int ret;
+
+	wq = alloc_keyed_wq(0, 1);
+	ret = queue_work(wq, keyed_sleep, NULL, NULL);
+	assert(ret == 0);
+	for (i = 0; i < 16; i++) {
+		args[i].key = 2;
+		args[i].seq = i;
+		ret = queue_work_keyed(wq, 2, keyed_func, &args[i],
+				       keyed_deleter);
+		assert(ret == 0);
+	}
+
+	destroy_workqueue(wq);
+	assert(atomic_load(&nr_keyed_deleted) == 16);
+	assert(key_next_seq[2] == 0);
+}
+
+enum {
+	NR_PARK_QUEUERS = 4,
+	NR_PARK_WORKS = 20000,
+};
+
+static atomic_uint nr_park_runs;
+
+static void park_work(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add(&nr_park_runs, 1u);
+}
+
+static void *park_queuer(void *arg)
+{
+	struct workqueue_struct *wq = arg;
+	void *args[8] = { NULL };
+	uint32_t i = 0;
+	int ret;
+
+	while (i < NR_PARK_WORKS) {
+		if (i % 3) {
+			ret = queue_work(wq, park_work, NULL, NULL);
+			assert(ret == 0);
+			i++;
+			continue;
+		}
+
+		ret = queue_work_batch(wq, park_work, args, 8, NULL);
+		assert(ret == 8);
+		i += 8;
+	}
+	return NULL;
+}
+
+/*
+ * Test that no wake up is lost when the queuers keep parking on a tiny
+ * work list and wait_all_work_done() runs in the middle.
+ */
+static void test_parking(uint64_t flags)
+{
+	struct workqueue_attr attr = {
+		.name = "test-park",
+		.max_threads = 3,
+		.min_threads = 3,
+		.max_pending_works = 4,
+		.flags = flags,
+	};
+	thread_t threads[NR_PARK_QUEUERS];
+	struct workqueue_struct *wq;
+	uint32_t i;
+	int ret;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+
+	atomic_store(&nr_park_runs, 0u);
+	for (i = 0; i < NR_PARK_QUEUERS; i++) {
+		ret = thread_create(&threads[i], park_queuer, wq);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < 20; i++)
+		wait_all_work_done(wq);
+
+	for (i = 0; i < NR_PARK_QUEUERS; i++)
+		thread_join(threads[i], NULL);
+
+	wait_all_work_done(wq);
+	assert(atomic_load(&nr_park_runs) >= NR_PARK_QUEUERS * NR_PARK_WORKS);
+	assert(atomic_load(&nr_park_runs) < NR_PARK_QUEUERS *
+					     (NR_PARK_WORKS + 8));
+	destroy_workqueue(wq);
+}
+
+struct inline_payload {
+	uint32_t	size;
+	uint32_t	seed;
+	uint8_t		bytes[248];
+};
+
+static struct workqueue_struct *inline_wq;
+static atomic_uint nr_inline_runs;
+static atomic_uint nr_inline_deleted;
+
+static void fill_payload(struct inline_payload *p, uint32_t size,
+			 uint32_t seed)
+{
+	uint32_t i;
+
+	p->size = size;
+	p->seed = seed;
+	for (i = 0; i + 8 < size; i++)
+		p->bytes[i] = (uint8_t)(seed + i);
+}
+
+static void check_payload(const struct inline_payload *p)
+{
+	uint32_t i;
+
+	assert(!((uintptr_t)p % 8));
+	for (i = 0; i + 8 < p->size; i++)
+		assert(p->bytes[i] == (uint8_t)(p->seed + i));
+}
+
+static void inline_func(void *arg)
+{
+	check_payload(arg);
+	atomic_fetch_add(&nr_inline_runs, 1u);
+}
+
+static void inline_deleter(void *arg)
+{
+	check_payload(arg);
+	atomic_fetch_add(&nr_inline_deleted, 1u);
+}
+
+/*
+ * Queue children from a worker, so that they go to its deque in work
+ * stealing mode.
+ */
+static void inline_parent(void *arg)
+{
+	const struct inline_payload *p = arg;
+	struct inline_payload c;
+	uint32_t i;
+	int ret;
+
+	check_payload(p);
+	for (i = 0; i < 4; i++) {
+		fill_payload(&c, 8 + (p->seed + i) % 200, p->seed * 4 + i);
+		ret = queue_work_inline_prio(inline_wq, WQ_PRIO_NORMAL,
+					     inline_func, &c, c.size,
+					     inline_deleter);
+		assert(ret == 0);
+	}
+	atomic_fetch_add(&nr_inline_runs, 1u);
+}
+
+/*
+ * Test that inline payloads, and the bigger ones that go to the heap,
+ * reach the work and its deleter intact. The lanes can hold all the
+ * works, so that the parents never wait for room.
+ */
+static void test_inline_work(uint64_t flags)
+{
+	struct workqueue_attr attr = {
+		.name = "test-inline",
+		.max_threads = 4,
+		.min_threads = 4,
+		.max_pending_works = 1024,
+		.flags = flags,
+	};
+	struct inline_payload p;
+	uint32_t i, size;
+	int ret;
+
+	ret = alloc_workqueue(&inline_wq, &attr);
+	assert(ret == 0);
+	atomic_store(&nr_inline_runs, 0u);
+	atomic_store(&nr_inline_deleted, 0u);
+
+	ret = queue_work_inline(inline_wq, inline_func, &p, 0);
+	assert(ret == -EINVAL);
+
+	for (i = 0; i < 400; i++) {
+		size = 8 + i % (sizeof(p) - 8);
+		fill_payload(&p, size, i);
+		ret = queue_work_inline_prio(inline_wq, i % WQ_NR_PRIO,
+					     inline_func, &p, size,
+					     inline_deleter);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < 100; i++) {
+		fill_payload(&p, 8 + i % 100, i);
+		ret = queue_work_inline(inline_wq, inline_parent, &p, p.size);
+		assert(ret == 0);
+	}
+
+	/*
+	 * wait_all_work_done() would block the parents queueing their
+	 * children.
+	 */
+	while (atomic_load(&nr_inline_deleted) < 400 + 100 * 4)
+		usleep(1000);
+
+	wait_all_work_done(inline_wq);
+	assert(atomic_load(&nr_inline_runs) == 400 + 100 * 5);
+	assert(atomic_load(&nr_inline_deleted) == 400 + 100 * 4);
+	destroy_workqueue(inline_wq);
+}
+
+static void inline_sleep(void *arg)
+{
+	(void)arg;
+	usleep(50000);
+}
+
+/*
+ * Test that destroying the workqueue calls the deleter of the pending
+ * inline works, and frees the heap copies (checked by ASan).
+ */
+static void test_inline_work_destroy(void)
+{
+	struct workqueue_attr attr = {
+		.name = "test-inline",
+		.max_threads = 1,
+		.min_threads = 1,
+		.max_pending_works = 16,
+	};
+	struct inline_payload p;
+	uint32_t i;
+	int ret;
+
+	ret = alloc_workqueue(&inline_wq, &attr);
+	assert(ret == 0);
+	atomic_store(&nr_inline_runs, 0u);
+	atomic_store(&nr_inline_deleted, 0u);
+
+	ret = queue_work(inline_wq, inline_sleep, NULL, NULL);
+	assert(ret == 0);
+	for (i = 0; i < 8; i++) {
+		fill_payload(&p, i & 1 ? WQ_INLINE_SIZE : sizeof(p), i);
+		ret = queue_work_inline_prio(inline_wq, WQ_PRIO_NORMAL,
+					     inline_func, &p, p.size,
+					     inline_deleter);
+		assert(ret == 0);
+	}
+
+	destroy_workqueue(inline_wq);
+	assert(atomic_load(&nr_inline_runs) == 0);
+	assert(atomic_load(&nr_inline_deleted) == 8);
+}
+
+static void stats_sleep(void *arg)
+{
+	(void)arg;
+	usleep(1000);
+}
+
+/*
+ * Test the histograms and the counters of workqueue_get_stats() on a
+ * work list small enough for the queuer to wait for room.
+ */
+static void test_stats(void)
+{
+	struct workqueue_attr attr = {
+		.name = "test-stats",
+		.max_threads = 2,
+		.min_threads = 2,
+		.max_pending_works = 4,
+	};
+	struct workqueue_struct *wq;
+	struct workqueue_stats st;
+	uint64_t sum_wait = 0, sum_run = 0;
+	uint32_t i, nr = 100;
+	int ret;
+
+	for (i = 1; i < WQ_HIST_NR_BUCKETS; i++)
+		assert(workqueue_hist_bucket_min(i) >
+		       workqueue_hist_bucket_min(i - 1));
+	assert(workqueue_hist_bucket_min(3) == 3);
+	assert(workqueue_hist_bucket_min(4) == 4);
+	assert(workqueue_hist_bucket_min(8) == 8);
+	assert(workqueue_hist_bucket_min(9) == 10);
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+
+	for (i = 0; i < 100; i++) {
+		ret = queue_work(wq, stats_sleep, NULL, NULL);
+		assert(ret == 0);
+	}
+
+	while (1) {
+		ret = try_queue_work(wq, stats_sleep, NULL, NULL);
+		if (ret == -EAGAIN)
+			break;
+		assert(ret == 0);
+		nr++;
+	}
+
+	wait_all_work_done(wq);
+	workqueue_get_stats(wq, &st);
+	for (i = 0; i < WQ_HIST_NR_BUCKETS; i++) {
+		sum_wait += st.wait_ns[i];
+		sum_run += st.run_ns[i];
+	}
+
+	assert(st.now_ns);
+	assert(st.nr_done == nr);
+	assert(sum_wait == nr);
+	assert(sum_run == nr);
+	assert(workqueue_hist_percentile(st.run_ns, 50.0) >= 500000u);
+	assert(workqueue_hist_percentile(st.run_ns, 99.9) >=
+	       workqueue_hist_percentile(st.run_ns, 50.0));
+	assert(st.nr_queue_waits > 0);
+	assert(st.nr_queue_full == 1);
+	assert(st.nr_spawns >= 1);
+	assert(st.nr_threads_spawned == 2);
+	assert(st.nr_threads_exited == 0);
+	destroy_workqueue(wq);
+}
+
+struct flush_item {
+	atomic_bool	ran;
+	atomic_bool	deleted;
+};
+
+static struct workqueue_struct *flush_wq;
+static atomic_uint nr_flush_slow;
+static atomic_int flush_self_ret;
+
+static void flush_slow(void *arg)
+{
+	struct flush_item *item = arg;
+
+	usleep(2000);
+	if (item)
+		atomic_store(&item->ran, true);
+	atomic_fetch_add(&nr_flush_slow, 1u);
+}
+
+static void flush_item_deleter(void *arg)
+{
+	struct flush_item *item = arg;
+
+	atomic_store(&item->deleted, true);
+}
+
+static void flush_fast(void *arg)
+{
+	(void)arg;
+}
+
+static void flush_self(void *arg)
+{
+	(void)arg;
+	atomic_store(&flush_self_ret, flush_workqueue(flush_wq));
+}
+
+/*
+ * Test that flush_work() returns once its work and deleter are done,
+ * and that destroying the workqueue completes the pending ones.
+ */
+static void test_flush_work(uint64_t flags)
+{
+	struct workqueue_attr attr = {
+		.name = "test-flush",
+		.max_threads = 2,
+		.min_threads = 2,
+		.max_pending_works = 32,
+		.flags = flags,
+	};
+	struct work_completion c[16];
+	struct flush_item items[16];
+	uint32_t i;
+	int ret;
+
+	ret = alloc_workqueue(&flush_wq, &attr);
+	assert(ret == 0);
+
+	init_work_completion(&c[0]);
+	assert(work_completion_done(&c[0]));
+	assert(!flush_work(&c[0]));
+
+	memset(items, 0, sizeof(items));
+	for (i = 0; i < 16; i++) {
+		ret = queue_work_completion(flush_wq, &c[i], flush_slow,
+					    &items[i], flush_item_deleter);
+		assert(ret == 0);
+	}
+
+	assert(flush_work(&c[0]));
+	assert(atomic_load(&items[0].ran));
+	assert(atomic_load(&items[0].deleted));
+	assert(!flush_work(&c[0]));
+
+	for (i = 15; i > 0; i--) {
+		flush_work(&c[i]);
+		assert(work_completion_done(&c[i]));
+		assert(atomic_load(&items[i].ran));
+		assert(atomic_load(&items[i].deleted));
+	}
+	destroy_workqueue(flush_wq);
+
+	attr.max_threads = 1;
+	attr.min_threads = 1;
+	ret = alloc_workqueue(&flush_wq, &attr);
+	assert(ret == 0);
+
+	memset(items, 0, sizeof(items));
+	ret = queue_work(flush_wq, inline_sleep, NULL, NULL);
+	assert(ret == 0);
+	ret = queue_work_completion(flush_wq, &c[0], flush_slow, &items[0],
+				    flush_item_deleter);
+	assert(ret == 0);
+	destroy_workqueue(flush_wq);
+	assert(work_completion_done(&c[0]));
+	assert(!atomic_load(&items[0].ran));
+	assert(atomic_load(&items[0].deleted));
+}
+
+static void *flusher(void *arg)
+{
+	int ret;
+
+	ret = flush_workqueue(arg);
+	assert(ret == 0);
+	assert(atomic_load(&nr_flush_slow) >= 20);
+	return NULL;
+}
+
+/*
+ * Test that flush_workqueue() waits for the works queued before it,
+ * while try_queue_work() keeps succeeding (it would fail with -EAGAIN
+ * during wait_all_work_done()).
+ */
+static void test_flush_workqueue(uint64_t flags)
+{
+	struct workqueue_attr attr = {
+		.name = "test-flush",
+		.max_threads = 2,
+		.min_threads = 2,
+		.max_pending_works = 64,
+		.flags = flags,
+	};
+	thread_t threads[2];
+	uint32_t i;
+	int ret;
+
+	ret = alloc_workqueue(&flush_wq, &attr);
+	assert(ret == 0);
+	atomic_store(&nr_flush_slow, 0u);
+
+	ret = flush_workqueue(flush_wq);
+	assert(ret == 0);
+
+	for (i = 0; i < 20; i++) {
+		ret = queue_work(flush_wq, flush_slow, NULL, NULL);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < 2; i++) {
+		ret = thread_create(&threads[i], flusher, flush_wq);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < 20; i++) {
+		ret = try_queue_work(flush_wq, flush_fast, NULL, NULL);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < 2; i++)
+		thread_join(threads[i], NULL);
+
+	ret = queue_work(flush_wq, flush_self, NULL, NULL);
+	assert(ret == 0);
+	ret = flush_workqueue(flush_wq);
+	assert(ret == 0);
+	assert(atomic_load(&flush_self_ret) == -EDEADLK);
+	destroy_workqueue(flush_wq);
+}
+
+static atomic_bool feed_stop;
+static atomic_uint nr_fed_queued;
+static atomic_uint nr_fed_done;
+
+static void fed_func(void *arg)
+{
+	(void)arg;
+	usleep(100);
+	atomic_fetch_add(&nr_fed_done, 1u);
+}
+
+static void *key_feeder(void *arg)
+{
+	struct workqueue_struct *wq = arg;
+	int ret;
+
+	while (!atomic_load(&feed_stop)) {
+		ret = queue_work_keyed(wq, 7, fed_func, NULL, NULL);
+		assert(ret == 0);
+		atomic_fetch_add(&nr_fed_queued, 1u);
+	}
+	return NULL;
+}
+
+/*
+ * Test that flush_workqueue() returns while a key keeps getting new
+ * works, once the works of the key queued before it are done.
+ */
+static void test_flush_workqueue_keyed(void)
+{
+	struct workqueue_struct *wq;
+	thread_t feeder;
+	uint32_t nr;
+	int ret;
+
+	wq = alloc_keyed_wq(0, 2);
+	atomic_store(&feed_stop, false);
+	atomic_store(&nr_fed_queued, 0u);
+	atomic_store(&nr_fed_done, 0u);
+	ret = thread_create(&feeder, key_feeder, wq);
+	assert(ret == 0);
+
+	while (atomic_load(&nr_fed_done) < 100)
+		usleep(1000);
+
+	nr = atomic_load(&nr_fed_queued);
+	ret = flush_workqueue(wq);
+	assert(ret == 0);
+	assert(atomic_load(&nr_fed_done) >= nr);
+	assert(!atomic_load(&feed_stop));
+
+	atomic_store(&feed_stop, true);
+	thread_join(feeder, NULL);
+	wait_all_work_done(wq);
+	assert(atomic_load(&nr_fed_done) == atomic_load(&nr_fed_queued));
+	destroy_workqueue(wq);
+}
+
+int main(void)
+{
+	test_prio_order();
+	test_prio_aging();
+	test_work_stealing();
+	test_idle_reap(0);
+	test_idle_reap(WQ_F_WORK_STEALING);
+	test_spawn_delay();
+	test_spawn_delay_timer();
+	test_affinity();
+	test_delayed_work();
+	test_periodic_work();
+	test_delayed_work_many();
+	test_delayed_work_full();
+	test_keyed_work(0);
+	test_keyed_work(WQ_F_WORK_STEALING);
+	test_keyed_work_wait();
+	test_keyed_work_destroy();
+	test_keyed_work_full();
+	test_keyed_work_prio();
+	test_parking(0);
+	test_parking(WQ_F_WORK_STEALING);
+	test_inline_work(0);
+	test_inline_work(WQ_F_WORK_STEALING);
+	test_inline_work_destroy();
+	test_stats();
+	test_flush_work(0);
+	test_flush_work(WQ_F_WORK_STEALING);
+	test_flush_workqueue(0);
+	test_flush_workqueue(WQ_F_WORK_STEALING);
+	test_flush_workqueue_keyed();
+	return 0;
+}
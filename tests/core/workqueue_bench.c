@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Scaling benchmark for the workqueue, classic vs WQ_F_WORK_STEALING.
+ *
+ * The flat run queues a batch of small works from the main thread, so
+ * every work goes through the lanes. The tree run starts from a single
+ * work that queues two children until the depth runs out, like a
+ * fork-join program does; in work-stealing mode the children go to the
+ * deque of the worker that queued them.
+ *
+ * The ctx run queues works with a 48 byte context each, allocated by
+ * the caller and freed by the deleter, or copied inline with
+ * queue_work_inline().
+ *
+ * All runs go from 1 to 64 threads. The numbers only mean something on
+ * a machine with at least as many cores as threads.
+ */
+
+#undef NDEBUG
+#include <gw/common.h>
+#include <gw/workqueue.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+enum {
+	NR_FLAT = 200000,
+	FLAT_BATCH = 256,
+	TREE_DEPTH = 16,
+	WORK_SPIN = 200,
+};
+
+static struct workqueue_struct *tree_wq;
+static atomic_uint nr_done;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void spin(void)
+{
+	volatile uint32_t x = 0;
+	uint32_t i;
+
+	for (i = 0; i < WORK_SPIN; i++)
+		x += i;
+}
+
+static void flat_work(void *arg)
+{
+	(void)arg;
+	spin();
+}
+
+struct bench_ctx {
+	uint64_t	words[6];
+};
+
+static void ctx_work(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+
+	spin();
+	assert(ctx->words[5] == 5);
+}
+
+static void tree_work(void *arg)
+{
+	uintptr_t depth = (uintptr_t)arg;
+	int ret;
+
+	spin();
+	if (depth) {
+		ret = queue_work(tree_wq, tree_work, (void *)(depth - 1), NULL);
+		assert(ret == 0);
+		ret = queue_work(tree_wq, tree_work, (void *)(depth - 1), NULL);
+		assert(ret == 0);
+	}
+	atomic_fetch_add_explicit(&nr_done, 1u, memory_order_relaxed);
+}
+
+/*
+ * The lanes can hold the whole tree. Otherwise a classic workqueue can
+ * deadlock with all the workers waiting for room to queue children.
+ */
+static struct workqueue_struct *alloc_bench_wq(uint32_t nr_threads,
+					       uint64_t flags)
+{
+	struct workqueue_attr attr = {
+		.name = "bench",
+		.max_threads = nr_threads,
+		.min_threads = nr_threads,
+		.max_pending_works = 1u << (TREE_DEPTH + 1),
+		.flags = flags,
+	};
+	struct workqueue_struct *wq;
+	int ret;
+
+	ret = alloc_workqueue(&wq, &attr);
+	assert(ret == 0);
+	return wq;
+}
+
+static void print_result(const char *name, uint64_t flags, uint32_t nr_threads,
+			 uint64_t nr, uint64_t start, uint64_t end)
+{
+	printf("%-4s %-8s threads=%-3u works=%-7llu time=%-8.3fms "
+	       "rate=%.0f works/s\n", name,
+	       (flags & WQ_F_WORK_STEALING) ? "stealing" : "classic",
+	       nr_threads, (unsigned long long)nr, (double)(end - start) / 1e6,
+	       (double)nr * 1e9 / (double)(end - start));
+}
+
+static void bench_flat(uint32_t nr_threads, uint64_t flags)
+{
+	static void *args[FLAT_BATCH];
+	struct workqueue_struct *wq;
+	uint64_t start, end;
+	uint32_t queued = 0;
+	int ret;
+
+	wq = alloc_bench_wq(nr_threads, flags);
+	start = now_ns();
+	while (queued < NR_FLAT) {
+		ret = queue_work_batch(wq, flat_work, args, FLAT_BATCH, NULL);
+		assert(ret > 0);
+		queued += (uint32_t)ret;
+	}
+	wait_all_work_done(wq);
+	end = now_ns();
+
+	print_result("flat", flags, nr_threads, queued, start, end);
+	destroy_workqueue(wq);
+}
+
+static void bench_ctx(uint32_t nr_threads, bool use_inline)
+{
+	struct workqueue_struct *wq;
+	struct bench_ctx ctx, *p;
+	uint64_t start, end;
+	uint32_t i;
+	int ret;
+
+	for (i = 0; i < 6; i++)
+		ctx.words[i] = i;
+
+	wq = alloc_bench_wq(nr_threads, 0);
+	start = now_ns();
+	for (i = 0; i < NR_FLAT; i++) {
+		if (use_inline) {
+			ret = queue_work_inline(wq, ctx_work, &ctx, sizeof(ctx));
+		} else {
+			p = malloc(sizeof(*p));
+			assert(p);
+			memcpy(p, &ctx, sizeof(*p));
+			ret = queue_work(wq, ctx_work, p, free);
+		}
+		assert(ret == 0);
+	}
+	wait_all_work_done(wq);
+	end = now_ns();
+
+	printf("ctx  %-8s threads=%-3u works=%-7u time=%-8.3fms "
+	       "rate=%.0f works/s\n", use_inline ? "inline" : "malloc",
+	       nr_threads, (unsigned)NR_FLAT, (double)(end - start) / 1e6,
+	       (double)NR_FLAT * 1e9 / (double)(end - start));
+	destroy_workqueue(wq);
+}
+
+static void bench_tree(uint32_t nr_threads, uint64_t flags)
+{
+	const uint32_t nr = (1u << (TREE_DEPTH + 1)) - 1u;
+	uint64_t start, end;
+	int ret;
+
+	tree_wq = alloc_bench_wq(nr_threads, flags);
+	atomic_store(&nr_done, 0u);
+	start = now_ns();
+	ret = queue_work(tree_wq, tree_work, (void *)(uintptr_t)TREE_DEPTH,
+			 NULL);
+	assert(ret == 0);
+
+	/*
+	 * Can't use wait_all_work_done() here, it would block the
+	 * workers queueing the children.
+	 */
+	while (atomic_load(&nr_done) < nr)
+		sched_yield();
+	end = now_ns();
+
+	print_result("tree", flags, nr_threads, nr, start, end);
+	destroy_workqueue(tree_wq);
+}
+
+int main(void)
+{
+	uint32_t nr_threads;
+
+	for (nr_threads = 1; nr_threads <= 64; nr_threads *= 2) {
+		bench_flat(nr_threads, 0);
+		bench_flat(nr_threads, WQ_F_WORK_STEALING);
+		bench_tree(nr_threads, 0);
+		bench_tree(nr_threads, WQ_F_WORK_STEALING);
+		bench_ctx(nr_threads, false);
+		bench_ctx(nr_threads, true);
+	}
+	return 0;
+}